@@ -9,17 +9,23 @@
 ***************************************************************************/
 
 #include <ITKUtils.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <Dispatch.hpp>
 #include <itkImage.h>
 #include <itkAdaptiveHistogramEqualizationImageFilter.h>
 
 
 template<typename ImageType>
-void AdaptiveHistogramEqualization(int argc, char *argv[])
+void AdaptiveHistogramEqualization(int argc, char *argv[], Profiler &profiler)
 {
     using AdaptiveHistogramEqualizationImageFilterType = itk::AdaptiveHistogramEqualizationImageFilter<ImageType>;
 
     // Read image
+    profiler.Start("read");
     typename ImageType::Pointer image = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
+    profiler.Start("compute");
     // Default radius, alpha and beta parameters
     unsigned int radius = 3;
     double alpha = 0.8;
@@ -37,21 +43,30 @@ void AdaptiveHistogramEqualization(int argc, char *argv[])
     filter->SetRadius(radius);
     filter->SetAlpha(alpha);
     filter->SetBeta(beta);
+    filter->Update();
     // Save image
+    profiler.Start("write");
     ITKUtils::WriteNIfTIImage<ImageType>(filter->GetOutput(), std::string(argv[2]));
+    profiler.Stop();
 }
 
 int main(int argc, char *argv[])
 {
+    CommandLineOptions options(argc, argv);
     if (argc < 3)
     {
-        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: AdaptiveHistogramEqualization inputImage outputImage [radius=3] [alpha=0.8] [beta=1]" << std::endl;
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: AdaptiveHistogramEqualization inputImage outputImage [radius=3] [alpha=0.8] [beta=1] [--cache=directory] [--profile=json|text]" << std::endl;
         return EXIT_FAILURE;
     }
 
     typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
     const unsigned int ImageDimension = imageIO->GetNumberOfDimensions();
 
+    Profiler profiler("AdaptiveHistogramEqualization", options.Get("profile"));
+    profiler.SetImageInformation(imageIO);
+    profiler.AddInput(std::string(argv[1]));
+    ResultCache cache(options.Get("cache"), "AdaptiveHistogramEqualization");
+
     if (ImageDimension < 2 || ImageDimension > 4)
     {
         std::cerr << "Unsupported image dimensions" << std::endl;
@@ -60,12 +75,26 @@ int main(int argc, char *argv[])
 
     try
     {
-        if (ImageDimension == 2)
-            AdaptiveHistogramEqualization<itk::Image<float, 2>>(argc, argv);
-        else if (ImageDimension == 3)
-            AdaptiveHistogramEqualization<itk::Image<float, 3>>(argc, argv);
-        else
-            AdaptiveHistogramEqualization<itk::Image<float, 4>>(argc, argv);
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        cache.AddInput(std::string(argv[1]));
+        cache.AddParameters(3, argc, argv);
+        cache.AddOptions(options);
+        cache.AddOutput(std::string(argv[2]));
+        if (cache.Fetch())
+        {
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        Dispatch::ByDimension<2, 3, 4>(ImageDimension, [&](auto dimension)
+        {
+            AdaptiveHistogramEqualization<itk::Image<float, decltype(dimension)::value>>(argc, argv, profiler);
+        });
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
     }
     catch (itk::ExceptionObject & err)
     {
@@ -73,6 +102,14 @@ int main(int argc, char *argv[])
         std::cerr << err << std::endl;
         return EXIT_FAILURE;
     }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -9,92 +9,134 @@
 ***************************************************************************/
 
 #include <ITKUtils.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <Dispatch.hpp>
+#include <NIfTIUtils.hpp>
+#include <WorkPartitioner.hpp>
 #include <itkImage.h>
-#include <itkRescaleIntensityImageFilter.h>
-#include <itkCastImageFilter.h>
+#include <itkVectorImage.h>
+#include <algorithm>
+#include <limits>
 
 
 template<typename InputImageType, typename OutputImageType>
-void _CastImage(int argc, char *argv [])
+void _CastImage(int argc, char *argv [], Profiler &profiler)
 {
+    typedef typename InputImageType::InternalPixelType InputPixelType;
+    typedef typename OutputImageType::InternalPixelType OutputPixelType;
     bool rescaleIntensity = true;
-    float minimum;
-    float maximum;
+    float minimum = 0;
+    float maximum = (float) itk::NumericTraits<OutputPixelType>::max();
     if (argc > 4)
-    {
         rescaleIntensity = (bool) std::atoi(argv[4]);
-        minimum = (argc > 5) ? std::atof(argv[5]) : 0;
-        maximum = (argc > 6) ? std::atof(argv[6]) : (float) itk::NumericTraits<typename OutputImageType::PixelType>::max();
-    }
+    if (argc > 5)
+        minimum = std::atof(argv[5]);
+    if (argc > 6)
+        maximum = std::atof(argv[6]);
     
     // Read image (InputImageType is float for a correct intensity rescaling)
+    profiler.Start("read");
     typename InputImageType::Pointer image = ITKUtils::ReadNIfTIImage<InputImageType>(std::string(argv[1]));
+    profiler.Start("compute");
+    const InputPixelType *buffer = image->GetBufferPointer();
+    // The interleaved components of a vector image are rescaled together
+    const unsigned int components = image->GetNumberOfComponentsPerPixel();
+    const long long voxels = (long long) image->GetBufferedRegion().GetNumberOfPixels() * components;
+    const long long unitLength = WorkPartitioner::UnitLength<InputImageType>(image) * components;
 
-    // Cast filter
-    using FilterType = itk::CastImageFilter<InputImageType, OutputImageType>;
-    typename FilterType::Pointer filter = FilterType::New();
-
-    // Rescale filter if required
+    // Linear intensity map of the rescaling (as itk::RescaleIntensityImageFilter)
+    double scale = 1;
+    double shift = 0;
     if (rescaleIntensity)
     {
-        using RescaleType = itk::RescaleIntensityImageFilter<InputImageType, InputImageType>;
-        typename RescaleType::Pointer rescale = RescaleType::New();
-        rescale->SetInput(image);
-        rescale->SetOutputMinimum(minimum);
-        rescale->SetOutputMaximum(maximum);
-        rescale->Update();
-        filter->SetInput(rescale->GetOutput());
+        double imageMinimum = std::numeric_limits<double>::max();
+        double imageMaximum = std::numeric_limits<double>::lowest();
+        WorkPartitioner::ParallelFor(voxels, unitLength, [&](long long begin, long long end)
+        {
+            const std::pair<const InputPixelType *, const InputPixelType *> range = std::minmax_element(buffer + begin, buffer + end);
+            #pragma omp critical
+            {
+                imageMinimum = std::min(imageMinimum, (double) *range.first);
+                imageMaximum = std::max(imageMaximum, (double) *range.second);
+            }
+        });
+        if (imageMinimum != imageMaximum)
+            scale = ((double) maximum - minimum) / (imageMaximum - imageMinimum);
+        else if (imageMaximum != 0)
+            scale = ((double) maximum - minimum) / imageMaximum;
+        else
+            scale = 0;
+        shift = minimum - imageMinimum * scale;
     }
-    else
+
+    // Rescale and cast in a single pass, first touching every output chunk from the thread that writes it
+    typename OutputImageType::Pointer output = OutputImageType::New();
+    output->CopyInformation(image);
+    output->SetRegions(image->GetBufferedRegion());
+    output->SetNumberOfComponentsPerPixel(components);
+    output->Allocate(false);
+    OutputPixelType *outputBuffer = output->GetBufferPointer();
+    WorkPartitioner::ParallelFor(voxels, unitLength, [&](long long begin, long long end)
     {
-        filter->SetInput(image);
-    }
-    filter->Update();
+        if (rescaleIntensity)
+        {
+            for (long long i = begin; i < end; ++i)
+                outputBuffer[i] = static_cast<OutputPixelType>((float) std::max<double>(minimum, std::min<double>(maximum, buffer[i] * scale + shift)));
+        }
+        else
+        {
+            for (long long i = begin; i < end; ++i)
+                outputBuffer[i] = static_cast<OutputPixelType>(buffer[i]);
+        }
+    });
     // Save image
-    ITKUtils::WriteNIfTIImage<OutputImageType>(filter->GetOutput(), std::string(argv[2]));
+    profiler.Start("write");
+    if (components > 1)
+        NIfTIUtils::WriteNIfTIImage<OutputImageType>(output, std::string(argv[2]), NIfTIUtils::ReadTimeStep(std::string(argv[1])));
+    else
+        ITKUtils::WriteNIfTIImage<OutputImageType>(output, std::string(argv[2]));
+    profiler.Stop();
 }
 
 
 template<typename InputImageType>
-void CastImage(int argc, char *argv [])
+void _CastImageScaledShort(int argc, char *argv [], Profiler &profiler)
+{
+    // Read image
+    profiler.Start("read");
+    typename InputImageType::Pointer image = ITKUtils::ReadNIfTIImage<InputImageType>(std::string(argv[1]));
+    // Save image as int16 with the scl_slope/scl_inter that preserve its intensity range
+    profiler.Start("write");
+    NIfTIUtils::WriteScaledNIfTIImage<InputImageType>(image, std::string(argv[2]), NIfTIUtils::ReadTimeStep(std::string(argv[1])));
+    profiler.Stop();
+}
+
+
+template<typename InputImageType>
+void CastImage(int argc, char *argv [], Profiler &profiler)
 {
     // Read pixel type
     const unsigned int type = (unsigned int) std::atoi(argv[3]);
 
-    if (type == 0)
-        _CastImage<InputImageType, itk::Image<float, InputImageType::ImageDimension>>(argc, argv);
-    else if (type == 1)
-        _CastImage<InputImageType, itk::Image<unsigned char, InputImageType::ImageDimension>>(argc, argv);
-    else if (type == 2)
-        _CastImage<InputImageType, itk::Image<unsigned short, InputImageType::ImageDimension>>(argc, argv);
-    else if (type == 3)
-        _CastImage<InputImageType, itk::Image<unsigned int, InputImageType::ImageDimension>>(argc, argv);
-    else if (type == 4)
-        _CastImage<InputImageType, itk::Image<unsigned long, InputImageType::ImageDimension>>(argc, argv);
-    else if (type == 5)
-        _CastImage<InputImageType, itk::Image<char, InputImageType::ImageDimension>>(argc, argv);
-    else if (type == 6)
-        _CastImage<InputImageType, itk::Image<short, InputImageType::ImageDimension>>(argc, argv);
-    else if (type == 7)
-        _CastImage<InputImageType, itk::Image<int, InputImageType::ImageDimension>>(argc, argv);
-    else if (type == 8)
-        _CastImage<InputImageType, itk::Image<long, InputImageType::ImageDimension>>(argc, argv);
-    else if (type == 9)
-        _CastImage<InputImageType, itk::Image<double, InputImageType::ImageDimension>>(argc, argv);
+    if (type == Dispatch::CastPixelTypes::size)
+        _CastImageScaledShort<InputImageType>(argc, argv, profiler);
     else
-    {
-        std::stringstream s;
-        s << "Unsupported data type" << std::endl;
-        throw std::runtime_error(s.str());
-    }
+        Dispatch::ByIndex(Dispatch::CastPixelTypes(), type, [&](auto pixel)
+        {
+            // Same kind of image (scalar or vector) as the input
+            _CastImage<InputImageType, typename InputImageType::template Rebind<typename decltype(pixel)::type>::Type>(argc, argv, profiler);
+        });
 }
 
 
 int main(int argc, char *argv [])
 {
+    CommandLineOptions options(argc, argv);
     if (argc < 4)
     {
-        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: CastImage inputImage outputImage pixelType [rescaleIntensity=1] [minimum=0] [maximum=MAX]" << std::endl;
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: CastImage inputImage outputImage pixelType [rescaleIntensity=1] [minimum=0] [maximum=MAX] [--pin] [--cache=directory] [--profile=json|text]" << std::endl;
         std::cerr << "pixelType:\t0 -> float" << std::endl;
         std::cerr << "\t\t1 -> unsigned char" << std::endl;
         std::cerr << "\t\t2 -> unsigned short" << std::endl;
@@ -105,11 +147,21 @@ int main(int argc, char *argv [])
         std::cerr << "\t\t7 -> int" << std::endl;
         std::cerr << "\t\t8 -> long" << std::endl;
         std::cerr << "\t\t9 -> double" << std::endl;
+        std::cerr << "\t\t10 -> short with scl_slope/scl_inter (intensity range preserved, rescaleIntensity ignored)" << std::endl;
+        std::cerr << "Vector images keep their components, rescaled with a common intensity range" << std::endl;
         return EXIT_FAILURE;
     }
 
     typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
     const unsigned int ImageDimension = imageIO->GetNumberOfDimensions();
+    const unsigned int Components = imageIO->GetNumberOfComponents();
+
+    Profiler profiler("CastImage", options.Get("profile"));
+    profiler.SetImageInformation(imageIO);
+    profiler.AddInput(std::string(argv[1]));
+    ResultCache cache(options.Get("cache"), "CastImage");
+    if (options.Has("pin"))
+        WorkPartitioner::PinThreads();
 
     if (ImageDimension < 2 || ImageDimension > 4)
     {
@@ -119,12 +171,29 @@ int main(int argc, char *argv [])
 
     try
     {
-        if (ImageDimension == 2)
-            CastImage<itk::Image<float, 2>>(argc, argv);
-        else if (ImageDimension == 3)
-            CastImage<itk::Image<float, 3>>(argc, argv);
-        else
-            CastImage<itk::Image<float, 4>>(argc, argv);
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        cache.AddInput(std::string(argv[1]));
+        cache.AddParameters(3, argc, argv);
+        cache.AddOptions(options);
+        cache.AddOutput(std::string(argv[2]));
+        if (cache.Fetch())
+        {
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        Dispatch::ByDimension<2, 3, 4>(ImageDimension, [&](auto dimension)
+        {
+            if (Components > 1)
+                CastImage<itk::VectorImage<float, decltype(dimension)::value>>(argc, argv, profiler);
+            else
+                CastImage<itk::Image<float, decltype(dimension)::value>>(argc, argv, profiler);
+        });
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
     }
     catch (itk::ExceptionObject & err)
     {
@@ -132,6 +201,14 @@ int main(int argc, char *argv [])
         std::cerr << err << std::endl;
         return EXIT_FAILURE;
     }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,368 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Chunked storage of 3D/4D voxel data                                      *
+***************************************************************************/
+
+#ifndef CHUNKEDIMAGE_HPP
+#define CHUNKEDIMAGE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <itk_zlib.h>
+
+/*
+ * Container of the voxel data of a 3D or 4D scalar image cut into chunks of
+ * chunk[0] x chunk[1] x chunk[2] voxels by chunk[3] time points, each one
+ * deflated independently. Chunks are compressed and inflated in parallel and
+ * a region (a sub-volume, a slab of time points) only inflates the chunks it
+ * overlaps, instead of the full sequential inflate of a .nii.gz file.
+ *
+ * File layout: a fixed header (magic, byte order mark, bytes per voxel, image
+ * and chunk sizes), the compressed chunks with x tiles fastest and time blocks
+ * slowest, and the table of chunk offsets and sizes followed by its own
+ * offset. The table is written last, so whole time blocks are appended as
+ * they are produced. Voxels are stored in native byte order. The geometry and
+ * datatype live in a NIfTI header sidecar (see NIfTIUtils).
+ */
+namespace ChunkedImage
+{
+    const char Magic[8] = {'O', 'N', 'T', 's', 'C', 'H', 'K', '1'};
+    const std::uint32_t ByteOrderMark = 0x01020304;
+
+    // Parse a chunk shape "x,y,z,t" (missing sizes keep the defaults 64,64,16,8)
+    inline void ParseChunk(const std::string &spec, long long chunk[4])
+    {
+        const long long defaults[4] = {64, 64, 16, 8};
+        std::istringstream s(spec);
+        std::string item;
+        for (unsigned int i = 0; i < 4; ++i)
+        {
+            chunk[i] = defaults[i];
+            if (std::getline(s, item, ',') && !item.empty())
+                chunk[i] = std::atoll(item.c_str());
+            if (chunk[i] < 1)
+                throw std::runtime_error("Invalid chunk shape: " + spec);
+        }
+    }
+
+    // Image and chunk sizes, and the box of every chunk
+    struct Layout
+    {
+        std::int64_t size[4];
+        std::int64_t chunk[4];
+        std::int64_t count[4];
+        std::int32_t bytes;
+
+        Layout() : bytes(0)
+        {
+            for (unsigned int i = 0; i < 4; ++i)
+                size[i] = chunk[i] = count[i] = 1;
+        }
+
+        Layout(const long long imageSize[4], const long long chunkSize[4], int voxelBytes) : bytes(voxelBytes)
+        {
+            for (unsigned int i = 0; i < 4; ++i)
+            {
+                size[i] = imageSize[i];
+                chunk[i] = std::min<long long>(chunkSize[i], std::max<long long>(1, imageSize[i]));
+            }
+            Count();
+        }
+
+        void Count()
+        {
+            for (unsigned int i = 0; i < 4; ++i)
+                count[i] = (size[i] + chunk[i] - 1) / chunk[i];
+        }
+
+        long long Chunks() const
+        {
+            return count[0] * count[1] * count[2] * count[3];
+        }
+
+        // Chunks of one time block
+        long long ChunksPerBlock() const
+        {
+            return count[0] * count[1] * count[2];
+        }
+
+        // First voxel and extent of a chunk (clipped at the image borders)
+        void Box(long long c, long long first[4], long long extent[4]) const
+        {
+            for (unsigned int i = 0; i < 4; ++i)
+            {
+                first[i] = (c % count[i]) * chunk[i];
+                extent[i] = std::min<long long>(chunk[i], size[i] - first[i]);
+                c /= count[i];
+            }
+        }
+
+        long long Voxels(long long c) const
+        {
+            long long first[4], extent[4];
+            Box(c, first, extent);
+            return extent[0] * extent[1] * extent[2] * extent[3];
+        }
+    };
+
+
+    /*
+     * Writes whole time blocks of an image in order. The chunks of every
+     * block are gathered and deflated by the threads, then appended.
+     */
+    class Writer
+    {
+    public:
+        Writer(const std::string &fileName, const Layout &layout, int level = Z_BEST_SPEED) : m_FileName(fileName), m_Layout(layout), m_Level(level), m_Volumes(0)
+        {
+            m_File = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0664);
+            if (m_File < 0)
+                throw std::runtime_error("Unable to write file: " + fileName);
+            Append(Magic, sizeof(Magic));
+            Append(&ByteOrderMark, sizeof(ByteOrderMark));
+            Append(&m_Layout.bytes, sizeof(m_Layout.bytes));
+            Append(m_Layout.size, sizeof(m_Layout.size));
+            Append(m_Layout.chunk, sizeof(m_Layout.chunk));
+            m_Offset = (std::uint64_t) (sizeof(Magic) + sizeof(ByteOrderMark) + sizeof(m_Layout.bytes) + sizeof(m_Layout.size) + sizeof(m_Layout.chunk));
+        }
+
+        ~Writer()
+        {
+            if (m_File >= 0)
+                close(m_File);
+        }
+
+        /*
+         * Append volumes [firstVolume, firstVolume + volumes) of raw voxels
+         * (x fastest). They must start a time block and hold whole blocks,
+         * except for the last volumes of the image.
+         */
+        void WriteVolumes(const void *data, long long firstVolume, long long volumes)
+        {
+            if (firstVolume != m_Volumes || firstVolume % m_Layout.chunk[3] != 0)
+                throw std::runtime_error("Chunked images are written in whole time blocks: " + m_FileName);
+            if (firstVolume + volumes != m_Layout.size[3] && volumes % m_Layout.chunk[3] != 0)
+                throw std::runtime_error("Chunked images are written in whole time blocks: " + m_FileName);
+            if (firstVolume + volumes > m_Layout.size[3])
+                throw std::runtime_error("Too many volumes written to " + m_FileName);
+            const long long begin = (firstVolume / m_Layout.chunk[3]) * m_Layout.ChunksPerBlock();
+            const long long end = std::min(m_Layout.Chunks(), ((firstVolume + volumes + m_Layout.chunk[3] - 1) / m_Layout.chunk[3]) * m_Layout.ChunksPerBlock());
+            const char *voxels = static_cast<const char *>(data);
+            const long long bytes = m_Layout.bytes;
+            const long long rowStride = m_Layout.size[0];
+            const long long sliceStride = rowStride * m_Layout.size[1];
+            const long long volumeStride = sliceStride * m_Layout.size[2];
+            std::vector<std::vector<Bytef>> compressed(end - begin);
+            int status = Z_OK;
+            #pragma omp parallel for schedule(dynamic)
+            for (long long c = begin; c < end; ++c)
+            {
+                long long first[4], extent[4];
+                m_Layout.Box(c, first, extent);
+                // Gather the rows of the chunk
+                std::vector<char> chunk(extent[0] * extent[1] * extent[2] * extent[3] * bytes);
+                char *target = chunk.data();
+                for (long long t = 0; t < extent[3]; ++t)
+                    for (long long z = 0; z < extent[2]; ++z)
+                        for (long long y = 0; y < extent[1]; ++y)
+                        {
+                            const long long source = (first[3] + t - firstVolume) * volumeStride + (first[2] + z) * sliceStride + (first[1] + y) * rowStride + first[0];
+                            std::memcpy(target, voxels + source * bytes, extent[0] * bytes);
+                            target += extent[0] * bytes;
+                        }
+                std::vector<Bytef> &output = compressed[c - begin];
+                uLongf length = compressBound((uLong) chunk.size());
+                output.resize(length);
+                const int result = compress2(output.data(), &length, reinterpret_cast<const Bytef *>(chunk.data()), (uLong) chunk.size(), m_Level);
+                output.resize(length);
+                if (result != Z_OK)
+                {
+                    #pragma omp critical
+                    status = result;
+                }
+            }
+            if (status != Z_OK)
+                throw std::runtime_error("Unable to compress chunk of " + m_FileName);
+            for (std::size_t i = 0; i < compressed.size(); ++i)
+            {
+                m_Table.push_back(m_Offset);
+                m_Table.push_back(compressed[i].size());
+                Append(compressed[i].data(), compressed[i].size());
+            }
+            m_Volumes += volumes;
+        }
+
+        // Write the chunk table. Every volume must have been written
+        void Close()
+        {
+            if (m_Volumes != m_Layout.size[3])
+                throw std::runtime_error("Incomplete image written to " + m_FileName);
+            const std::uint64_t tableOffset = m_Offset;
+            Append(m_Table.data(), m_Table.size() * sizeof(std::uint64_t));
+            Append(&tableOffset, sizeof(tableOffset));
+            if (close(m_File) != 0)
+                throw std::runtime_error("Unable to write file: " + m_FileName);
+            m_File = -1;
+        }
+
+    private:
+        Writer(const Writer &);
+        Writer &operator=(const Writer &);
+
+        void Append(const void *data, std::size_t length)
+        {
+            const char *bytes = static_cast<const char *>(data);
+            std::size_t written = 0;
+            while (written < length)
+            {
+                const ssize_t result = write(m_File, bytes + written, length - written);
+                if (result <= 0)
+                    throw std::runtime_error("Unable to write file: " + m_FileName);
+                written += (std::size_t) result;
+            }
+            m_Offset += length;
+        }
+
+        std::string m_FileName;
+        Layout m_Layout;
+        int m_Level;
+        int m_File;
+        std::uint64_t m_Offset;
+        long long m_Volumes;
+        std::vector<std::uint64_t> m_Table;
+    };
+
+
+    /*
+     * Reads boxes of a chunked image. The overlapping chunks are read with
+     * pread and inflated by the threads, each copying its part of the box.
+     */
+    class Reader
+    {
+    public:
+        Reader(const std::string &fileName) : m_FileName(fileName)
+        {
+            m_File = open(fileName.c_str(), O_RDONLY);
+            if (m_File < 0)
+                throw std::runtime_error("Unable to read file: " + fileName);
+            char magic[sizeof(Magic)];
+            std::uint32_t byteOrder = 0;
+            std::uint64_t offset = 0;
+            Read(magic, sizeof(magic), offset);
+            Read(&byteOrder, sizeof(byteOrder), offset);
+            Read(&m_Layout.bytes, sizeof(m_Layout.bytes), offset);
+            Read(m_Layout.size, sizeof(m_Layout.size), offset);
+            Read(m_Layout.chunk, sizeof(m_Layout.chunk), offset);
+            if (std::memcmp(magic, Magic, sizeof(Magic)) != 0)
+                throw std::runtime_error("Not a chunked image: " + fileName);
+            if (byteOrder != ByteOrderMark)
+                throw std::runtime_error("Chunked image written with another byte order: " + fileName);
+            m_Layout.Count();
+            // Chunk table, located by the last 8 bytes of the file
+            const off_t end = lseek(m_File, 0, SEEK_END);
+            std::uint64_t tableOffset = 0;
+            offset = (std::uint64_t) end - sizeof(tableOffset);
+            Read(&tableOffset, sizeof(tableOffset), offset);
+            m_Table.resize(2 * m_Layout.Chunks());
+            Read(m_Table.data(), m_Table.size() * sizeof(std::uint64_t), tableOffset);
+        }
+
+        ~Reader()
+        {
+            close(m_File);
+        }
+
+        const Layout &GetLayout() const
+        {
+            return m_Layout;
+        }
+
+        // Copy the raw voxels of the box [first, first + extent) to output (x fastest)
+        void ReadBox(const long long first[4], const long long extent[4], void *output) const
+        {
+            // Chunks overlapping the box
+            long long low[4], high[4];
+            for (unsigned int i = 0; i < 4; ++i)
+            {
+                if (extent[i] < 1 || first[i] < 0 || first[i] + extent[i] > m_Layout.size[i])
+                    throw std::runtime_error("The requested region is outside the image: " + m_FileName);
+                low[i] = first[i] / m_Layout.chunk[i];
+                high[i] = (first[i] + extent[i] - 1) / m_Layout.chunk[i];
+            }
+            std::vector<long long> chunks;
+            for (long long t = low[3]; t <= high[3]; ++t)
+                for (long long z = low[2]; z <= high[2]; ++z)
+                    for (long long y = low[1]; y <= high[1]; ++y)
+                        for (long long x = low[0]; x <= high[0]; ++x)
+                            chunks.push_back(((t * m_Layout.count[2] + z) * m_Layout.count[1] + y) * m_Layout.count[0] + x);
+            char *voxels = static_cast<char *>(output);
+            const long long bytes = m_Layout.bytes;
+            bool failed = false;
+            #pragma omp parallel for schedule(dynamic)
+            for (long long i = 0; i < (long long) chunks.size(); ++i)
+            {
+                const long long c = chunks[i];
+                long long chunkFirst[4], chunkExtent[4];
+                m_Layout.Box(c, chunkFirst, chunkExtent);
+                std::vector<Bytef> compressed(m_Table[2 * c + 1]);
+                std::vector<char> chunk(chunkExtent[0] * chunkExtent[1] * chunkExtent[2] * chunkExtent[3] * bytes);
+                uLongf length = (uLongf) chunk.size();
+                if (pread(m_File, compressed.data(), compressed.size(), (off_t) m_Table[2 * c]) != (ssize_t) compressed.size() ||
+                    uncompress(reinterpret_cast<Bytef *>(chunk.data()), &length, compressed.data(), (uLong) compressed.size()) != Z_OK || length != chunk.size())
+                {
+                    #pragma omp critical
+                    failed = true;
+                    continue;
+                }
+                // Intersection of the chunk and the box, copied row by row
+                long long begin[4], count[4];
+                for (unsigned int d = 0; d < 4; ++d)
+                {
+                    begin[d] = std::max(first[d], chunkFirst[d]);
+                    count[d] = std::min(first[d] + extent[d], chunkFirst[d] + chunkExtent[d]) - begin[d];
+                }
+                for (long long t = 0; t < count[3]; ++t)
+                    for (long long z = 0; z < count[2]; ++z)
+                        for (long long y = 0; y < count[1]; ++y)
+                        {
+                            const long long source = (((begin[3] + t - chunkFirst[3]) * chunkExtent[2] + begin[2] + z - chunkFirst[2]) * chunkExtent[1] + begin[1] + y - chunkFirst[1]) * chunkExtent[0] + begin[0] - chunkFirst[0];
+                            const long long target = (((begin[3] + t - first[3]) * extent[2] + begin[2] + z - first[2]) * extent[1] + begin[1] + y - first[1]) * extent[0] + begin[0] - first[0];
+                            std::memcpy(voxels + target * bytes, chunk.data() + source * bytes, count[0] * bytes);
+                        }
+            }
+            if (failed)
+                throw std::runtime_error("Invalid chunk in " + m_FileName);
+        }
+
+    private:
+        Reader(const Reader &);
+        Reader &operator=(const Reader &);
+
+        void Read(void *data, std::size_t length, std::uint64_t &offset) const
+        {
+            if (pread(m_File, data, length, (off_t) offset) != (ssize_t) length)
+                throw std::runtime_error("Unexpected end of chunked image: " + m_FileName);
+            offset += length;
+        }
+
+        std::string m_FileName;
+        int m_File;
+        Layout m_Layout;
+        std::vector<std::uint64_t> m_Table;
+    };
+}
+
+#endif
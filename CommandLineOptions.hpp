@@ -0,0 +1,66 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Command line options                                                     *
+***************************************************************************/
+
+#ifndef COMMANDLINEOPTIONS_HPP
+#define COMMANDLINEOPTIONS_HPP
+
+#include <map>
+#include <string>
+
+/*
+ * Extracts the optional "--key[=value]" arguments from the command line and
+ * removes them from argv, so the positional arguments of every tool keep their
+ * original indices regardless of where the options were placed.
+ */
+class CommandLineOptions
+{
+public:
+    CommandLineOptions(int &argc, char *argv[])
+    {
+        int positional = 1;
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string argument(argv[i]);
+            if (argument.size() > 2 && argument.compare(0, 2, "--") == 0)
+            {
+                const std::size_t separator = argument.find('=');
+                if (separator == std::string::npos)
+                    m_Options[argument.substr(2)] = "";
+                else
+                    m_Options[argument.substr(2, separator - 2)] = argument.substr(separator + 1);
+            }
+            else
+                argv[positional++] = argv[i];
+        }
+        argc = positional;
+        argv[argc] = NULL;
+    }
+
+    bool Has(const std::string &key) const
+    {
+        return m_Options.find(key) != m_Options.end();
+    }
+
+    std::string Get(const std::string &key, const std::string &defaultValue = "") const
+    {
+        std::map<std::string, std::string>::const_iterator it = m_Options.find(key);
+        return (it == m_Options.end() || it->second.empty()) ? defaultValue : it->second;
+    }
+
+    const std::map<std::string, std::string> &All() const
+    {
+        return m_Options;
+    }
+
+private:
+    std::map<std::string, std::string> m_Options;
+};
+
+#endif
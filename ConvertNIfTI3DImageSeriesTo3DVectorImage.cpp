@@ -12,9 +12,17 @@
 #include <itkDirectory.h>
 #include <itkNiftiImageIOFactory.h>
 #include <itkImageFileReader.h>
-#include <itkImageFileWriter.h>
 #include <itkComposeImageFilter.h>
 #include <itkVectorImage.h>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <ImageTypes.hpp>
+#include <MemoryBudget.hpp>
+#include <NIfTIUtils.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
 
 const char PathSeparator =
 #ifdef _WIN32
@@ -25,16 +33,21 @@ const char PathSeparator =
 
 int main(int argc, char *argv[])
 {
+	CommandLineOptions options(argc, argv);
 	if (argc < 3)
 	{
-		std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: ConvertNIfTI3DSeriesTo4D inputDirectory outputFileName [TR=1]" << std::endl;
+		std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: ConvertNIfTI3DSeriesTo4D inputDirectory outputFileName [TR=1] [--timestamps=file] [--max-memory=size] [--cache=directory] [--profile=json|text]" << std::endl;
+		std::cerr << "TR:\t\ttime between volumes, written to pixdim[4]" << std::endl;
+		std::cerr << "--timestamps:\tacquisition time of every volume in seconds, one per line (overrides TR)" << std::endl;
+		std::cerr << "--max-memory:\tmemory budget (e.g. 4G), a series that does not fit is written volume by volume" << std::endl;
 		return EXIT_FAILURE;
 	}
 
+	Profiler profiler("ConvertNIfTI3DImageSeriesTo3DVectorImage", options.Get("profile"));
+
 	typedef itk::VectorImage<float, 3> VectorImageType;
 	typedef itk::Image<float, 3> ScalarImageType;
 	typedef itk::ImageFileReader<ScalarImageType> ImageReader;
-	typedef itk::ImageFileWriter<VectorImageType> ImageWriter;
 	typedef itk::ComposeImageFilter<ScalarImageType> ImageToVectorImageFilterType;
 
 	// Set directory
@@ -48,25 +61,139 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	// Reuse the result of a previous run with the same inputs and parameters
+	ResultCache cache(options.Get("cache"), "ConvertNIfTI3DImageSeriesTo3DVectorImage");
+	try
+	{
+		profiler.Start("cache");
+		cache.AddInput(baseDirectory);
+		if (options.Has("timestamps"))
+			cache.AddInput(options.Get("timestamps"));
+		cache.AddParameters(3, argc, argv);
+		cache.AddOptions(options);
+		cache.AddOutput(std::string(argv[2]));
+		if (cache.Fetch())
+		{
+			profiler.Stop();
+			profiler.Report();
+			return EXIT_SUCCESS;
+		}
+	}
+	catch (std::exception & err)
+	{
+		std::cerr << "Exception caught !" << std::endl;
+		std::cerr << err.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
 	// NIfTI IO Factory
 	itk::NiftiImageIOFactory::RegisterOneFactory();
 
+	// Get file paths in ascending order (the order of the components)
+	std::vector<std::string> imagesFilePaths;
+	for (int i = 0; i < directoryReader->GetNumberOfFiles(); i++)
+	{
+		std::string fileName(directoryReader->GetFile(i));
+		if (fileName == "." || fileName == "..")
+		{
+			continue;
+		}
+		imagesFilePaths.push_back(baseDirectory + PathSeparator + fileName);
+		profiler.AddInput(imagesFilePaths.back());
+	}
+	std::sort(imagesFilePaths.begin(), imagesFilePaths.end());
+
+	// Check the geometry of every volume before decoding any voxel data and get the TR
+	profiler.Start("read");
+	double timeStep = (argc > 3) ? std::atof(argv[3]) : 1;
+	try
+	{
+		NIfTIUtils::ValidateSeriesGeometry(imagesFilePaths);
+		double timeOffset = 0;
+		if (options.Has("timestamps"))
+			NIfTIUtils::ReadTimestamps(options.Get("timestamps"), imagesFilePaths.size(), timeStep, timeOffset);
+		if (timeStep <= 0)
+			throw std::runtime_error("The TR must be positive");
+	}
+	catch (itk::ExceptionObject & err)
+	{
+		std::cerr << "ExceptionObject caught !" << std::endl;
+		std::cerr << err << std::endl;
+		return EXIT_FAILURE;
+	}
+	catch (std::exception & err)
+	{
+		std::cerr << "Exception caught !" << std::endl;
+		std::cerr << err.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// Peak memory: the volumes, the composed vector image and its per-component copy, or a single volume when streamed
+	bool streamed = false;
+	try
+	{
+		const MemoryBudget budget(options.Get("max-memory"));
+		itk::NiftiImageIO::Pointer volumeIO = itk::NiftiImageIO::New();
+		volumeIO->SetFileName(imagesFilePaths[0]);
+		volumeIO->ReadImageInformation();
+		const unsigned long long volumeBytes = MemoryBudget::ImageBytes(volumeIO, sizeof(float));
+		const unsigned long long inMemoryBytes = 3 * volumeBytes * imagesFilePaths.size();
+		streamed = !budget.Fits(inMemoryBytes);
+		if (streamed)
+			budget.Require(volumeBytes, "ConvertNIfTI3DImageSeriesTo3DVectorImage");
+		const std::string plan = streamed ? "streamed volume by volume" : "in memory";
+		budget.Report(plan, streamed ? volumeBytes : inMemoryBytes);
+		profiler.SetMemoryPlan(plan, streamed ? volumeBytes : inMemoryBytes);
+		if (streamed)
+		{
+			// NIfTI stores one volume per component, so every volume is appended as soon as it is read
+			VectorImageType::Pointer geometry = NIfTIUtils::ImageGeometry<VectorImageType>(volumeIO);
+			NIfTIUtils::NIfTIStreamWriter<VectorImageType> writer(geometry, geometry->GetLargestPossibleRegion().GetSize(), std::string(argv[2]), imagesFilePaths.size(), timeStep);
+			for (std::size_t i = 0; i < imagesFilePaths.size(); i++)
+			{
+				profiler.Start("read");
+				ImageReader::Pointer reader = ImageReader::New();
+				reader->SetFileName(imagesFilePaths[i]);
+				reader->Update();
+				profiler.Start("write");
+				writer.Write(reader->GetOutput()->GetBufferPointer(), (long long) reader->GetOutput()->GetBufferedRegion().GetNumberOfPixels());
+			}
+			writer.Close();
+			profiler.SetVoxels(volumeBytes / sizeof(float) * imagesFilePaths.size());
+			// Keep the result for later runs
+			profiler.Start("cache");
+			cache.Store();
+			profiler.Stop();
+		}
+	}
+	catch (itk::ExceptionObject & err)
+	{
+		std::cerr << "ExceptionObject caught !" << std::endl;
+		std::cerr << err << std::endl;
+		return EXIT_FAILURE;
+	}
+	catch (std::exception & err)
+	{
+		std::cerr << "Exception caught !" << std::endl;
+		std::cerr << err.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (streamed)
+	{
+		profiler.Report();
+		return EXIT_SUCCESS;
+	}
+
 	// Load pointers for each 3D file and assign to imageToVectorImageFilter
 	ImageToVectorImageFilterType::Pointer imageToVectorImageFilter = ImageToVectorImageFilterType::New();
 	int index = 0;
-	for (int i = 0; i < directoryReader->GetNumberOfFiles(); i++)
+	for (std::size_t i = 0; i < imagesFilePaths.size(); i++)
 	{
 		// Read image
 		try
 		{
-			std::string fileName(directoryReader->GetFile(i));
-			if (fileName == "." || fileName == "..")
-			{
-				continue;
-			}
-
 			ImageReader::Pointer reader = ImageReader::New();
-			reader->SetFileName(baseDirectory + PathSeparator + directoryReader->GetFile(i));
+			reader->SetFileName(imagesFilePaths[i]);
 			reader->Update();
 			imageToVectorImageFilter->SetInput(index, reader->GetOutput());
 			index++;
@@ -78,15 +205,19 @@ int main(int argc, char *argv[])
 			return EXIT_FAILURE;
 		}
 	}
+	profiler.Start("compute");
 	imageToVectorImageFilter->Update();
+	profiler.SetVoxels(imageToVectorImageFilter->GetOutput()->GetLargestPossibleRegion().GetNumberOfPixels() * index);
 
-	// Save image
-	ImageWriter::Pointer writer = ImageWriter::New();
+	// Save image (through niftilib, as ITK does not store the TR of vector images)
+	profiler.Start("write");
 	try
 	{
-		writer->SetFileName(argv[2]);
-		writer->SetInput(imageToVectorImageFilter->GetOutput());
-		writer->Update();
+		NIfTIUtils::WriteNIfTIImage<VectorImageType>(imageToVectorImageFilter->GetOutput(), std::string(argv[2]), timeStep);
+		// Keep the result for later runs
+		profiler.Start("cache");
+		cache.Store();
+		profiler.Stop();
 	}
 	catch (itk::ExceptionObject & err)
 	{
@@ -94,6 +225,14 @@ int main(int argc, char *argv[])
 		std::cerr << err << std::endl;
 		return EXIT_FAILURE;
 	}
+	catch (std::exception & err)
+	{
+		std::cerr << "Exception caught !" << std::endl;
+		std::cerr << err.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	profiler.Report();
 
 	return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -14,6 +14,12 @@
 #include <itkImageFileWriter.h>
 #include <itkImageSeriesReader.h>
 #include <itkDirectory.h>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <ImageTypes.hpp>
+#include <MemoryBudget.hpp>
+#include <NIfTIUtils.hpp>
 
 const char PathSeparator =
 #ifdef _WIN32
@@ -24,13 +30,21 @@ const char PathSeparator =
 
 int main(int argc, char *argv[])
 {
+	CommandLineOptions options(argc, argv);
 	if (argc < 3)
 	{
-		std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: ConvertNIfTI3DSeriesTo4D inputDirectory outputFileName" << std::endl;
+		std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: ConvertNIfTI3DSeriesTo4D inputDirectory outputFileName [--tr=seconds] [--timestamps=file] [--int16] [--chunked[=x,y,z,t]] [--max-memory=size] [--cache=directory] [--profile=json|text]" << std::endl;
+		std::cerr << "--tr:\t\ttime between volumes, written to pixdim[4] (default: inferred by the series reader, 1 when streamed)" << std::endl;
+		std::cerr << "--timestamps:\tacquisition time of every volume in seconds, one per line (sets the TR and toffset)" << std::endl;
+		std::cerr << "--max-memory:\tmemory budget (e.g. 4G), a series that does not fit is written volume by volume" << std::endl;
+		std::cerr << "--chunked:\twrite a chunked image (outputFileName.nii header and .chunks data) in chunks of x,y,z voxels by t volumes (default 64,64,16,8)" << std::endl;
 		return EXIT_FAILURE;
 	}
 
+	Profiler profiler("ConvertNIfTI3DImageSeriesTo4DImage", options.Get("profile"));
+
 	typedef itk::Image<float, 4> ImageType;
+	typedef itk::Image<float, 3> VolumeType;
 	typedef itk::ImageSeriesReader<ImageType> ImageReader;
 	typedef itk::ImageFileWriter<ImageType> ImageWriter;
 
@@ -48,6 +62,33 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	// Reuse the result of a previous run with the same inputs and parameters
+	ResultCache cache(options.Get("cache"), "ConvertNIfTI3DImageSeriesTo4DImage");
+	try
+	{
+		profiler.Start("cache");
+		cache.AddInput(baseDirectory);
+		if (options.Has("timestamps"))
+			cache.AddInput(options.Get("timestamps"));
+		cache.AddParameters(3, argc, argv);
+		cache.AddOptions(options);
+		cache.AddOutput(std::string(argv[2]));
+		if (options.Has("chunked"))
+			cache.AddOutput(NIfTIUtils::ChunksFileName(std::string(argv[2])));
+		if (cache.Fetch())
+		{
+			profiler.Stop();
+			profiler.Report();
+			return EXIT_SUCCESS;
+		}
+	}
+	catch (std::exception & err)
+	{
+		std::cerr << "Exception caught !" << std::endl;
+		std::cerr << err.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
 	// Get file paths
 	std::vector<std::string> imagesFilePaths;
 	for (int i = 0; i < directoryReader->GetNumberOfFiles(); ++i)
@@ -58,6 +99,7 @@ int main(int argc, char *argv[])
 			continue;
 		}
 		imagesFilePaths.push_back(baseDirectory + PathSeparator + fileName);
+		profiler.AddInput(imagesFilePaths.back());
 	}
     // Sort image file paths in ascending order
     std::sort(imagesFilePaths.begin(), imagesFilePaths.end());
@@ -70,9 +112,116 @@ int main(int argc, char *argv[])
 	ImageWriter::Pointer writer = ImageWriter::New();
 	try
 	{
-		writer->SetFileName(argv[2]);
-		writer->SetInput(reader->GetOutput());
-		writer->Update();
+		profiler.Start("read");
+		// Check the geometry of every volume before decoding any voxel data
+		NIfTIUtils::ValidateSeriesGeometry(imagesFilePaths);
+		// Time between volumes (TR) and acquisition time of the first one
+		double timeStep = 0;
+		double timeOffset = 0;
+		if (options.Has("timestamps"))
+			NIfTIUtils::ReadTimestamps(options.Get("timestamps"), imagesFilePaths.size(), timeStep, timeOffset);
+		else if (options.Has("tr"))
+		{
+			timeStep = std::atof(options.Get("tr").c_str());
+			if (timeStep <= 0)
+				throw std::runtime_error("The TR must be positive");
+		}
+		// Peak memory: the series, a volume being read and the int16 copy, or a single volume when streamed
+		// (a time block of volumes for chunked outputs, which are always streamed)
+		const MemoryBudget budget(options.Get("max-memory"));
+		const bool chunked = options.Has("chunked");
+		long long chunk[4];
+		ChunkedImage::ParseChunk(options.Get("chunked"), chunk);
+		itk::NiftiImageIO::Pointer volumeIO = itk::NiftiImageIO::New();
+		volumeIO->SetFileName(imagesFilePaths[0]);
+		volumeIO->ReadImageInformation();
+		const unsigned long long volumeBytes = MemoryBudget::ImageBytes(volumeIO, sizeof(float));
+		const unsigned long long seriesBytes = volumeBytes * imagesFilePaths.size();
+		const unsigned long long inMemoryBytes = seriesBytes + volumeBytes + (options.Has("int16") ? seriesBytes / 2 : 0);
+		const unsigned long long streamedBytes = chunked ? volumeBytes * (chunk[3] + 1) : volumeBytes;
+		const bool streamed = chunked || !budget.Fits(inMemoryBytes);
+		if (chunked && options.Has("int16"))
+			throw std::runtime_error("--int16 is not supported for chunked images");
+		if (streamed)
+		{
+			budget.Require(streamedBytes, "ConvertNIfTI3DImageSeriesTo4DImage");
+			if (options.Has("int16"))
+				throw std::runtime_error("--int16 scales by the intensity range of the whole series, which does not fit the memory budget");
+		}
+		const std::string plan = chunked ? "streamed volume by volume into chunks" : (streamed ? "streamed volume by volume" : "in memory");
+		budget.Report(plan, streamed ? streamedBytes : inMemoryBytes);
+		profiler.SetMemoryPlan(plan, streamed ? streamedBytes : inMemoryBytes);
+		if (streamed)
+		{
+			// Every volume is appended to the output as soon as it is read
+			ImageType::Pointer geometry = NIfTIUtils::ImageGeometry<ImageType>(volumeIO);
+			ImageType::SizeType size = geometry->GetLargestPossibleRegion().GetSize();
+			size[3] = imagesFilePaths.size();
+			if (timeStep > 0)
+			{
+				ImageType::PointType origin = geometry->GetOrigin();
+				origin[3] = timeOffset;
+				geometry->SetOrigin(origin);
+			}
+			auto append = [&](auto &streamWriter)
+			{
+				for (std::size_t i = 0; i < imagesFilePaths.size(); ++i)
+				{
+					profiler.Start("read");
+					itk::ImageFileReader<VolumeType>::Pointer volumeReader = itk::ImageFileReader<VolumeType>::New();
+					volumeReader->SetFileName(imagesFilePaths[i]);
+					volumeReader->Update();
+					profiler.Start("write");
+					streamWriter.Write(volumeReader->GetOutput()->GetBufferPointer(), (long long) volumeReader->GetOutput()->GetBufferedRegion().GetNumberOfPixels());
+				}
+				streamWriter.Close();
+			};
+			if (chunked)
+			{
+				NIfTIUtils::ChunkedNIfTIWriter<ImageType> streamWriter(geometry, size, std::string(argv[2]), chunk, timeStep);
+				append(streamWriter);
+			}
+			else
+			{
+				NIfTIUtils::NIfTIStreamWriter<ImageType> streamWriter(geometry, size, std::string(argv[2]), 1, timeStep);
+				append(streamWriter);
+			}
+			profiler.SetVoxels(seriesBytes / sizeof(float));
+			// Keep the result for later runs
+			profiler.Start("cache");
+			cache.Store();
+			profiler.Stop();
+			profiler.Report();
+			return EXIT_SUCCESS;
+		}
+		reader->Update();
+		ImageType::Pointer image = reader->GetOutput();
+		image->DisconnectPipeline();
+		if (timeStep > 0)
+		{
+			ImageType::SpacingType spacing = image->GetSpacing();
+			spacing[3] = timeStep;
+			image->SetSpacing(spacing);
+			ImageType::PointType origin = image->GetOrigin();
+			origin[3] = timeOffset;
+			image->SetOrigin(origin);
+		}
+		profiler.SetVoxels(image->GetLargestPossibleRegion().GetNumberOfPixels());
+		profiler.Start("write");
+		if (options.Has("int16"))
+		{
+			// Scaled int16 with scl_slope/scl_inter
+			NIfTIUtils::WriteScaledNIfTIImage<ImageType>(image, std::string(argv[2]));
+		}
+		else
+		{
+			writer->SetFileName(argv[2]);
+			writer->SetInput(image);
+			writer->Update();
+		}
+		// Keep the result for later runs
+		profiler.Start("cache");
+		cache.Store();
 	}
 	catch (itk::ExceptionObject & err)
 	{
@@ -80,6 +229,15 @@ int main(int argc, char *argv[])
 		std::cerr << err << std::endl;
 		return EXIT_FAILURE;
 	}
+	catch (std::exception & err)
+	{
+		std::cerr << "Exception caught !" << std::endl;
+		std::cerr << err.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	profiler.Stop();
+	profiler.Report();
 
 	return EXIT_SUCCESS;
 }
\ No newline at end of file
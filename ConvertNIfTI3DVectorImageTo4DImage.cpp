@@ -18,6 +18,14 @@
 #include <itkVectorImage.h>
 #include <itkImageRegionConstIteratorWithIndex.h>
 #include <itkVectorIndexSelectionCastImageFilter.h>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <ImageTypes.hpp>
+#include <MemoryBudget.hpp>
+#include <NIfTIUtils.hpp>
+#include <algorithm>
+#include <sstream>
 
 typedef itk::VectorImage<float, 3> VectorImageType;
 typedef itk::Image<float, 3> Image3DType;
@@ -29,12 +37,19 @@ typedef itk::VectorIndexSelectionCastImageFilter<VectorImageType, Image3DType> I
 
 int main(int argc, char *argv[])
 {
+	CommandLineOptions options(argc, argv);
 	if (argc < 3)
 	{
-		std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: ConvertNIfTI3DVectorImageTo4D inputFilePath outputFilePath" << std::endl;
+		std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: ConvertNIfTI3DVectorImageTo4D inputFilePath outputFilePath [--int16] [--chunked[=x,y,z,t]] [--max-memory=size] [--cache=directory] [--profile=json|text]" << std::endl;
+		std::cerr << "--max-memory:\tmemory budget (e.g. 4G), an image that does not fit is converted in slabs of volumes" << std::endl;
+		std::cerr << "--chunked:\twrite a chunked image (outputFilePath.nii header and .chunks data) in chunks of x,y,z voxels by t volumes (default 64,64,16,8)" << std::endl;
+		std::cerr << "A chunked 4D input image is converted to a regular NIfTI image" << std::endl;
 		return EXIT_FAILURE;
 	}
 
+	Profiler profiler("ConvertNIfTI3DVectorImageTo4DImage", options.Get("profile"));
+	profiler.AddInput(std::string(argv[1]));
+
 	// NIfTI IO
 	itk::NiftiImageIO::Pointer NIfTIIO = itk::NiftiImageIO::New();
 	
@@ -60,10 +75,148 @@ int main(int argc, char *argv[])
 	// Get number of components and dimensions
 	const int numberOfCompnents  = NIfTIIO->GetNumberOfComponents();
 	const int numberOfDimensions = NIfTIIO->GetNumberOfDimensions();
+	profiler.SetImageInformation(NIfTIIO);
+
+	// Reuse the result of a previous run with the same inputs and parameters
+	ResultCache cache(options.Get("cache"), "ConvertNIfTI3DVectorImageTo4DImage");
+	try
+	{
+		profiler.Start("cache");
+		cache.AddInput(std::string(argv[1]));
+		if (NIfTIUtils::IsChunkedImage(std::string(argv[1])))
+			cache.AddInput(NIfTIUtils::ChunksFileName(std::string(argv[1])));
+		cache.AddOptions(options);
+		cache.AddOutput(std::string(argv[2]));
+		if (options.Has("chunked"))
+			cache.AddOutput(NIfTIUtils::ChunksFileName(std::string(argv[2])));
+		if (cache.Fetch())
+		{
+			profiler.Stop();
+			profiler.Report();
+			return EXIT_SUCCESS;
+		}
+	}
+	catch (std::exception & err)
+	{
+		std::cerr << "Exception caught !" << std::endl;
+		std::cerr << err.what() << std::endl;
+		return EXIT_FAILURE;
+	}
 
 	// NIfTI IO Factory
 	itk::NiftiImageIOFactory::RegisterOneFactory();
 
+	if (!(numberOfCompnents == 1 && numberOfDimensions == 4) && !(numberOfCompnents > 1 && numberOfDimensions == 3))
+	{
+		std::cerr << "Unsupported image: a 4D scalar image or a 3D vector image is expected" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// Peak memory: the input and the int16 copy for 4D images, the input, a component and the output for vector images
+	// (chunked outputs are always streamed and keep a time block of volumes)
+	try
+	{
+		const MemoryBudget budget(options.Get("max-memory"));
+		const bool chunked = options.Has("chunked");
+		long long chunk[4];
+		ChunkedImage::ParseChunk(options.Get("chunked"), chunk);
+		if (chunked && options.Has("int16"))
+			throw std::runtime_error("--int16 is not supported for chunked images");
+		const unsigned long long imageBytes = MemoryBudget::ImageBytes(NIfTIIO, sizeof(float));
+		const unsigned long long volumeBytes = MemoryBudget::VolumeBytes(NIfTIIO, sizeof(float));
+		const long long volumes = (numberOfCompnents > 1) ? numberOfCompnents : (long long) imageBytes / volumeBytes;
+		const unsigned long long inMemoryBytes = (numberOfCompnents > 1) ? 2 * imageBytes + volumeBytes : imageBytes + (options.Has("int16") ? imageBytes / 2 : 0);
+		const bool streamed = chunked || !budget.Fits(inMemoryBytes);
+		const unsigned long long blockBytes = chunked ? volumeBytes * chunk[3] : 0;
+		// Volumes (time points, or components read one at a time) per slab
+		long long slab = volumes;
+		if (streamed)
+		{
+			slab = (numberOfCompnents > 1) ? 1 : budget.Units(volumes, volumeBytes, blockBytes, "ConvertNIfTI3DVectorImageTo4DImage");
+			// Slabs of whole time blocks of a chunked input inflate every chunk once
+			const long long block = NIfTIUtils::ChunkedTimeBlock(std::string(argv[1]));
+			if (numberOfCompnents == 1 && slab > block)
+				slab -= slab % block;
+			budget.Require(slab * volumeBytes + blockBytes, "ConvertNIfTI3DVectorImageTo4DImage");
+			if (options.Has("int16"))
+				throw std::runtime_error("--int16 scales by the intensity range of the whole image, which does not fit the memory budget");
+		}
+		std::ostringstream plan;
+		if (streamed)
+			plan << "streamed in slabs of " << slab << " of " << volumes << " volumes";
+		else
+			plan << "in memory";
+		const unsigned long long peakBytes = streamed ? slab * volumeBytes + blockBytes : inMemoryBytes;
+		budget.Report(plan.str(), peakBytes);
+		profiler.SetMemoryPlan(plan.str(), peakBytes);
+		if (streamed)
+		{
+			// 4D images are read in slabs of time points and vector images one component at a time, both appended to the output
+			Image4DType::Pointer geometry = NIfTIUtils::ImageGeometry<Image4DType>(NIfTIIO);
+			Image4DType::SizeType size = geometry->GetLargestPossibleRegion().GetSize();
+			size[3] = volumes;
+			auto convert = [&](auto &writer)
+			{
+				for (long long v = 0; v < volumes; v += slab)
+				{
+					profiler.Start("read");
+					Image3DType::Pointer component;
+					Image4DType::Pointer image;
+					const float *buffer;
+					long long voxels;
+					if (numberOfCompnents > 1)
+					{
+						component = NIfTIUtils::ReadNIfTIComponent<Image3DType>(std::string(argv[1]), (unsigned int) v);
+						buffer = component->GetBufferPointer();
+						voxels = (long long) component->GetBufferedRegion().GetNumberOfPixels();
+					}
+					else
+					{
+						Image4DType::IndexType index;
+						index.Fill(0);
+						index[3] = v;
+						Image4DType::SizeType slabSize = size;
+						slabSize[3] = std::min(slab, volumes - v);
+						image = NIfTIUtils::ReadNIfTIImageRegion<Image4DType>(std::string(argv[1]), Image4DType::RegionType(index, slabSize));
+						buffer = image->GetBufferPointer();
+						voxels = (long long) image->GetBufferedRegion().GetNumberOfPixels();
+					}
+					profiler.Start("write");
+					writer.Write(buffer, voxels);
+				}
+				writer.Close();
+			};
+			if (chunked)
+			{
+				NIfTIUtils::ChunkedNIfTIWriter<Image4DType> writer(geometry, size, std::string(argv[2]), chunk);
+				convert(writer);
+			}
+			else
+			{
+				NIfTIUtils::NIfTIStreamWriter<Image4DType> writer(geometry, size, std::string(argv[2]));
+				convert(writer);
+			}
+			// Keep the result for later runs
+			profiler.Start("cache");
+			cache.Store();
+			profiler.Stop();
+			profiler.Report();
+			return EXIT_SUCCESS;
+		}
+	}
+	catch (itk::ExceptionObject & err)
+	{
+		std::cerr << "ExceptionObject caught !" << std::endl;
+		std::cerr << err << std::endl;
+		return EXIT_FAILURE;
+	}
+	catch (std::exception & err)
+	{
+		std::cerr << "Exception caught !" << std::endl;
+		std::cerr << err.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
 	// Image 4D case
 	if (numberOfCompnents == 1 && numberOfDimensions == 4)
 	{
@@ -71,13 +224,26 @@ int main(int argc, char *argv[])
 		Image4DType::Pointer inputImage;		
 		try
 		{
-			Image4DReader::Pointer reader = Image4DReader::New();
-			reader->SetFileName(argv[1]);
-			reader->Update();
-			ImageWriter::Pointer writer = ImageWriter::New();
-			writer->SetFileName(argv[2]);
-			writer->SetInput(reader->GetOutput());
-			writer->Update();
+			// Chunked images are read through NIfTIUtils
+			profiler.Start("read");
+			inputImage = NIfTIUtils::ReadImage<Image4DType>(std::string(argv[1]));
+			profiler.Start("write");
+			if (options.Has("int16"))
+			{
+				// Scaled int16 with scl_slope/scl_inter
+				NIfTIUtils::WriteScaledNIfTIImage<Image4DType>(inputImage, std::string(argv[2]));
+			}
+			else
+			{
+				ImageWriter::Pointer writer = ImageWriter::New();
+				writer->SetFileName(argv[2]);
+				writer->SetInput(inputImage);
+				writer->Update();
+			}
+			// Keep the result for later runs
+			profiler.Start("cache");
+			cache.Store();
+			profiler.Stop();
 		}
 		catch (itk::ExceptionObject & err)
 		{
@@ -85,6 +251,13 @@ int main(int argc, char *argv[])
 			std::cerr << err << std::endl;
 			return EXIT_FAILURE;
 		}
+		catch (std::exception & err)
+		{
+			std::cerr << "Exception caught !" << std::endl;
+			std::cerr << err.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+		profiler.Report();
 		return EXIT_SUCCESS;
 	}
 	// VectorImage 3D multi-component case
@@ -97,6 +270,7 @@ int main(int argc, char *argv[])
 		VectorImageReader::Pointer reader = VectorImageReader::New();
 		try
 		{
+			profiler.Start("read");
 			reader->SetFileName(argv[1]);
 			reader->Update();
 			inputImage = reader->GetOutput();
@@ -109,6 +283,7 @@ int main(int argc, char *argv[])
 		}
 
 		// Copy metadata to 4D image
+		profiler.Start("compute");
 		VectorImageType::SpacingType inputSpacing = inputImage->GetSpacing();
 		Image4DType::SpacingType outputSpacing;
 		outputSpacing[0] = inputSpacing[0];
@@ -172,10 +347,23 @@ int main(int argc, char *argv[])
 
 		try
 		{
-			ImageWriter::Pointer writer = ImageWriter::New();
-			writer->SetFileName(argv[2]);
-			writer->SetInput(outputImage);
-			writer->Update();
+			profiler.Start("write");
+			if (options.Has("int16"))
+			{
+				// Scaled int16 with scl_slope/scl_inter
+				NIfTIUtils::WriteScaledNIfTIImage<Image4DType>(outputImage, std::string(argv[2]));
+			}
+			else
+			{
+				ImageWriter::Pointer writer = ImageWriter::New();
+				writer->SetFileName(argv[2]);
+				writer->SetInput(outputImage);
+				writer->Update();
+			}
+			// Keep the result for later runs
+			profiler.Start("cache");
+			cache.Store();
+			profiler.Stop();
 		}
 		catch (itk::ExceptionObject & err)
 		{
@@ -183,6 +371,13 @@ int main(int argc, char *argv[])
 			std::cerr << err << std::endl;
 			return EXIT_FAILURE;
 		}
+		catch (std::exception & err)
+		{
+			std::cerr << "Exception caught !" << std::endl;
+			std::cerr << err.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+		profiler.Report();
 		return EXIT_SUCCESS;
 	}
 	else
@@ -9,17 +9,23 @@
 ***************************************************************************/
 
 #include <ITKUtils.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <Dispatch.hpp>
 #include <itkImage.h>
 #include <itkChangeInformationImageFilter.h>
 
 
 template<class ImageType>
-void CopyHeaderInformation(int argc, char *argv[])
+void CopyHeaderInformation(int argc, char *argv[], Profiler &profiler)
 {
     // Read input image
+    profiler.Start("read");
     typename ImageType::Pointer imageSource = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
     // Read reference image
     typename ImageType::Pointer imageReference = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[2]));
+    profiler.Start("compute");
     // Check consistency
     ITKUtils::AssertCompatibleImageAndMaskSizes<ImageType, ImageType>(imageSource, imageReference);
     // Get copy spacing
@@ -55,15 +61,18 @@ void CopyHeaderInformation(int argc, char *argv[])
     }
     changeInformationImageFilter->Update();
     // Save image
+    profiler.Start("write");
     ITKUtils::WriteNIfTIImage<ImageType>(changeInformationImageFilter->GetOutput(), std::string(argv[3]));
+    profiler.Stop();
 }
 
 
 int main(int argc, char *argv[])
 {
+    CommandLineOptions options(argc, argv);
     if (argc < 4)
     {
-        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: CopyHeaderInformation sourceImage referenceImage outputImage [copySpacing=1] [copyOrigin=1] [copyDirection=1]" << std::endl;
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: CopyHeaderInformation sourceImage referenceImage outputImage [copySpacing=1] [copyOrigin=1] [copyDirection=1] [--cache=directory] [--profile=json|text]" << std::endl;
         return EXIT_FAILURE;
     }
 
@@ -73,6 +82,12 @@ int main(int argc, char *argv[])
     const unsigned int SourceImageDimension = sourceIO->GetNumberOfDimensions();
     const unsigned int ReferenceImageDimension = referenceIO->GetNumberOfDimensions();
 
+    Profiler profiler("CopyHeaderInformation", options.Get("profile"));
+    profiler.SetImageInformation(sourceIO);
+    profiler.AddInput(std::string(argv[1]));
+    profiler.AddInput(std::string(argv[2]));
+    ResultCache cache(options.Get("cache"), "CopyHeaderInformation");
+
     if (SourceImageDimension != ReferenceImageDimension)
     {
         std::cerr << "Incompatible image dimensions" << std::endl;
@@ -87,12 +102,27 @@ int main(int argc, char *argv[])
     
     try
     {
-        if (SourceImageDimension == 2)
-            CopyHeaderInformation<itk::Image<float, 2>>(argc, argv);
-        else if (SourceImageDimension == 3)
-            CopyHeaderInformation<itk::Image<float, 3>>(argc, argv);
-        else
-            CopyHeaderInformation<itk::Image<float, 4>>(argc, argv);
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        cache.AddInput(std::string(argv[1]));
+        cache.AddInput(std::string(argv[2]));
+        cache.AddParameters(4, argc, argv);
+        cache.AddOptions(options);
+        cache.AddOutput(std::string(argv[3]));
+        if (cache.Fetch())
+        {
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        Dispatch::ByDimension<2, 3, 4>(SourceImageDimension, [&](auto dimension)
+        {
+            CopyHeaderInformation<itk::Image<float, decltype(dimension)::value>>(argc, argv, profiler);
+        });
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
     }
     catch (itk::ExceptionObject & err)
     {
@@ -100,6 +130,14 @@ int main(int argc, char *argv[])
         std::cerr << err << std::endl;
         return EXIT_FAILURE;
     }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
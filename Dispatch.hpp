@@ -0,0 +1,67 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Runtime selection of compile-time image dimensions and pixel types       *
+***************************************************************************/
+
+#ifndef DISPATCH_HPP
+#define DISPATCH_HPP
+
+#include <stdexcept>
+#include <type_traits>
+#include <ImageTypes.hpp>
+
+/*
+ * A tool writes its body once, as a generic lambda over the dimension (an
+ * std::integral_constant) or the pixel type (a Dispatch::Type), and the
+ * dispatcher instantiates it only for the alternatives listed at compile
+ * time, instead of if/else chains repeated in every tool.
+ *
+ *     Dispatch::ByDimension<2, 3, 4>(dimension, [&](auto D) { Run<itk::Image<float, decltype(D)::value>>(...); });
+ */
+namespace Dispatch
+{
+    template<typename T>
+    struct Type
+    {
+        typedef T type;
+    };
+
+    template<typename... Types>
+    struct TypeList
+    {
+        static constexpr unsigned int size = sizeof...(Types);
+    };
+
+    // Pixel types of CastImage, in the order of its pixelType codes
+    typedef TypeList<float, unsigned char, unsigned short, unsigned int, unsigned long, char, short, int, long, double> CastPixelTypes;
+
+    // Call function(std::integral_constant<unsigned int, D>()) for the D in Dimensions equal to dimension
+    template<unsigned int... Dimensions, typename Function>
+    void ByDimension(unsigned int dimension, Function &&function)
+    {
+        bool found = false;
+        int expand[] = {0, ((dimension == Dimensions) ? (function(std::integral_constant<unsigned int, Dimensions>()), found = true, 0) : 0)...};
+        (void) expand;
+        if (!found)
+            throw std::runtime_error("Unsupported image dimensions");
+    }
+
+    // Call function(Type<T>()) for the index-th type T of the list
+    template<typename... Types, typename Function>
+    void ByIndex(TypeList<Types...>, unsigned int index, Function &&function)
+    {
+        unsigned int i = 0;
+        bool found = false;
+        int expand[] = {0, ((index == i++) ? (function(Type<Types>()), found = true, 0) : 0)...};
+        (void) expand;
+        if (!found)
+            throw std::runtime_error("Unsupported data type");
+    }
+}
+
+#endif
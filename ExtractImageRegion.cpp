@@ -0,0 +1,106 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Extract Image Region (time points and/or sub-volume)                     *
+***************************************************************************/
+
+#include <cstdlib>
+#include <ITKUtils.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <Dispatch.hpp>
+#include <NIfTIUtils.hpp>
+#include <itkImage.h>
+
+
+template<typename ImageType>
+void ExtractImageRegion(int argc, char *argv[], const itk::ImageIOBase *imageIO, Profiler &profiler)
+{
+    const unsigned int Dimension = ImageType::ImageDimension;
+    // Whole image by default
+    typename ImageType::IndexType index;
+    typename ImageType::SizeType size;
+    for (unsigned int i = 0; i < Dimension; ++i)
+    {
+        index[i] = 0;
+        size[i] = (i < imageIO->GetNumberOfDimensions()) ? imageIO->GetDimensions(i) : 1;
+    }
+    // Time points
+    if (Dimension > 3)
+    {
+        index[3] = (argc > 3) ? std::atol(argv[3]) : 0;
+        size[3] = (argc > 4) ? std::atol(argv[4]) : 1;
+    }
+    else if (argc > 3 && (std::atol(argv[3]) != 0 || (argc > 4 && std::atol(argv[4]) != 1)))
+        throw std::runtime_error("A 3D image has a single time point");
+    // Sub-volume
+    if (argc > 5)
+    {
+        for (unsigned int i = 0; i < 3; ++i)
+        {
+            index[i] = std::atol(argv[5 + i]);
+            size[i] = std::atol(argv[8 + i]);
+        }
+    }
+    typename ImageType::RegionType region(index, size);
+    // Read the region only
+    profiler.Start("read");
+    profiler.SetVoxels(region.GetNumberOfPixels());
+    typename ImageType::Pointer image = NIfTIUtils::ReadNIfTIImageRegion<ImageType>(std::string(argv[1]), region);
+    // Save image
+    profiler.Start("write");
+    ITKUtils::WriteNIfTIImage<ImageType>(image, std::string(argv[2]));
+    profiler.Stop();
+}
+
+
+int main(int argc, char *argv[])
+{
+    CommandLineOptions options(argc, argv);
+    if (argc < 3 || (argc > 5 && argc != 11))
+    {
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: ExtractImageRegion inputImage outputImage [firstTimePoint=0] [timePoints=1] [indexX indexY indexZ sizeX sizeY sizeZ] [--profile=json|text]" << std::endl;
+        std::cerr << "Only the requested data is read: uncompressed files are streamed, .nii.gz files are read through an inflate index built on first use and kept in $TMPDIR/onts-zidx-<uid>, chunked images inflate only the chunks overlapping the region" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
+    const unsigned int ImageDimension = imageIO->GetNumberOfDimensions();
+
+    Profiler profiler("ExtractImageRegion", options.Get("profile"));
+    profiler.AddInput(std::string(argv[1]));
+
+    if (ImageDimension != 3 && ImageDimension != 4)
+    {
+        std::cerr << "Unsupported image dimensions" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        Dispatch::ByDimension<3, 4>(ImageDimension, [&](auto dimension)
+        {
+            ExtractImageRegion<itk::Image<float, decltype(dimension)::value>>(argc, argv, imageIO, profiler);
+        });
+    }
+    catch (itk::ExceptionObject & err)
+    {
+        std::cerr << "ExceptionObject caught !" << std::endl;
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Global Principal Compoment Analysis temporal basis fitting               *
+***************************************************************************/
+
+#include <itkImage.h>
+#include <Eigen/Dense>
+#include <EigenITK.hpp>
+#include <ITKUtils.hpp>
+#include <GlobalPCADenoising.hpp>
+#include <TemporalPrincipalComponentAnalysis.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <ImageTypes.hpp>
+#include <cstdlib>
+
+using namespace Eigen;
+
+int main(int argc, char *argv [])
+{
+    CommandLineOptions options(argc, argv);
+    if (argc < 4 || (argc % 2) != 0)
+    {
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: GlobalPCABasis basisFile inputImage maskImage [inputImage maskImage ...] [--update] [--refined] [--precision=single|mixed|double] [--cache=directory] [--profile=json|text]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    Profiler profiler("GlobalPCABasis", options.Get("profile"));
+    ResultCache cache(options.Get("cache"), "GlobalPCABasis");
+
+    // Typedefs
+    typedef itk::Image<float, 4> ComponentsImageType;
+    typedef itk::Image<unsigned char, 3> MaskType;
+    try
+    {
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        if (options.Has("update"))
+            cache.AddInput(std::string(argv[1]));
+        for (int i = 2; i < argc; ++i)
+            cache.AddInput(std::string(argv[i]));
+        cache.AddOptions(options);
+        cache.AddOutput(std::string(argv[1]));
+        if (cache.Fetch())
+        {
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        TemporalPrincipalComponentAnalysis pca(TemporalPrincipalComponentAnalysis::precisionFromString(options.Get("precision", "mixed")));
+        // Keep accumulating on top of an existing basis
+        if (options.Has("update"))
+        {
+            profiler.Start("read");
+            pca.load(std::string(argv[1]));
+        }
+        unsigned long long voxels = 0;
+        for (int i = 2; i < argc; i += 2)
+        {
+            // Get PWI
+            profiler.Start("read");
+            profiler.AddInput(std::string(argv[i]));
+            profiler.AddInput(std::string(argv[i + 1]));
+            typename ComponentsImageType::Pointer PWI = ITKUtils::ReadNIfTIImage<ComponentsImageType>(std::string(argv[i]));
+            // Get mask
+            typename MaskType::Pointer mask = ITKUtils::ReadNIfTIImage<MaskType>(std::string(argv[i + 1]));
+            profiler.Start("compute");
+            voxels += PWI->GetLargestPossibleRegion().GetNumberOfPixels();
+            // Compute Non-Zeros mask (same voxel selection as GlobalPCADenoising)
+            typename MaskType::Pointer nonZerosMask = options.Has("refined") ? mask : ITKUtils::ZerosMaskIntersect<ComponentsImageType, MaskType>(PWI, mask, true, false, 0.05);
+            // Accumulate the series statistics
+            pca.update(MaskedDataset<ComponentsImageType, MaskType>(PWI, nonZerosMask));
+        }
+        profiler.Start("compute");
+        pca.fit();
+        profiler.SetVoxels(voxels);
+        // Save basis
+        profiler.Start("write");
+        pca.save(std::string(argv[1]));
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
+    }
+    catch (itk::ExceptionObject & err)
+    {
+        std::cerr << "ExceptionObject caught !" << std::endl;
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
+
+    return EXIT_SUCCESS;
+}
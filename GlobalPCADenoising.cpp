@@ -9,38 +9,209 @@
 ***************************************************************************/
 
 #include <itkImage.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionIterator.h>
 #include <Eigen/Dense>
 #include <EigenITK.hpp>
 #include <ITKUtils.hpp>
 #include <PrincipalComponentAnalysis.hpp>
+#include <TemporalPrincipalComponentAnalysis.hpp>
+#include <NIfTIUtils.hpp>
+#include <GlobalPCADenoising.hpp>
+#include <SmoothImage.hpp>
+#include <WorkPartitioner.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <ImageTypes.hpp>
+#include <MemoryBudget.hpp>
+#include <algorithm>
 #include <cstdlib>
 #include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
 
 using namespace Eigen;
 
+
+/*
+ * Denoising of a series that does not fit in the memory budget, in two
+ * passes over slabs of slices (all the time points of a range of z): the
+ * first accumulates the temporal covariance of the masked voxels (only their
+ * mean curve with a precomputed basis), the second projects every slab onto
+ * the selected components and writes it in place in the output, which must
+ * therefore be uncompressed. The temporal PCA is the
+ * incremental one, so the result matches --precision rather than the default
+ * in-memory decomposition. Returns the number of components kept.
+ */
+template<typename ImageType, typename MaskType>
+unsigned int GlobalPCADenoisingSlabs(char *argv[], const CommandLineOptions &options, const MaskType *mask, long long slices, bool marchenkoPastur, double variance, unsigned int minComponents, unsigned int maxComponents, double &noiseSigma, Profiler &profiler)
+{
+    const std::string fileName(argv[1]);
+    typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(fileName);
+    typename ImageType::Pointer geometry = NIfTIUtils::ImageGeometry<ImageType>(imageIO);
+    const typename ImageType::SizeType size = geometry->GetLargestPossibleRegion().GetSize();
+    const long long sliceVoxels = (long long) size[0] * size[1];
+    const long long volumeVoxels = sliceVoxels * size[2];
+    const typename MaskType::SizeType maskSize = mask->GetLargestPossibleRegion().GetSize();
+    for (unsigned int i = 0; i < 3; ++i)
+        if (maskSize[i] != size[i])
+            throw std::runtime_error("Image and mask sizes are different");
+    // Slab of slices z .. z + count - 1 and its part of the mask
+    auto ReadSlab = [&](long long z, long long count, typename MaskType::Pointer &slabMask)
+    {
+        typename ImageType::IndexType index;
+        index.Fill(0);
+        index[2] = z;
+        typename ImageType::SizeType slabSize = size;
+        slabSize[2] = count;
+        typename ImageType::Pointer slab = NIfTIUtils::ReadNIfTIImageRegion<ImageType>(fileName, typename ImageType::RegionType(index, slabSize));
+        typename MaskType::IndexType maskIndex;
+        maskIndex.Fill(0);
+        maskIndex[2] = z;
+        typename MaskType::PointType origin;
+        mask->TransformIndexToPhysicalPoint(maskIndex, origin);
+        typename MaskType::SizeType slabMaskSize = maskSize;
+        slabMaskSize[2] = count;
+        slabMask = MaskType::New();
+        slabMask->SetRegions(slabMaskSize);
+        slabMask->SetSpacing(mask->GetSpacing());
+        slabMask->SetOrigin(origin);
+        slabMask->SetDirection(mask->GetDirection());
+        slabMask->Allocate();
+        std::memcpy(slabMask->GetBufferPointer(), mask->GetBufferPointer() + z * sliceVoxels, sizeof(typename MaskType::PixelType) * count * sliceVoxels);
+        return slab;
+    };
+    // First pass: temporal covariance, or only the mean curve of the series with a precomputed basis
+    TemporalPrincipalComponentAnalysis pca(TemporalPrincipalComponentAnalysis::precisionFromString(options.Get("precision", "mixed")));
+    const bool basis = options.Has("basis");
+    if (basis)
+        pca.load(options.Get("basis"));
+    VectorXd sum = VectorXd::Zero(size[3]);
+    double samples = 0;
+    for (long long z = 0; z < (long long) size[2]; z += slices)
+    {
+        profiler.Start("read");
+        typename MaskType::Pointer slabMask;
+        typename ImageType::Pointer slab = ReadSlab(z, std::min(slices, (long long) size[2] - z), slabMask);
+        profiler.Start("compute");
+        const MatrixXf dataset(MaskedDataset<ImageType, MaskType>(slab, slabMask));
+        if (dataset.rows() == 0)
+            continue;
+        if (basis)
+        {
+            for (Eigen::Index t = 0; t < dataset.cols(); ++t)
+                sum(t) += dataset.col(t).cast<double>().sum();
+            samples += dataset.rows();
+        }
+        else
+            pca.update(dataset);
+    }
+    if (!basis)
+        pca.fit();
+    if (pca.dimensions() != size[3])
+        throw std::runtime_error("Image and temporal basis have a different number of time points");
+    const unsigned int components = marchenkoPastur ? pca.componentsMarchenkoPastur(minComponents, maxComponents) : pca.componentsVarianceExplained(variance, minComponents, maxComponents);
+    noiseSigma = pca.noiseSigma();
+    // The series is centred on the mean of the fit, or on its own mean curve when it was not part of it
+    const RowVectorXf mean = basis ? RowVectorXf((sum / std::max(1.0, samples)).transpose().cast<float>()) : RowVectorXf();
+    // Second pass: reconstruction, every time point of a slab is written at its place in the output
+    NIfTIUtils::NIfTIStreamWriter<ImageType> writer(geometry, size, std::string(argv[4]));
+    for (long long z = 0; z < (long long) size[2]; z += slices)
+    {
+        const long long count = std::min(slices, (long long) size[2] - z);
+        profiler.Start("read");
+        typename MaskType::Pointer slabMask;
+        typename ImageType::Pointer slab = ReadSlab(z, count, slabMask);
+        profiler.Start("compute");
+        const MatrixXf dataset(MaskedDataset<ImageType, MaskType>(slab, slabMask));
+        if (dataset.rows() > 0)
+        {
+            MatrixXf reconstruction = basis ? pca.project(dataset, components, mean) : pca.project(dataset, components);
+            CorrectNegativeCurves(reconstruction);
+            EigenITK::toITK<ImageType, MaskType>(reconstruction, slabMask, slab);
+        }
+        profiler.Start("write");
+        const long long slabVoxels = count * sliceVoxels;
+        for (long long t = 0; t < (long long) size[3]; ++t)
+            writer.WriteAt(t * volumeVoxels + z * sliceVoxels, slab->GetBufferPointer() + t * slabVoxels, slabVoxels);
+    }
+    writer.Close();
+    return components;
+}
+
+
+// Save the estimated noise sigma as a scalar or as a map over the analysed voxels
+template<typename SigmaImageType, typename MaskType>
+void WriteNoiseSigma(double noiseSigma, const MaskType *mask, const std::string &sigmaFileName)
+{
+    if (sigmaFileName.find(".nii") != std::string::npos)
+    {
+        typename SigmaImageType::Pointer sigmaImage = SigmaImageType::New();
+        sigmaImage->CopyInformation(mask);
+        sigmaImage->SetRegions(mask->GetLargestPossibleRegion());
+        sigmaImage->Allocate();
+        itk::ImageRegionConstIterator<MaskType> maskIterator(mask, mask->GetLargestPossibleRegion());
+        itk::ImageRegionIterator<SigmaImageType> sigmaIterator(sigmaImage, sigmaImage->GetLargestPossibleRegion());
+        for (; !maskIterator.IsAtEnd(); ++maskIterator, ++sigmaIterator)
+            sigmaIterator.Set(maskIterator.Get() ? (float) noiseSigma : 0.0f);
+        ITKUtils::WriteNIfTIImage<SigmaImageType>(sigmaImage, sigmaFileName);
+    }
+    else
+    {
+        std::ofstream sigmaFile(sigmaFileName.c_str());
+        sigmaFile << noiseSigma << std::endl;
+    }
+}
+
 int main(int argc, char *argv [])
 {
+    CommandLineOptions options(argc, argv);
     if (argc < 5)
     {
-        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: GlobalPCADenoising inputImage maskImage variance outputImage [minComponents=5% of number of components] [maxComponents=25% of number of components] [verbose=0]" << std::endl;
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: GlobalPCADenoising inputImage maskImage variance|mp outputImage [minComponents=5% of number of components] [maxComponents=25% of number of components] [verbose=0] [--basis=basisFile] [--refined] [--sigma=sigmaFile|sigmaImage] [--precision=single|mixed|double] [--smooth=sigma] [--outliers=listFile] [--outlier-threshold=z] [--int16] [--max-memory=size] [--pin] [--cache=directory] [--profile=json|text]" << std::endl;
+        std::cerr << "variance:\tfraction of variance explained, or 'mp' to select the rank by Marchenko-Pastur thresholding" << std::endl;
+        std::cerr << "--precision:\taccumulation precision of the covariance (default mixed); it selects the incremental temporal PCA, also used by mp, --basis, --outliers and --max-memory, instead of the default in-memory decomposition, so results may differ slightly from a run without it" << std::endl;
+        std::cerr << "--smooth:\tmask normalized Gaussian smoothing (sigma in mm) of the denoised image before it is written" << std::endl;
+        std::cerr << "--outliers:\tflag volumes whose global intensity or DVARS z-score around its running median exceeds --outlier-threshold (default 3), fit the basis without them, reconstruct them by projection and write their indices to listFile (no --basis)" << std::endl;
+        std::cerr << "--refined:\tmaskImage is already the refined mask of PreprocessImage (skip the zeros mask intersection)" << std::endl;
+        std::cerr << "--max-memory:\tmemory budget (e.g. 4G), a series that does not fit is denoised in two passes over slabs of slices (needs --refined and an uncompressed output, no --smooth, --outliers or --int16)" << std::endl;
         return EXIT_FAILURE;
     }
 
+    Profiler profiler("GlobalPCADenoising", options.Get("profile"));
+    profiler.AddInput(std::string(argv[1]));
+    profiler.AddInput(std::string(argv[2]));
+    ResultCache cache(options.Get("cache"), "GlobalPCADenoising");
+    if (options.Has("pin"))
+        WorkPartitioner::PinThreads();
+
     // Typedefs
     typedef itk::Image<float, 4> ComponentsImageType;
     typedef itk::Image<unsigned char, 3> MaskType;
+    typedef itk::Image<float, 3> SigmaImageType;
     try
     {
-        // Get PWI
-        typename ComponentsImageType::Pointer PWI = ITKUtils::ReadNIfTIImage<ComponentsImageType>(std::string(argv[1]));
-        // Get mask
-        typename MaskType::Pointer mask = ITKUtils::ReadNIfTIImage<MaskType>(std::string(argv[2]));
-        // Get variance
-        const double variance = std::strtod(argv[3], NULL);
-        // Default min and max number of components
-        typename ComponentsImageType::SizeType imageSize = PWI->GetLargestPossibleRegion().GetSize();
-        unsigned int minComponents = std::ceil(imageSize[3] * 0.0500);
-        unsigned int maxComponents = std::ceil(imageSize[3] * 0.3333);
+        // Get PWI geometry
+        profiler.Start("read");
+        typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
+        if (imageIO->GetNumberOfDimensions() != 4)
+            throw std::runtime_error("Unsupported image dimensions");
+        profiler.SetVoxels(imageIO->GetImageSizeInPixels());
+        // The outlier volumes are left out of the fit, which a precomputed basis has no room for
+        if (options.Has("outliers") && options.Has("basis"))
+            throw std::runtime_error("--outliers fits the basis without the outlier volumes and cannot be combined with --basis");
+        // Get variance (or Marchenko-Pastur rank selection)
+        const bool marchenkoPastur = std::string(argv[3]) == "mp";
+        const double variance = marchenkoPastur ? 1.0 : std::strtod(argv[3], NULL);
+        // Default min and max number of components (unconstrained when the rank is estimated)
+        typename ComponentsImageType::SizeType imageSize;
+        for (unsigned int i = 0; i < 4; ++i)
+            imageSize[i] = imageIO->GetDimensions(i);
+        unsigned int minComponents = marchenkoPastur ? 1 : std::ceil(imageSize[3] * 0.0500);
+        unsigned int maxComponents = marchenkoPastur ? imageSize[3] : std::ceil(imageSize[3] * 0.3333);
         // Get user min number of components
         if (argc > 5)
             minComponents = std::atoi(argv[5]);
@@ -56,37 +227,226 @@ int main(int argc, char *argv [])
         {
             std::cout << "CONFIGURATION" << std::endl;
             std::cout << "-------------" << std::endl;
-            std::cout << "Variance explained" << std::endl;
-            std::cout << "\tValue: " << variance << std::endl;
+            if (marchenkoPastur)
+                std::cout << "Rank selection" << std::endl << "\tMarchenko-Pastur" << std::endl;
+            else
+            {
+                std::cout << "Variance explained" << std::endl;
+                std::cout << "\tValue: " << variance << std::endl;
+            }
             std::cout << "Number of components" << std::endl;
             std::cout << "\tMinium: " << minComponents << std::endl;
             std::cout << "\tMaximum: " << maxComponents << std::endl;    
+            if (options.Has("basis"))
+                std::cout << "Temporal basis" << std::endl << "\tFile: " << options.Get("basis") << std::endl;
+            if (options.Has("outliers"))
+                std::cout << "Outlier volumes" << std::endl << "\tThreshold: " << options.Get("outlier-threshold", "3") << std::endl;
         }
-        // Compute Non-Zeros mask
-        typename MaskType::Pointer nonZerosMask = ITKUtils::ZerosMaskIntersect<ComponentsImageType, MaskType>(PWI, mask, true, false, 0.05);
+        // Peak memory: the series, its data matrix and the reconstruction, or those of a slab of slices
+        const MemoryBudget budget(options.Get("max-memory"));
+        const unsigned long long imageBytes = MemoryBudget::ImageBytes(imageIO, sizeof(float));
+        const unsigned long long maskBytes = MemoryBudget::VolumeBytes(imageIO, sizeof(unsigned char));
+        const unsigned long long basisBytes = 4 * sizeof(double) * imageSize[3] * imageSize[3];
+        const unsigned long long sliceBytes = 3 * sizeof(float) * imageSize[0] * imageSize[1] * imageSize[3];
+        const long long slices = budget.Units(imageSize[2], sliceBytes, 2 * maskBytes + basisBytes, "GlobalPCADenoising");
+        const bool streamed = slices < (long long) imageSize[2];
+        // (with --outliers the reconstruction of the inliers lives next to the full one)
+        const unsigned long long inMemoryBytes = (options.Has("outliers") ? 4 : 3) * imageBytes + 2 * maskBytes + basisBytes;
+        const unsigned long long peakBytes = streamed ? 2 * maskBytes + basisBytes + slices * sliceBytes : inMemoryBytes;
+        std::ostringstream plan;
+        if (!streamed)
+            plan << "in memory";
+        else
+        {
+            plan << "two passes over slabs of " << slices << " of " << imageSize[2] << " slices";
+            // Fail before reading anything when the slabs cannot produce the requested output
+            const std::string outputFileName(argv[4]);
+            if (outputFileName.size() > 3 && outputFileName.compare(outputFileName.size() - 3, 3, ".gz") == 0)
+                throw std::runtime_error("The series does not fit the memory budget and slabs can only be written to an uncompressed output (.nii)");
+            if (!options.Has("refined") || options.Has("smooth") || options.Has("outliers") || options.Has("int16"))
+                throw std::runtime_error("The series does not fit the memory budget and slabs need --refined, without --smooth, --outliers or --int16");
+        }
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        cache.AddInput(std::string(argv[1]));
+        if (NIfTIUtils::IsChunkedImage(std::string(argv[1])))
+            cache.AddInput(NIfTIUtils::ChunksFileName(std::string(argv[1])));
+        cache.AddInput(std::string(argv[2]));
+        if (options.Has("basis"))
+            cache.AddInput(options.Get("basis"));
+        cache.AddParameters(5, argc, argv);
+        cache.AddParameter(std::string(argv[3]));
+        cache.AddOptions(options);
+        // --max-memory is not in the options of the key, but the slabs use the incremental PCA and the in-memory default does not
+        cache.AddParameter(streamed ? "plan=slabs" : "plan=in-memory");
+        cache.AddOutput(std::string(argv[4]));
+        if (std::string(argv[3]) == "mp" && options.Has("sigma"))
+            cache.AddOutput(options.Get("sigma"));
+        if (options.Has("outliers"))
+            cache.AddOutput(options.Get("outliers"));
+        if (cache.Fetch())
+        {
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        budget.Report(plan.str(), peakBytes);
+        profiler.SetMemoryPlan(plan.str(), peakBytes);
+        // Get mask
+        profiler.Start("read");
+        typename MaskType::Pointer mask = ITKUtils::ReadNIfTIImage<MaskType>(std::string(argv[2]));
+        if (streamed)
+        {
+            double noiseSigma = 0;
+            const unsigned int components = GlobalPCADenoisingSlabs<ComponentsImageType, MaskType>(argv, options, mask, slices, marchenkoPastur, variance, minComponents, maxComponents, noiseSigma, profiler);
+            if (verbose)
+            {
+                std::cout << "PCA" << std::endl;
+                std::cout << "---" << std::endl;
+                std::cout << "Reconstruction with " << components << " components out of " << imageSize[3] << std::endl;
+                if (marchenkoPastur)
+                    std::cout << "Estimated noise sigma: " << noiseSigma << std::endl;
+            }
+            if (marchenkoPastur && options.Has("sigma"))
+                WriteNoiseSigma<SigmaImageType, MaskType>(noiseSigma, mask, options.Get("sigma"));
+            // Keep the result for later runs
+            profiler.Start("cache");
+            cache.Store();
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        // Get PWI
+        typename ComponentsImageType::Pointer PWI = NIfTIUtils::IsChunkedImage(std::string(argv[1])) ? NIfTIUtils::ReadImage<ComponentsImageType>(std::string(argv[1])) : ITKUtils::ReadNIfTIImage<ComponentsImageType>(std::string(argv[1]));
+        profiler.Start("compute");
+        // Compute Non-Zeros mask (unless it was already refined by PreprocessImage)
+        typename MaskType::Pointer nonZerosMask = options.Has("refined") ? mask : ITKUtils::ZerosMaskIntersect<ComponentsImageType, MaskType>(PWI, mask, true, false, 0.05);
         // Convert to Eigen Matrix
-        MatrixXf dataset(EigenITK::toEigen<ComponentsImageType, MaskType>(PWI, nonZerosMask));
+        MatrixXf dataset(MaskedDataset<ComponentsImageType, MaskType>(PWI, nonZerosMask));
+        // Volume-level outliers, from the global intensity and DVARS of every time point
+        std::vector<Eigen::Index> outliers;
+        if (options.Has("outliers"))
+        {
+            VectorXd intensityZ, dvarsZ;
+            outliers = OutlierVolumes(dataset, std::atof(options.Get("outlier-threshold", "3").c_str()), intensityZ, dvarsZ);
+            if (dataset.cols() - (Eigen::Index) outliers.size() < 3)
+                throw std::runtime_error("Too many outlier volumes to fit the temporal basis");
+            std::ofstream outliersFile(options.Get("outliers").c_str());
+            for (std::size_t i = 0; i < outliers.size(); ++i)
+                outliersFile << outliers[i] << std::endl;
+            if (verbose)
+            {
+                std::cout << "OUTLIERS" << std::endl;
+                std::cout << "--------" << std::endl;
+                std::cout << outliers.size() << " outlier volumes out of " << imageSize[3] << std::endl;
+                for (std::size_t i = 0; i < outliers.size(); ++i)
+                    std::cout << "\tVolume " << outliers[i] << ": intensity z " << intensityZ(outliers[i]) << ", DVARS z " << dvarsZ(outliers[i]) << std::endl;
+            }
+        }
         // Compute PCA filtering
-        PrincipalComponentAnalysis pca;
-        MatrixXf PWIPCARawdata = pca.filteringVarianceExplained(dataset, variance, minComponents, maxComponents);
+        MatrixXf PWIPCARawdata;
+        unsigned int components;
+        double noiseSigma = 0;
+        if (!outliers.empty())
+        {
+            // Fit on the remaining volumes, then reconstruct the outliers from the spatial maps of the kept components
+            std::vector<Eigen::Index> inliers;
+            for (Eigen::Index t = 0, i = 0; t < dataset.cols(); ++t)
+            {
+                if (i < (Eigen::Index) outliers.size() && outliers[i] == t)
+                    ++i;
+                else
+                    inliers.push_back(t);
+            }
+            MatrixXf inlierData(dataset.rows(), inliers.size());
+            for (std::size_t i = 0; i < inliers.size(); ++i)
+                inlierData.col(i) = dataset.col(inliers[i]);
+            MatrixXf outlierData(dataset.rows(), outliers.size());
+            for (std::size_t i = 0; i < outliers.size(); ++i)
+                outlierData.col(i) = dataset.col(outliers[i]);
+            dataset.resize(0, 0);
+            const unsigned int fitMinComponents = std::min<unsigned int>(minComponents, inliers.size());
+            const unsigned int fitMaxComponents = std::min<unsigned int>(maxComponents, inliers.size());
+            TemporalPrincipalComponentAnalysis pca(TemporalPrincipalComponentAnalysis::precisionFromString(options.Get("precision", "mixed")));
+            MatrixXf inlierReconstruction;
+            if (marchenkoPastur)
+            {
+                inlierReconstruction = pca.filteringMarchenkoPastur(inlierData, fitMinComponents, fitMaxComponents);
+                noiseSigma = pca.noiseSigma();
+            }
+            else
+                inlierReconstruction = pca.filteringVarianceExplained(inlierData, variance, fitMinComponents, fitMaxComponents);
+            components = pca.components();
+            // The mean of an outlier is interpolated from the nearest inliers, its own one is the artefact
+            const RowVectorXf inlierMean = inlierData.colwise().mean();
+            RowVectorXf outlierMean(outliers.size());
+            for (std::size_t i = 0; i < outliers.size(); ++i)
+            {
+                const std::size_t next = std::lower_bound(inliers.begin(), inliers.end(), outliers[i]) - inliers.begin();
+                if (next == 0 || next == inliers.size())
+                    outlierMean(i) = inlierMean(next == 0 ? 0 : next - 1);
+                else
+                {
+                    const float w = float(outliers[i] - inliers[next - 1]) / float(inliers[next] - inliers[next - 1]);
+                    outlierMean(i) = (1 - w) * inlierMean(next - 1) + w * inlierMean(next);
+                }
+            }
+            const MatrixXf outlierReconstruction = pca.projectVolumes(inlierData, outlierData, outlierMean, components);
+            PWIPCARawdata.resize(inlierData.rows(), imageSize[3]);
+            for (std::size_t i = 0; i < inliers.size(); ++i)
+                PWIPCARawdata.col(inliers[i]) = inlierReconstruction.col(i);
+            for (std::size_t i = 0; i < outliers.size(); ++i)
+                PWIPCARawdata.col(outliers[i]) = outlierReconstruction.col(i);
+        }
+        else if (marchenkoPastur || options.Has("basis") || options.Has("precision"))
+        {
+            TemporalPrincipalComponentAnalysis pca(TemporalPrincipalComponentAnalysis::precisionFromString(options.Get("precision", "mixed")));
+            // Project onto a precomputed temporal basis (see GlobalPCABasis)
+            if (options.Has("basis"))
+                pca.load(options.Get("basis"));
+            if (marchenkoPastur)
+            {
+                PWIPCARawdata = pca.filteringMarchenkoPastur(dataset, minComponents, maxComponents);
+                noiseSigma = pca.noiseSigma();
+            }
+            else
+                PWIPCARawdata = pca.filteringVarianceExplained(dataset, variance, minComponents, maxComponents);
+            components = pca.components();
+        }
+        else
+        {
+            PrincipalComponentAnalysis pca;
+            PWIPCARawdata = pca.filteringVarianceExplained(dataset, variance, minComponents, maxComponents);
+            components = pca.components();
+        }
         if (verbose)
         {
             std::cout << "PCA" << std::endl;
             std::cout << "---" << std::endl;
-            std::cout << "Reconstruction with " << pca.components() << " components out of " << imageSize[3] << std::endl;
+            std::cout << "Reconstruction with " << components << " components out of " << imageSize[3] << std::endl;
+            if (marchenkoPastur)
+                std::cout << "Estimated noise sigma: " << noiseSigma << std::endl;
         }
         // Correct curves with negative values
-        #pragma omp parallel for
-        for (int i = 0; i < PWIPCARawdata.rows(); i++)
-        {
-            ArrayXf row = PWIPCARawdata.row(i);
-            if ((row <= 0).any())
-                PWIPCARawdata.row(i) = (row - row.minCoeff() + 1);
-        }
+        CorrectNegativeCurves(PWIPCARawdata);
         // Convert to ITK image
         EigenITK::toITK<ComponentsImageType, MaskType>(PWIPCARawdata, nonZerosMask, PWI);
+        // Spatial smoothing in the same pass, instead of another round-trip through an external tool
+        if (options.Has("smooth"))
+            Smoothing::SmoothSeries<ComponentsImageType, MaskType>(PWI, nonZerosMask, Smoothing::Gaussian, std::atof(options.Get("smooth").c_str()));
+        // Save estimated noise sigma as a scalar or as a map over the analysed voxels
+        if (marchenkoPastur && options.Has("sigma"))
+            WriteNoiseSigma<SigmaImageType, MaskType>(noiseSigma, nonZerosMask, options.Get("sigma"));
         // Save new filtered image
-        ITKUtils::WriteNIfTIImage<ComponentsImageType>(PWI, std::string(argv[4]));
+        profiler.Start("write");
+        if (options.Has("int16"))
+            NIfTIUtils::WriteScaledNIfTIImage<ComponentsImageType>(PWI, std::string(argv[4]));
+        else
+            ITKUtils::WriteNIfTIImage<ComponentsImageType>(PWI, std::string(argv[4]));
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
     }
     catch (itk::ExceptionObject & err)
     {
@@ -94,6 +454,14 @@ int main(int argc, char *argv [])
         std::cerr << err << std::endl;
         return EXIT_FAILURE;
     }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
     
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,186 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Global Principal Compoment Analysis filtering kernels                    *
+***************************************************************************/
+
+#ifndef GLOBALPCADENOISING_HPP
+#define GLOBALPCADENOISING_HPP
+
+#include <Eigen/Dense>
+#include <WorkPartitioner.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+
+/*
+ * Data matrix of a series (masked voxels x time points, voxels in buffer
+ * order) from its buffer and a mask of its volumes. The matrix is allocated
+ * uninitialised and filled through WorkPartitioner::ParallelFor with the
+ * blocks of rows of CorrectNegativeCurves, so on NUMA systems the rows of
+ * every column live on the node of the thread that later corrects them.
+ */
+template<typename PixelType, typename MaskPixelType>
+Eigen::MatrixXf MaskedDataset(const PixelType *buffer, const MaskPixelType *mask, long long voxels, long long timePoints)
+{
+    const long long BlockSize = 1024;
+    std::vector<long long> offsets;
+    for (long long v = 0; v < voxels; ++v)
+        if (mask[v])
+            offsets.push_back(v);
+    Eigen::MatrixXf dataset(offsets.size(), timePoints);
+    WorkPartitioner::ParallelFor(dataset.rows(), BlockSize, [&](long long begin, long long end)
+    {
+        for (long long t = 0; t < timePoints; ++t)
+        {
+            const PixelType *volume = buffer + t * voxels;
+            float *column = dataset.col(t).data();
+            for (long long i = begin; i < end; ++i)
+                column[i] = (float) volume[offsets[i]];
+        }
+    });
+    return dataset;
+}
+
+
+// Data matrix of a 4D series over a 3D mask (the rows of EigenITK::toEigen)
+template<typename ImageType, typename MaskType>
+Eigen::MatrixXf MaskedDataset(const ImageType *image, const MaskType *mask)
+{
+    const typename ImageType::SizeType size = image->GetBufferedRegion().GetSize();
+    const long long voxels = (long long) mask->GetBufferedRegion().GetNumberOfPixels();
+    return MaskedDataset(image->GetBufferPointer(), mask->GetBufferPointer(), voxels, (long long) size[ImageType::ImageDimension - 1]);
+}
+
+
+// Correct curves with negative values
+inline void CorrectNegativeCurves(Eigen::MatrixXf &data)
+{
+    // Every thread sweeps the time points (contiguous columns) of its own block of voxels (rows)
+    const long long BlockSize = 1024;
+    if (data.cols() == 0)
+        return;
+    WorkPartitioner::ParallelFor(data.rows(), BlockSize, [&](long long begin, long long end)
+    {
+        for (long long block = begin; block < end; block += BlockSize)
+        {
+            const Eigen::Index rows = std::min(BlockSize, end - block);
+            Eigen::ArrayXf minimum = data.col(0).segment(block, rows).array();
+            for (Eigen::Index t = 1; t < data.cols(); ++t)
+                minimum = minimum.min(data.col(t).segment(block, rows).array());
+            for (Eigen::Index t = 0; t < data.cols(); ++t)
+                for (Eigen::Index i = 0; i < rows; ++i)
+                    if (minimum(i) <= 0)
+                        data(block + i, t) = data(block + i, t) - minimum(i) + 1;
+        }
+    });
+}
+
+
+// Median of values[first .. last)
+inline double RangeMedian(const Eigen::VectorXd &values, Eigen::Index first, Eigen::Index last)
+{
+    std::vector<double> sorted(values.data() + first, values.data() + last);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    return sorted[sorted.size() / 2];
+}
+
+
+/*
+ * Robust z-scores of a time series around its running median (over windows
+ * of 2 * halfWidth + 1 time points). The scale is the noise (MAD of the second
+ * differences) plus the range of the neighbours of each time point within the
+ * window: wherever the series moves, such as during the passage of a contrast
+ * bolus, the neighbours spread and the running median may lag behind, while a
+ * single time point off quiet neighbours stands out.
+ */
+inline Eigen::VectorXd TrendZScores(const Eigen::VectorXd &values, Eigen::Index halfWidth = 2)
+{
+    const Eigen::Index size = values.size();
+    Eigen::VectorXd z = Eigen::VectorXd::Zero(size);
+    if (size < 2 * halfWidth + 1)
+        return z;
+    const Eigen::VectorXd curvature = (values.segment(1, size - 2) - 0.5 * (values.head(size - 2) + values.tail(size - 2))).cwiseAbs();
+    const double noise = 1.4826 * RangeMedian(curvature, 0, size - 2) / std::sqrt(1.5);
+    for (Eigen::Index t = 0; t < size; ++t)
+    {
+        // The window slides inwards at both ends instead of shrinking
+        const Eigen::Index first = std::min(std::max<Eigen::Index>(0, t - halfWidth), size - 2 * halfWidth - 1);
+        const Eigen::Index last = first + 2 * halfWidth + 1;
+        double minimum = std::numeric_limits<double>::max();
+        double maximum = std::numeric_limits<double>::lowest();
+        for (Eigen::Index i = first; i < last; ++i)
+        {
+            if (i == t)
+                continue;
+            minimum = std::min(minimum, values(i));
+            maximum = std::max(maximum, values(i));
+        }
+        const double scale = noise + maximum - minimum;
+        if (scale > 0)
+            z(t) = (values(t) - RangeMedian(values, first, last)) / scale;
+    }
+    return z;
+}
+
+
+/*
+ * Volume-level outliers (spikes, motion) of a dataset (voxels x time points).
+ * The global intensity of every time point and the RMS over the voxels of its
+ * change from the previous one (DVARS) are accumulated in one sweep over
+ * blocks of voxels. A spike changes both its own DVARS and that of the next
+ * time point, so a time point is scored by the smaller of its changes to the
+ * previous and to the next one, which only stands out for the volume off both
+ * neighbours (the first and last time points only by their intensity). A time
+ * point is flagged when the z-score of its intensity or of that change around
+ * their running medians (see TrendZScores) exceeds threshold.
+ */
+inline std::vector<Eigen::Index> OutlierVolumes(const Eigen::MatrixXf &data, double threshold, Eigen::VectorXd &intensityZ, Eigen::VectorXd &dvarsZ)
+{
+    const long long BlockSize = 1024;
+    const Eigen::Index timePoints = data.cols();
+    Eigen::VectorXd sum = Eigen::VectorXd::Zero(timePoints);
+    Eigen::VectorXd change = Eigen::VectorXd::Zero(timePoints);
+    WorkPartitioner::ParallelFor(data.rows(), BlockSize, [&](long long begin, long long end)
+    {
+        Eigen::VectorXd localSum = Eigen::VectorXd::Zero(timePoints);
+        Eigen::VectorXd localChange = Eigen::VectorXd::Zero(timePoints);
+        for (long long block = begin; block < end; block += BlockSize)
+        {
+            const Eigen::Index rows = std::min(BlockSize, end - block);
+            for (Eigen::Index t = 0; t < timePoints; ++t)
+            {
+                localSum(t) += data.col(t).segment(block, rows).cast<double>().sum();
+                if (t > 0)
+                    localChange(t) += (data.col(t).segment(block, rows) - data.col(t - 1).segment(block, rows)).cast<double>().squaredNorm();
+            }
+        }
+        #pragma omp critical
+        {
+            sum += localSum;
+            change += localChange;
+        }
+    });
+    const double voxels = std::max<double>(1, data.rows());
+    intensityZ = TrendZScores(sum / voxels);
+    // Smaller of the DVARS to both neighbours, which the first and last time points do not have
+    dvarsZ = Eigen::VectorXd::Zero(timePoints);
+    if (timePoints > 2)
+    {
+        const Eigen::VectorXd dvars = (change / voxels).cwiseSqrt();
+        dvarsZ.segment(1, timePoints - 2) = TrendZScores(dvars.segment(1, timePoints - 2).cwiseMin(dvars.tail(timePoints - 2)));
+    }
+    std::vector<Eigen::Index> outliers;
+    for (Eigen::Index t = 0; t < timePoints; ++t)
+        if (std::abs(intensityZ(t)) > threshold || dvarsZ(t) > threshold)
+            outliers.push_back(t);
+    return outliers;
+}
+
+#endif
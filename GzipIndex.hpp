@@ -0,0 +1,337 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Random access to gzip compressed files                                   *
+***************************************************************************/
+
+#ifndef GZIPINDEX_HPP
+#define GZIPINDEX_HPP
+
+#include <XXHash.hpp>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <itk_zlib.h>
+
+/*
+ * Random access index of a gzip file, after zlib's zran example. Access
+ * points every span bytes of uncompressed data keep the compressed position
+ * and the last 32 KiB of output, from which inflation can resume. Building the
+ * index costs one full inflate. It is saved in a per user temporary directory
+ * ($TMPDIR/onts-zidx-<uid>, never next to the file, where it would show up as
+ * a volume of the directory), under a name that hashes the path, size and
+ * modification time of the file, and reused while the file is unchanged, so
+ * reading a region only inflates from the closest access point before it.
+ * Consecutive forward reads reuse the inflate state.
+ */
+class GzipIndex
+{
+public:
+    GzipIndex(const std::string &fileName, long long span = 4LL << 20) : m_FileName(fileName), m_File(NULL), m_Active(false), m_Position(0), m_Input(InputSize)
+    {
+        struct stat status;
+        if (stat(fileName.c_str(), &status) != 0)
+            throw std::runtime_error("Unable to access file: " + fileName);
+        m_FileSize = (std::uint64_t) status.st_size;
+        // Nanoseconds, so a same-size rewrite within the same second still invalidates the index
+        m_FileTime = (std::int64_t) status.st_mtim.tv_sec * 1000000000LL + (std::int64_t) status.st_mtim.tv_nsec;
+        m_IndexFileName = IndexFileName();
+        if (!Load())
+        {
+            Build(span);
+            Save();
+        }
+        m_File = std::fopen(fileName.c_str(), "rb");
+        if (m_File == NULL)
+            throw std::runtime_error("Unable to read file: " + fileName);
+    }
+
+    ~GzipIndex()
+    {
+        if (m_Active)
+            inflateEnd(&m_Stream);
+        if (m_File != NULL)
+            std::fclose(m_File);
+    }
+
+    // Read length bytes of uncompressed data starting at offset
+    void Read(long long offset, long long length, void *buffer)
+    {
+        const AccessPoint &point = Closest(offset);
+        // Resume from the access point unless the current stream is already between it and the offset
+        if (!m_Active || offset < m_Position || point.out > m_Position)
+            Seek(point);
+        std::vector<unsigned char> discard;
+        while (m_Position < offset)
+        {
+            discard.resize(WindowSize);
+            const long long skip = std::min<long long>(offset - m_Position, WindowSize);
+            Inflate(discard.data(), skip);
+        }
+        Inflate(static_cast<unsigned char *>(buffer), length);
+    }
+
+    std::size_t AccessPoints() const
+    {
+        return m_Points.size();
+    }
+
+private:
+    GzipIndex(const GzipIndex &);
+    GzipIndex &operator=(const GzipIndex &);
+
+    static const unsigned int WindowSize = 32768;
+    static const unsigned int InputSize = 131072;
+
+    struct AccessPoint
+    {
+        std::int64_t out;
+        std::int64_t in;
+        std::int32_t bits;
+        std::vector<unsigned char> window;
+    };
+
+    std::string IndexFileName() const
+    {
+        const char *temporary = std::getenv("TMPDIR");
+        std::ostringstream directory;
+        directory << ((temporary != NULL && *temporary != '\0') ? temporary : "/tmp") << "/onts-zidx-" << getuid();
+        mkdir(directory.str().c_str(), 0700);
+        char path[PATH_MAX];
+        XXHash64 hash;
+        hash.Update(realpath(m_FileName.c_str(), path) != NULL ? std::string(path) : m_FileName);
+        hash.Update(&m_FileSize, sizeof(m_FileSize));
+        hash.Update(&m_FileTime, sizeof(m_FileTime));
+        std::ostringstream s;
+        s << directory.str() << "/" << std::hex << std::setfill('0') << std::setw(16) << hash.Digest() << ".zidx";
+        return s.str();
+    }
+
+    void Build(long long span)
+    {
+        std::unique_ptr<std::FILE, int (*)(std::FILE *)> file(std::fopen(m_FileName.c_str(), "rb"), std::fclose);
+        if (!file)
+            throw std::runtime_error("Unable to read file: " + m_FileName);
+        z_stream stream;
+        std::memset(&stream, 0, sizeof(stream));
+        // Automatic zlib or gzip header decoding
+        if (inflateInit2(&stream, 47) != Z_OK)
+            throw std::runtime_error("Unable to initialize inflate");
+        std::vector<unsigned char> input(InputSize);
+        std::vector<unsigned char> window(WindowSize);
+        long long totalIn = 0;
+        long long totalOut = 0;
+        long long last = 0;
+        int status = Z_OK;
+        stream.avail_out = 0;
+        do
+        {
+            stream.avail_in = (uInt) std::fread(input.data(), 1, InputSize, file.get());
+            if (std::ferror(file.get()) || stream.avail_in == 0)
+            {
+                inflateEnd(&stream);
+                throw std::runtime_error("Unexpected end of compressed file: " + m_FileName);
+            }
+            stream.next_in = input.data();
+            do
+            {
+                // The window keeps the last 32 KiB of output
+                if (stream.avail_out == 0)
+                {
+                    stream.avail_out = WindowSize;
+                    stream.next_out = window.data();
+                }
+                totalIn += stream.avail_in;
+                totalOut += stream.avail_out;
+                // Stop at the end of every deflate block
+                status = inflate(&stream, Z_BLOCK);
+                totalIn -= stream.avail_in;
+                totalOut -= stream.avail_out;
+                if (status == Z_NEED_DICT || status == Z_MEM_ERROR || status == Z_DATA_ERROR)
+                {
+                    inflateEnd(&stream);
+                    throw std::runtime_error("Invalid compressed data: " + m_FileName);
+                }
+                if (status == Z_STREAM_END)
+                    break;
+                // Block boundary that is not the last block: candidate access point
+                if ((stream.data_type & 128) && !(stream.data_type & 64) && (totalOut == 0 || totalOut - last > span))
+                {
+                    AddPoint(stream.data_type & 7, totalIn, totalOut, stream.avail_out, window);
+                    last = totalOut;
+                }
+            }
+            while (stream.avail_in != 0);
+        }
+        while (status != Z_STREAM_END);
+        inflateEnd(&stream);
+    }
+
+    void AddPoint(int bits, long long in, long long out, unsigned int left, const std::vector<unsigned char> &window)
+    {
+        AccessPoint point;
+        point.bits = bits;
+        point.in = in;
+        point.out = out;
+        point.window.resize(WindowSize);
+        // Unroll the circular window so the oldest byte comes first
+        if (left)
+            std::memcpy(point.window.data(), window.data() + WindowSize - left, left);
+        if (left < WindowSize)
+            std::memcpy(point.window.data() + left, window.data(), WindowSize - left);
+        m_Points.push_back(point);
+    }
+
+    const AccessPoint &Closest(long long offset) const
+    {
+        if (m_Points.empty())
+            throw std::runtime_error("Empty gzip index: " + m_FileName);
+        std::size_t first = 0;
+        std::size_t last = m_Points.size();
+        while (last - first > 1)
+        {
+            const std::size_t middle = (first + last) / 2;
+            if (m_Points[middle].out <= offset)
+                first = middle;
+            else
+                last = middle;
+        }
+        return m_Points[first];
+    }
+
+    void Seek(const AccessPoint &point)
+    {
+        if (m_Active)
+            inflateEnd(&m_Stream);
+        std::memset(&m_Stream, 0, sizeof(m_Stream));
+        // Raw inflate, the gzip header was consumed when the index was built
+        if (inflateInit2(&m_Stream, -15) != Z_OK)
+            throw std::runtime_error("Unable to initialize inflate");
+        m_Active = true;
+        if (fseeko(m_File, point.in - (point.bits ? 1 : 0), SEEK_SET) != 0)
+            throw std::runtime_error("Unable to seek in file: " + m_FileName);
+        if (point.bits)
+        {
+            const int byte = std::getc(m_File);
+            if (byte == EOF)
+                throw std::runtime_error("Unexpected end of compressed file: " + m_FileName);
+            inflatePrime(&m_Stream, point.bits, byte >> (8 - point.bits));
+        }
+        inflateSetDictionary(&m_Stream, point.window.data(), WindowSize);
+        m_Stream.avail_in = 0;
+        m_Position = point.out;
+    }
+
+    void Inflate(unsigned char *output, long long length)
+    {
+        while (length > 0)
+        {
+            const uInt chunk = (uInt) std::min<long long>(length, 1LL << 30);
+            m_Stream.next_out = output;
+            m_Stream.avail_out = chunk;
+            while (m_Stream.avail_out != 0)
+            {
+                if (m_Stream.avail_in == 0)
+                {
+                    m_Stream.avail_in = (uInt) std::fread(m_Input.data(), 1, InputSize, m_File);
+                    if (std::ferror(m_File) || m_Stream.avail_in == 0)
+                        throw std::runtime_error("Unexpected end of compressed file: " + m_FileName);
+                    m_Stream.next_in = m_Input.data();
+                }
+                const int status = inflate(&m_Stream, Z_NO_FLUSH);
+                if (status == Z_NEED_DICT || status == Z_MEM_ERROR || status == Z_DATA_ERROR)
+                    throw std::runtime_error("Invalid compressed data: " + m_FileName);
+                if (status == Z_STREAM_END && m_Stream.avail_out != 0)
+                    throw std::runtime_error("Read past the end of compressed file: " + m_FileName);
+            }
+            output += chunk;
+            length -= chunk;
+            m_Position += chunk;
+        }
+    }
+
+    bool Load()
+    {
+        std::ifstream file(m_IndexFileName.c_str(), std::ios::binary);
+        if (!file)
+            return false;
+        char magic[8];
+        std::uint64_t size, count;
+        std::int64_t time;
+        file.read(magic, 8);
+        file.read(reinterpret_cast<char *>(&size), sizeof(size));
+        file.read(reinterpret_cast<char *>(&time), sizeof(time));
+        file.read(reinterpret_cast<char *>(&count), sizeof(count));
+        // Stale or foreign index
+        if (!file || std::memcmp(magic, "ONTSZIDX", 8) != 0 || size != m_FileSize || time != m_FileTime)
+            return false;
+        std::vector<AccessPoint> points(count);
+        for (std::size_t i = 0; i < count && file; ++i)
+        {
+            file.read(reinterpret_cast<char *>(&points[i].out), sizeof(points[i].out));
+            file.read(reinterpret_cast<char *>(&points[i].in), sizeof(points[i].in));
+            file.read(reinterpret_cast<char *>(&points[i].bits), sizeof(points[i].bits));
+            points[i].window.resize(WindowSize);
+            file.read(reinterpret_cast<char *>(points[i].window.data()), WindowSize);
+        }
+        if (!file)
+            return false;
+        m_Points.swap(points);
+        return true;
+    }
+
+    // Best effort, an index that cannot be saved is simply rebuilt next time
+    void Save() const
+    {
+        // Publish atomically, so concurrent readers never load a partial index
+        std::ostringstream temporary;
+        temporary << m_IndexFileName << ".tmp." << getpid();
+        std::ofstream file(temporary.str().c_str(), std::ios::binary);
+        if (!file)
+            return;
+        const std::uint64_t count = m_Points.size();
+        file.write("ONTSZIDX", 8);
+        file.write(reinterpret_cast<const char *>(&m_FileSize), sizeof(m_FileSize));
+        file.write(reinterpret_cast<const char *>(&m_FileTime), sizeof(m_FileTime));
+        file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        for (std::size_t i = 0; i < m_Points.size(); ++i)
+        {
+            file.write(reinterpret_cast<const char *>(&m_Points[i].out), sizeof(m_Points[i].out));
+            file.write(reinterpret_cast<const char *>(&m_Points[i].in), sizeof(m_Points[i].in));
+            file.write(reinterpret_cast<const char *>(&m_Points[i].bits), sizeof(m_Points[i].bits));
+            file.write(reinterpret_cast<const char *>(m_Points[i].window.data()), WindowSize);
+        }
+        file.close();
+        if (!file || std::rename(temporary.str().c_str(), m_IndexFileName.c_str()) != 0)
+            unlink(temporary.str().c_str());
+    }
+
+    std::string m_FileName;
+    std::string m_IndexFileName;
+    std::uint64_t m_FileSize;
+    std::int64_t m_FileTime;
+    std::vector<AccessPoint> m_Points;
+    std::FILE *m_File;
+    z_stream m_Stream;
+    bool m_Active;
+    long long m_Position;
+    std::vector<unsigned char> m_Input;
+};
+
+#endif
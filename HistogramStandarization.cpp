@@ -9,19 +9,27 @@
 ***************************************************************************/
 
 #include <ITKUtils.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <Dispatch.hpp>
+#include <HistogramStandarization.hpp>
 #include <itkImage.h>
-#include <itkHistogramMatchingImageFilter.h>
 
 
-template<class ImageType>
-void HistogramMatching(int argc, char *argv[])
+template<class ImageType, class MaskType>
+void HistogramMatching(int argc, char *argv[], const CommandLineOptions &options, Profiler &profiler)
 {
-    using HistogramMatchingFilterType = itk::HistogramMatchingImageFilter<ImageType, ImageType>;
-
     // Read input image
+    profiler.Start("read");
     typename ImageType::Pointer imageSource = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
     // Read reference image
     typename ImageType::Pointer imageReference = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[2]));
+    // Read the mask the histograms are restricted to
+    typename MaskType::Pointer mask;
+    if (options.Has("mask"))
+        mask = ITKUtils::ReadNIfTIImage<MaskType>(options.Get("mask"));
+    profiler.Start("compute");
     // Check consistency
     ITKUtils::AssertCompatibleImageAndMaskSizes<ImageType, ImageType>(imageSource, imageReference);
     // Get number of histogram bins
@@ -32,24 +40,24 @@ void HistogramMatching(int argc, char *argv[])
     unsigned int matchPoints = 10;
     if (argc > 5)
         matchPoints = (unsigned int) std::atoi(argv[5]);
-    // Apply histogram matching filter
-    typename HistogramMatchingFilterType::Pointer matcher = HistogramMatchingFilterType::New();
-    matcher->SetSourceImage(imageSource);
-    matcher->SetReferenceImage(imageReference);
-    matcher->SetNumberOfHistogramLevels(bins);
-    matcher->SetNumberOfMatchPoints(matchPoints);
-    matcher->ThresholdAtMeanIntensityOn();
-    matcher->Update();
+    // Histograms from every n-th voxel only
+    const unsigned int subsample = (unsigned int) std::atoi(options.Get("subsample", "1").c_str());
+    // Apply histogram matching
+    typename ImageType::Pointer output = HistogramMatch<ImageType, MaskType>(imageSource, imageReference, bins, matchPoints, mask.GetPointer(), subsample);
     // Save image
-    ITKUtils::WriteNIfTIImage<ImageType>(matcher->GetOutput(), std::string(argv[3]));
+    profiler.Start("write");
+    ITKUtils::WriteNIfTIImage<ImageType>(output, std::string(argv[3]));
+    profiler.Stop();
 }
 
 
 int main(int argc, char *argv[])
 {
+    CommandLineOptions options(argc, argv);
     if (argc < 4)
     {
-        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: HistogramStandarization sourceImage referenceImage outputImage [bins=128] [matchPoints=10]" << std::endl;
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: HistogramStandarization sourceImage referenceImage outputImage [bins=128] [matchPoints=10] [--mask=maskImage] [--subsample=1] [--cache=directory] [--profile=json|text]" << std::endl;
+        std::cerr << "--mask, --subsample:\tbuild the histograms from the voxels inside the mask and/or every n-th voxel, the mapping is applied to the whole image" << std::endl;
         return EXIT_FAILURE;
     }
 
@@ -59,6 +67,12 @@ int main(int argc, char *argv[])
     const unsigned int SourceImageDimension = sourceIO->GetNumberOfDimensions();
     const unsigned int ReferenceImageDimension = referenceIO->GetNumberOfDimensions();
 
+    Profiler profiler("HistogramStandardization", options.Get("profile"));
+    profiler.SetImageInformation(sourceIO);
+    profiler.AddInput(std::string(argv[1]));
+    profiler.AddInput(std::string(argv[2]));
+    ResultCache cache(options.Get("cache"), "HistogramStandardization");
+
     if (SourceImageDimension != ReferenceImageDimension)
     {
         std::cerr << "Incompatible image dimensions" << std::endl;
@@ -73,12 +87,31 @@ int main(int argc, char *argv[])
     
     try
     {
-        if (SourceImageDimension == 2)
-            HistogramMatching<itk::Image<float, 2>>(argc, argv);
-        else if (SourceImageDimension == 3)
-            HistogramMatching<itk::Image<float, 3>>(argc, argv);
-        else
-            HistogramMatching<itk::Image<float, 4>>(argc, argv);
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        cache.AddInput(std::string(argv[1]));
+        cache.AddInput(std::string(argv[2]));
+        if (options.Has("mask"))
+            cache.AddInput(options.Get("mask"));
+        cache.AddParameters(4, argc, argv);
+        cache.AddOptions(options);
+        cache.AddOutput(std::string(argv[3]));
+        if (cache.Fetch())
+        {
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        Dispatch::ByDimension<2, 3, 4>(SourceImageDimension, [&](auto dimension)
+        {
+            // A 4D image takes a 3D mask
+            const unsigned int Dimension = decltype(dimension)::value;
+            HistogramMatching<itk::Image<float, Dimension>, itk::Image<unsigned char, (Dimension > 3) ? 3 : Dimension>>(argc, argv, options, profiler);
+        });
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
     }
     catch (itk::ExceptionObject & err)
     {
@@ -86,4 +119,14 @@ int main(int argc, char *argv[])
         std::cerr << err << std::endl;
         return EXIT_FAILURE;
     }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
+
+    return EXIT_SUCCESS;
 }
\ No newline at end of file
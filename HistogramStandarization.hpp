@@ -0,0 +1,217 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2014 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Histogram standarization kernels                                         *
+***************************************************************************/
+
+#ifndef HISTOGRAMSTANDARIZATION_HPP
+#define HISTOGRAMSTANDARIZATION_HPP
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include <omp.h>
+#include <itkImage.h>
+
+
+/*
+ * Histogram matching with the semantics of ITK's HistogramMatchingImageFilter
+ * (ThresholdAtMeanIntensityOn): histograms over [mean, maximum], match points
+ * at evenly spaced quantiles interpolated within the bins, and piecewise
+ * linear mapping between them, extrapolated below the first one. Every pass
+ * is multithreaded: minimum, maximum and mean are reductions, each thread
+ * fills its own histogram and the histograms are merged at the end. The
+ * samples can be restricted to a mask (spanning the leading dimensions of the
+ * images) and/or to every subsample-th voxel; the mapping is applied to all
+ * the voxels.
+ */
+namespace HistogramEngine
+{
+    struct Statistics
+    {
+        double minimum;
+        double maximum;
+        double mean;
+    };
+
+    // Minimum, maximum and mean of the sampled voxels
+    template<typename PixelType, typename MaskPixelType>
+    Statistics SampleStatistics(const PixelType *buffer, long long voxels, const MaskPixelType *mask, long long maskVoxels, long long subsample)
+    {
+        double minimum = std::numeric_limits<double>::max();
+        double maximum = std::numeric_limits<double>::lowest();
+        double sum = 0;
+        long long samples = 0;
+        #pragma omp parallel for schedule(static) reduction(min:minimum) reduction(max:maximum) reduction(+:sum,samples)
+        for (long long i = 0; i < voxels; i += subsample)
+        {
+            if (mask != NULL && !mask[i % maskVoxels])
+                continue;
+            const double value = (double) buffer[i];
+            minimum = std::min(minimum, value);
+            maximum = std::max(maximum, value);
+            sum += value;
+            ++samples;
+        }
+        if (samples == 0)
+            throw std::runtime_error("No voxels to build the histogram from");
+        Statistics statistics = {minimum, maximum, sum / samples};
+        return statistics;
+    }
+
+    // Histogram of the sampled voxels in [lower, upper] with equally spaced bins, one per thread and merged
+    template<typename PixelType, typename MaskPixelType>
+    std::vector<double> SampleHistogram(const PixelType *buffer, long long voxels, const MaskPixelType *mask, long long maskVoxels, long long subsample, unsigned int bins, double lower, double upper)
+    {
+        const double scale = (upper > lower) ? bins / (upper - lower) : 0;
+        std::vector<std::vector<double>> histograms(omp_get_max_threads(), std::vector<double>(bins, 0.0));
+        #pragma omp parallel
+        {
+            std::vector<double> &histogram = histograms[omp_get_thread_num()];
+            #pragma omp for schedule(static)
+            for (long long i = 0; i < voxels; i += subsample)
+            {
+                if (mask != NULL && !mask[i % maskVoxels])
+                    continue;
+                const double value = (double) buffer[i];
+                if (value < lower || value > upper)
+                    continue;
+                // The upper bound falls in the last bin
+                histogram[std::min<long long>(bins - 1, (long long) ((value - lower) * scale))] += 1;
+            }
+        }
+        for (std::size_t t = 1; t < histograms.size(); ++t)
+            for (unsigned int b = 0; b < bins; ++b)
+                histograms[0][b] += histograms[t][b];
+        return histograms[0];
+    }
+
+    // Quantile p of a histogram over [lower, upper], interpolated within its bin as itk::Statistics::Histogram does
+    inline double Quantile(const std::vector<double> &histogram, double lower, double upper, double p)
+    {
+        const long long bins = (long long) histogram.size();
+        const double width = (upper - lower) / bins;
+        double total = 0;
+        for (long long b = 0; b < bins; ++b)
+            total += histogram[b];
+        if (total == 0)
+            return lower;
+        double cumulated = 0;
+        double frequency = 0;
+        double previous = 0;
+        double current = 0;
+        if (p < 0.5)
+        {
+            long long n = 0;
+            do
+            {
+                frequency = histogram[n];
+                cumulated += frequency;
+                previous = current;
+                current = cumulated / total;
+                ++n;
+            }
+            while (n < bins && current < p);
+            return lower + (n - 1) * width + ((p - previous) / (frequency / total)) * width;
+        }
+        long long n = bins - 1;
+        long long m = 0;
+        current = 1.0;
+        do
+        {
+            frequency = histogram[n];
+            cumulated += frequency;
+            previous = current;
+            current = 1.0 - cumulated / total;
+            --n;
+            ++m;
+        }
+        while (m < bins && current > p);
+        return lower + (n + 2) * width - ((previous - p) / (frequency / total)) * width;
+    }
+}
+
+
+template<class ImageType, class MaskType = itk::Image<unsigned char, ImageType::ImageDimension>>
+typename ImageType::Pointer HistogramMatch(const ImageType *imageSource, const ImageType *imageReference, unsigned int bins, unsigned int matchPoints, const MaskType *mask = NULL, unsigned int subsample = 1)
+{
+    typedef typename ImageType::PixelType PixelType;
+    typedef typename MaskType::PixelType MaskPixelType;
+    const PixelType *source = imageSource->GetBufferPointer();
+    const PixelType *reference = imageReference->GetBufferPointer();
+    const long long sourceVoxels = (long long) imageSource->GetBufferedRegion().GetNumberOfPixels();
+    const long long referenceVoxels = (long long) imageReference->GetBufferedRegion().GetNumberOfPixels();
+    const MaskPixelType *maskBuffer = (mask != NULL) ? mask->GetBufferPointer() : NULL;
+    const long long maskVoxels = (mask != NULL) ? (long long) mask->GetBufferedRegion().GetNumberOfPixels() : 1;
+    const long long step = std::max(1u, subsample);
+    // The mask spans the leading dimensions of both images (a 4D image can be passed with a 3D mask)
+    if (mask != NULL)
+    {
+        const typename ImageType::SizeType sourceSize = imageSource->GetBufferedRegion().GetSize();
+        const typename ImageType::SizeType referenceSize = imageReference->GetBufferedRegion().GetSize();
+        const typename MaskType::SizeType maskSize = mask->GetBufferedRegion().GetSize();
+        for (unsigned int i = 0; i < MaskType::ImageDimension; ++i)
+            if (sourceSize[i] != maskSize[i] || referenceSize[i] != maskSize[i])
+                throw std::runtime_error("Image and mask sizes are different");
+    }
+    // Histograms above the mean intensity
+    const HistogramEngine::Statistics sourceStatistics = HistogramEngine::SampleStatistics(source, sourceVoxels, maskBuffer, maskVoxels, step);
+    const HistogramEngine::Statistics referenceStatistics = HistogramEngine::SampleStatistics(reference, referenceVoxels, maskBuffer, maskVoxels, step);
+    const std::vector<double> sourceHistogram = HistogramEngine::SampleHistogram(source, sourceVoxels, maskBuffer, maskVoxels, step, bins, sourceStatistics.mean, sourceStatistics.maximum);
+    const std::vector<double> referenceHistogram = HistogramEngine::SampleHistogram(reference, referenceVoxels, maskBuffer, maskVoxels, step, bins, referenceStatistics.mean, referenceStatistics.maximum);
+    // Match points: the threshold, matchPoints quantiles and the maximum
+    const unsigned int knots = matchPoints + 2;
+    std::vector<double> sourceKnots(knots);
+    std::vector<double> referenceKnots(knots);
+    sourceKnots[0] = sourceStatistics.mean;
+    referenceKnots[0] = referenceStatistics.mean;
+    sourceKnots[knots - 1] = sourceStatistics.maximum;
+    referenceKnots[knots - 1] = referenceStatistics.maximum;
+    const double delta = 1.0 / (matchPoints + 1);
+    for (unsigned int j = 1; j <= matchPoints; ++j)
+    {
+        sourceKnots[j] = HistogramEngine::Quantile(sourceHistogram, sourceStatistics.mean, sourceStatistics.maximum, j * delta);
+        referenceKnots[j] = HistogramEngine::Quantile(referenceHistogram, referenceStatistics.mean, referenceStatistics.maximum, j * delta);
+    }
+    // Slope and intercept of every segment of the mapping, segment j holds the values with j knots at or below them
+    std::vector<double> slopes(knots + 1, 0.0);
+    std::vector<double> intercepts(knots + 1, 0.0);
+    const double lowerDenominator = sourceKnots[0] - sourceStatistics.minimum;
+    slopes[0] = (lowerDenominator != 0) ? (referenceKnots[0] - referenceStatistics.minimum) / lowerDenominator : 0;
+    intercepts[0] = referenceKnots[0] - sourceKnots[0] * slopes[0];
+    for (unsigned int j = 1; j < knots; ++j)
+    {
+        const double denominator = sourceKnots[j] - sourceKnots[j - 1];
+        slopes[j] = (denominator != 0) ? (referenceKnots[j] - referenceKnots[j - 1]) / denominator : 0;
+        intercepts[j] = referenceKnots[j - 1] - sourceKnots[j - 1] * slopes[j];
+    }
+    // The last segment continues above the maximum, which only unsampled voxels can exceed
+    slopes[knots] = slopes[knots - 1];
+    intercepts[knots] = intercepts[knots - 1];
+    // Apply the mapping through the segment tables, branch free so the knot search vectorizes
+    typename ImageType::Pointer output = ImageType::New();
+    output->CopyInformation(imageSource);
+    output->SetRegions(imageSource->GetBufferedRegion());
+    output->Allocate(false);
+    PixelType *outputBuffer = output->GetBufferPointer();
+    const double *knotsBuffer = sourceKnots.data();
+    const double *slopesBuffer = slopes.data();
+    const double *interceptsBuffer = intercepts.data();
+    #pragma omp parallel for simd schedule(static)
+    for (long long i = 0; i < sourceVoxels; ++i)
+    {
+        const double value = (double) source[i];
+        int segment = 0;
+        for (unsigned int j = 0; j < knots; ++j)
+            segment += (value >= knotsBuffer[j]);
+        outputBuffer[i] = (PixelType) (interceptsBuffer[segment] + value * slopesBuffer[segment]);
+    }
+    return output;
+}
+
+#endif
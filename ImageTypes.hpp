@@ -0,0 +1,51 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Shared instantiations of the ITK image types of the tools                *
+***************************************************************************/
+
+#ifndef IMAGETYPES_HPP
+#define IMAGETYPES_HPP
+
+#include <itkImage.h>
+#include <itkImageFileReader.h>
+#include <itkImageFileWriter.h>
+
+/*
+ * The scalar images the tools read and write. The ITK image, reader and
+ * writer templates of every pixel type and dimension are instantiated once
+ * in the ONTsImageTypes library (ImageTypes2D/3D/4D.cpp). The tools, built
+ * with ONTS_EXTERN_IMAGE_TEMPLATES, only declare them, so they no longer
+ * compile their own copies.
+ */
+#define ONTS_FOR_EACH_PIXEL_TYPE(MACRO, DIMENSION) \
+    MACRO(unsigned char, DIMENSION) \
+    MACRO(char, DIMENSION) \
+    MACRO(unsigned short, DIMENSION) \
+    MACRO(short, DIMENSION) \
+    MACRO(unsigned int, DIMENSION) \
+    MACRO(int, DIMENSION) \
+    MACRO(unsigned long, DIMENSION) \
+    MACRO(long, DIMENSION) \
+    MACRO(float, DIMENSION) \
+    MACRO(double, DIMENSION)
+
+#define ONTS_IMAGE_TEMPLATES(PREFIX, PIXEL, DIMENSION) \
+    PREFIX template class itk::Image<PIXEL, DIMENSION>; \
+    PREFIX template class itk::ImageFileReader<itk::Image<PIXEL, DIMENSION>>; \
+    PREFIX template class itk::ImageFileWriter<itk::Image<PIXEL, DIMENSION>>;
+
+#define ONTS_EXTERN_IMAGE_TYPE(PIXEL, DIMENSION) ONTS_IMAGE_TEMPLATES(extern, PIXEL, DIMENSION)
+#define ONTS_INSTANTIATE_IMAGE_TYPE(PIXEL, DIMENSION) ONTS_IMAGE_TEMPLATES(, PIXEL, DIMENSION)
+
+#ifdef ONTS_EXTERN_IMAGE_TEMPLATES
+ONTS_FOR_EACH_PIXEL_TYPE(ONTS_EXTERN_IMAGE_TYPE, 2)
+ONTS_FOR_EACH_PIXEL_TYPE(ONTS_EXTERN_IMAGE_TYPE, 3)
+ONTS_FOR_EACH_PIXEL_TYPE(ONTS_EXTERN_IMAGE_TYPE, 4)
+#endif
+
+#endif
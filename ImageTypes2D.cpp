@@ -0,0 +1,13 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* 2D image type instantiations                                             *
+***************************************************************************/
+
+#include <ImageTypes.hpp>
+
+ONTS_FOR_EACH_PIXEL_TYPE(ONTS_INSTANTIATE_IMAGE_TYPE, 2)
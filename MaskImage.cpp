@@ -9,71 +9,254 @@
 ***************************************************************************/
 
 #include <ITKUtils.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <Dispatch.hpp>
+#include <MaskImage.hpp>
+#include <MemoryBudget.hpp>
+#include <NIfTIUtils.hpp>
+#include <WorkPartitioner.hpp>
 #include <itkImage.h>
-#include <itkMaskImageFilter.h>
-#include <itkChangeInformationImageFilter.h>
-#include <itkSliceBySliceImageFilter.h>
+#include <itkVectorImage.h>
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
+/*
+ * Mask on the grid of the image: the mask itself when the grids match, else
+ * the mask resampled with nearest neighbour. Resampled masks are kept in the
+ * --cache directory keyed by the mask content and the target grid, so a batch
+ * of images on one grid resamples the mask once.
+ */
 template<typename ImageType, typename MaskType>
-void MaskImageEqualDimensions(char *argv[])
+typename MaskType::Pointer GridMask(const ImageType *image, const MaskType *mask, const std::string &maskFile, const std::string &cacheDirectory)
+{
+    if (SameGrid<ImageType, MaskType>(image, mask))
+        return const_cast<MaskType *>(mask);
+    ResultCache cache(cacheDirectory, "MaskImage-ResampleMask");
+    std::ostringstream temporary;
+    temporary << cacheDirectory << "/resampled-mask-" << getpid() << ".nii.gz";
+    cache.AddInput(maskFile);
+    cache.AddParameter(GridKey<ImageType, MaskType>(image));
+    cache.AddOutput(temporary.str());
+    typename MaskType::Pointer resampled;
+    if (cache.Fetch())
+        resampled = ITKUtils::ReadNIfTIImage<MaskType>(temporary.str());
+    else
+    {
+        resampled = ResampleMask<ImageType, MaskType>(image, mask);
+        if (cache.Enabled())
+        {
+            mkdir(cacheDirectory.c_str(), 0775);
+            ITKUtils::WriteNIfTIImage<MaskType>(resampled, temporary.str());
+            cache.Store();
+        }
+    }
+    if (cache.Enabled())
+        unlink(temporary.str().c_str());
+    return resampled;
+}
+
+
+// Whole input image, through NIfTIUtils when it is chunked (ITK cannot read the voxels of the header-only sidecar)
+template<typename ImageType>
+typename ImageType::Pointer ReadInputImage(const std::string &fileName, const ImageType *)
+{
+    if (NIfTIUtils::IsChunkedImage(fileName))
+        return NIfTIUtils::ReadImage<ImageType>(fileName);
+    return ITKUtils::ReadNIfTIImage<ImageType>(fileName);
+}
+
+// Chunked images are always scalar
+template<typename PixelType, unsigned int Dimension>
+typename itk::VectorImage<PixelType, Dimension>::Pointer ReadInputImage(const std::string &fileName, const itk::VectorImage<PixelType, Dimension> *)
+{
+    if (NIfTIUtils::IsChunkedImage(fileName))
+        throw std::runtime_error("Chunked images are scalar: " + fileName);
+    return ITKUtils::ReadNIfTIImage<itk::VectorImage<PixelType, Dimension>>(fileName);
+}
+
+
+template<typename ImageType, typename MaskType>
+void MaskImageEqualDimensions(char *argv[], const std::string &cacheDirectory, Profiler &profiler)
 {
     // Read image
-    typename ImageType::Pointer image = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
+    profiler.Start("read");
+    typename ImageType::Pointer image = ReadInputImage(std::string(argv[1]), (const ImageType *) NULL);
     // Read mask
     typename MaskType::Pointer mask = ITKUtils::ReadNIfTIImage<MaskType>(std::string(argv[2]));
-    // Define the mask image filter type
-    using MaskImageFilterType = itk::MaskImageFilter<ImageType, MaskType>;
-    // Create mask image filter
-    typename MaskImageFilterType::Pointer maskFilter = MaskImageFilterType::New();
-    maskFilter->SetCoordinateTolerance(1e-4);
-    maskFilter->SetDirectionTolerance(1e-4);
-    maskFilter->SetInput(image);
-    maskFilter->SetMaskImage(mask);
-    maskFilter->Update();
+    // Mask image
+    profiler.Start("compute");
+    mask = GridMask<ImageType, MaskType>(image, mask, std::string(argv[2]), cacheDirectory);
+    typename ImageType::Pointer output = MaskEqualDimensions<ImageType, MaskType>(image, mask);
     // Save image
-    ITKUtils::WriteNIfTIImage<ImageType>(maskFilter->GetOutput(), std::string(argv[3]));
+    profiler.Start("write");
+    ITKUtils::WriteNIfTIImage<ImageType>(output, std::string(argv[3]));
+    profiler.Stop();
 }
 
 
 template<typename ImageType, typename MaskType>
-void MaskImageDifferentDimensions(char *argv[])
+void MaskImageDifferentDimensions(char *argv[], const std::string &cacheDirectory, Profiler &profiler)
 {
     // Read image
-    typename ImageType::Pointer image = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
+    profiler.Start("read");
+    typename ImageType::Pointer image = ReadInputImage(std::string(argv[1]), (const ImageType *) NULL);
     // Read mask
     typename MaskType::Pointer mask = ITKUtils::ReadNIfTIImage<MaskType>(std::string(argv[2]));
-    // Declare slice by slice type
-    using SliceBySliceImageFilterType = itk::SliceBySliceImageFilter<ImageType, ImageType>;
-    // Define the change image info filter type with the internal type of slice to slice image filter
-    using ChangeInformationImageFilterType = itk::ChangeInformationImageFilter<typename SliceBySliceImageFilterType::InternalInputImageType>;
-    typename ChangeInformationImageFilterType::Pointer changeInformationImageFilter = ChangeInformationImageFilterType::New();
-    changeInformationImageFilter->SetOutputSpacing(mask->GetSpacing());
-    changeInformationImageFilter->ChangeSpacingOn();
-    changeInformationImageFilter->SetOutputOrigin(mask->GetOrigin());
-    changeInformationImageFilter->ChangeOriginOn();
-    changeInformationImageFilter->SetOutputDirection(mask->GetDirection());
-    changeInformationImageFilter->ChangeDirectionOn();
-    // Define the mask image filter type with the internal type of slice to slice image filter
-    using MaskImageFilterType = itk::MaskImageFilter<typename SliceBySliceImageFilterType::InternalInputImageType, MaskType>;
-    typename MaskImageFilterType::Pointer maskFilter = MaskImageFilterType::New();
-    maskFilter->SetMaskImage(mask);
-    maskFilter->SetInput(changeInformationImageFilter->GetOutput());
-    // Create slice to slice image filter
-    typename SliceBySliceImageFilterType::Pointer sliceBySliceImageFilter = SliceBySliceImageFilterType::New();
-    sliceBySliceImageFilter->SetInput(image);
-    sliceBySliceImageFilter->SetInputFilter(changeInformationImageFilter);
-    sliceBySliceImageFilter->SetOutputFilter(maskFilter);
-    sliceBySliceImageFilter->Update();
-    // Save image
-    ITKUtils::WriteNIfTIImage<ImageType>(sliceBySliceImageFilter->GetOutput(), std::string(argv[3]));
+    // Mask every volume of the image
+    profiler.Start("compute");
+    mask = GridMask<ImageType, MaskType>(image, mask, std::string(argv[2]), cacheDirectory);
+    typename ImageType::Pointer output = MaskDifferentDimensions<ImageType, MaskType>(image, mask);
+    // Save image (vector images through niftilib, keeping the TR of the input)
+    profiler.Start("write");
+    if (output->GetNumberOfComponentsPerPixel() > 1)
+        NIfTIUtils::WriteNIfTIImage<ImageType>(output, std::string(argv[3]), NIfTIUtils::ReadTimeStep(std::string(argv[1])));
+    else
+        ITKUtils::WriteNIfTIImage<ImageType>(output, std::string(argv[3]));
+    profiler.Stop();
+}
+
+
+/*
+ * Masks a series whose input and output do not fit in the memory budget:
+ * slabs of time points (and of a 4D mask) are read, masked and appended to
+ * the output file, so only the mask and one slab are resident.
+ */
+template<typename ImageType, typename MaskType>
+void MaskImageSlabs(char *argv[], const itk::ImageIOBase *imageIO, long long slab, const std::string &cacheDirectory, Profiler &profiler)
+{
+    const bool equalDimensions = MaskType::ImageDimension == ImageType::ImageDimension;
+    const unsigned int TimeDimension = ImageType::ImageDimension - 1;
+    typename ImageType::SizeType size;
+    for (unsigned int i = 0; i < ImageType::ImageDimension; ++i)
+        size[i] = imageIO->GetDimensions(i);
+    const long long timePoints = (long long) size[TimeDimension];
+    // Read mask (a 4D mask is read along with every slab)
+    profiler.Start("read");
+    typename MaskType::Pointer mask;
+    if (!equalDimensions)
+    {
+        mask = ITKUtils::ReadNIfTIImage<MaskType>(std::string(argv[2]));
+        profiler.Start("compute");
+        mask = GridMask<ImageType, MaskType>(NIfTIUtils::ImageGeometry<ImageType>(imageIO).GetPointer(), mask.GetPointer(), std::string(argv[2]), cacheDirectory);
+    }
+    // A 4D mask may be on another grid: its slabs cover its own spatial extent, and its whole time axis unless it has the time points of the image
+    typename ImageType::SizeType maskSize = size;
+    if (equalDimensions)
+    {
+        typename itk::ImageIOBase::Pointer maskIO = ITKUtils::ReadImageInformation(std::string(argv[2]));
+        for (unsigned int i = 0; i < ImageType::ImageDimension; ++i)
+            maskSize[i] = maskIO->GetDimensions(i);
+    }
+    const bool maskSlabs = maskSize[TimeDimension] == size[TimeDimension];
+    std::unique_ptr<NIfTIUtils::NIfTIStreamWriter<ImageType>> writer;
+    for (long long t = 0; t < timePoints; t += slab)
+    {
+        typename ImageType::IndexType index;
+        index.Fill(0);
+        index[TimeDimension] = t;
+        typename ImageType::SizeType slabSize = size;
+        slabSize[TimeDimension] = std::min(slab, timePoints - t);
+        const typename ImageType::RegionType region(index, slabSize);
+        // Read slab
+        profiler.Start("read");
+        typename ImageType::Pointer image = NIfTIUtils::ReadNIfTIImageRegion<ImageType>(std::string(argv[1]), region);
+        typename ImageType::Pointer output;
+        if (equalDimensions)
+        {
+            typedef itk::Image<typename MaskType::PixelType, ImageType::ImageDimension> SlabMaskType;
+            typename SlabMaskType::IndexType maskIndex;
+            maskIndex.Fill(0);
+            typename SlabMaskType::SizeType maskSlabSize = maskSize;
+            if (maskSlabs)
+            {
+                maskIndex[TimeDimension] = t;
+                maskSlabSize[TimeDimension] = slabSize[TimeDimension];
+            }
+            typename SlabMaskType::Pointer slabMask = NIfTIUtils::ReadNIfTIImageRegion<SlabMaskType>(std::string(argv[2]), typename SlabMaskType::RegionType(maskIndex, maskSlabSize));
+            profiler.Start("compute");
+            if (!SameGrid<ImageType, SlabMaskType>(image, slabMask))
+                slabMask = ResampleMask<ImageType, SlabMaskType>(image, slabMask);
+            output = MaskEqualDimensions<ImageType, SlabMaskType>(image, slabMask);
+        }
+        else
+        {
+            profiler.Start("compute");
+            output = MaskDifferentDimensions<ImageType, MaskType>(image, mask);
+        }
+        // Append slab
+        profiler.Start("write");
+        if (!writer)
+            writer.reset(new NIfTIUtils::NIfTIStreamWriter<ImageType>(output, size, std::string(argv[3])));
+        writer->Write(output->GetBufferPointer(), (long long) output->GetBufferedRegion().GetNumberOfPixels());
+    }
+    writer->Close();
+    profiler.Stop();
+}
+
+
+/*
+ * Estimates the peak memory from the headers and masks the whole image in
+ * memory when it fits the budget, in slabs of time points otherwise.
+ */
+template<typename ImageType, typename MaskType>
+void MaskImage(char *argv[], const itk::ImageIOBase *imageIO, const MemoryBudget &budget, const std::string &cacheDirectory, Profiler &profiler)
+{
+    const bool equalDimensions = MaskType::ImageDimension == ImageType::ImageDimension;
+    const unsigned long long volumeBytes = MemoryBudget::VolumeBytes(imageIO, sizeof(typename ImageType::PixelType));
+    const unsigned long long maskVolumeBytes = MemoryBudget::VolumeBytes(imageIO, sizeof(typename MaskType::PixelType));
+    const long long timePoints = (ImageType::ImageDimension > 3) ? (long long) imageIO->GetDimensions(3) : 1;
+    // Input and output volumes per time point, plus the mask volume when the mask is a series too
+    const unsigned long long unitBytes = 2 * volumeBytes + (equalDimensions ? maskVolumeBytes : 0);
+    const unsigned long long residentBytes = equalDimensions ? 0 : maskVolumeBytes;
+    const long long slab = budget.Units(timePoints, unitBytes, residentBytes, "MaskImage");
+    const unsigned long long peakBytes = residentBytes + slab * unitBytes;
+    std::ostringstream plan;
+    if (slab == timePoints)
+        plan << "in memory";
+    else
+        plan << "streamed in slabs of " << slab << " of " << timePoints << " time points";
+    budget.Report(plan.str(), peakBytes);
+    profiler.SetMemoryPlan(plan.str(), peakBytes);
+    if (slab < timePoints)
+        MaskImageSlabs<ImageType, MaskType>(argv, imageIO, slab, cacheDirectory, profiler);
+    else if (equalDimensions)
+        MaskImageEqualDimensions<ImageType, MaskType>(argv, cacheDirectory, profiler);
+    else
+        MaskImageDifferentDimensions<ImageType, MaskType>(argv, cacheDirectory, profiler);
+}
+
+
+/*
+ * Masks a vector image in memory with a mask of its spatial dimensions,
+ * broadcast to the interleaved components of every voxel in one pass.
+ */
+template<typename ImageType, typename MaskType>
+void MaskVectorImage(char *argv[], const itk::ImageIOBase *imageIO, const MemoryBudget &budget, const std::string &cacheDirectory, Profiler &profiler)
+{
+    // Input and output images plus the mask
+    const unsigned long long peakBytes = 2 * MemoryBudget::ImageBytes(imageIO, sizeof(typename ImageType::InternalPixelType)) + MemoryBudget::VolumeBytes(imageIO, sizeof(typename MaskType::PixelType));
+    budget.Require(peakBytes, "MaskImage");
+    budget.Report("in memory", peakBytes);
+    profiler.SetMemoryPlan("in memory", peakBytes);
+    MaskImageDifferentDimensions<ImageType, MaskType>(argv, cacheDirectory, profiler);
 }
 
 int main(int argc, char *argv[])
 {
+    CommandLineOptions options(argc, argv);
     if (argc < 4)
     {
-        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: MaskImage inputImage maskImage outputImage" << std::endl;
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: MaskImage inputImage maskImage outputImage [--max-memory=size] [--pin] [--cache=directory] [--profile=json|text]" << std::endl;
+        std::cerr << "--max-memory:\tmemory budget (e.g. 4G), 4D images that do not fit are masked in slabs of time points" << std::endl;
+        std::cerr << "Vector images are masked with a 3D mask applied to every component" << std::endl;
+        std::cerr << "A mask on another grid is resampled to the image grid (nearest neighbour), cached in --cache" << std::endl;
         return EXIT_FAILURE;
     }
 
@@ -82,6 +265,15 @@ int main(int argc, char *argv[])
 
     const unsigned int ImageDimension = imageIO->GetNumberOfDimensions();
     const unsigned int MaskDimension = maskIO->GetNumberOfDimensions();
+    const unsigned int Components = imageIO->GetNumberOfComponents();
+
+    Profiler profiler("MaskImage", options.Get("profile"));
+    profiler.SetImageInformation(imageIO);
+    profiler.AddInput(std::string(argv[1]));
+    profiler.AddInput(std::string(argv[2]));
+    ResultCache cache(options.Get("cache"), "MaskImage");
+    if (options.Has("pin"))
+        WorkPartitioner::PinThreads();
 
     if (ImageDimension != MaskDimension && ImageDimension != (MaskDimension + 1))
     {
@@ -94,23 +286,44 @@ int main(int argc, char *argv[])
         std::cerr << "Unsupported image dimensions" << std::endl;
         return EXIT_FAILURE;   
     }
+
+    if (Components > 1 && MaskDimension != 3)
+    {
+        std::cerr << "Vector images take a 3D mask" << std::endl;
+        return EXIT_FAILURE;
+    }
     
     try
     {
-        if (ImageDimension == 4)
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        cache.AddInput(std::string(argv[1]));
+        if (NIfTIUtils::IsChunkedImage(std::string(argv[1])))
+            cache.AddInput(NIfTIUtils::ChunksFileName(std::string(argv[1])));
+        cache.AddInput(std::string(argv[2]));
+        cache.AddOptions(options);
+        cache.AddOutput(std::string(argv[3]));
+        if (cache.Fetch())
         {
-            if (MaskDimension == 4)
-                MaskImageEqualDimensions<itk::Image<float, 4>, itk::Image<unsigned char, 4>>(argv);
-            else
-                MaskImageDifferentDimensions<itk::Image<float, 4>, itk::Image<unsigned char, 3>>(argv);
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
         }
-        else
+        const MemoryBudget budget(options.Get("max-memory"));
+        Dispatch::ByDimension<3, 4>(ImageDimension, [&](auto dimension)
         {
-            if (MaskDimension == 3)
-                MaskImageEqualDimensions<itk::Image<float, 3>, itk::Image<unsigned char, 3>>(argv);
+            const unsigned int Dimension = decltype(dimension)::value;
+            if (Components > 1)
+                MaskVectorImage<itk::VectorImage<float, Dimension>, itk::Image<unsigned char, 3>>(argv, imageIO, budget, options.Get("cache"), profiler);
+            else if (MaskDimension == Dimension)
+                MaskImage<itk::Image<float, Dimension>, itk::Image<unsigned char, Dimension>>(argv, imageIO, budget, options.Get("cache"), profiler);
             else
-                MaskImageDifferentDimensions<itk::Image<float, 3>, itk::Image<unsigned char, 2>>(argv);
-        }
+                MaskImage<itk::Image<float, Dimension>, itk::Image<unsigned char, Dimension - 1>>(argv, imageIO, budget, options.Get("cache"), profiler);
+        });
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
     }
     catch (itk::ExceptionObject & err)
     {
@@ -118,6 +331,14 @@ int main(int argc, char *argv[])
         std::cerr << err << std::endl;
         return EXIT_FAILURE;
     }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
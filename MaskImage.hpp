@@ -0,0 +1,200 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Mask Image kernels                                                       *
+***************************************************************************/
+
+#ifndef MASKIMAGE_HPP
+#define MASKIMAGE_HPP
+
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <WorkPartitioner.hpp>
+#include <itkImage.h>
+#include <itkMaskImageFilter.h>
+
+
+template<typename ImageType, typename MaskType>
+typename ImageType::Pointer MaskEqualDimensions(const ImageType *image, const MaskType *mask)
+{
+    // Define the mask image filter type
+    using MaskImageFilterType = itk::MaskImageFilter<ImageType, MaskType>;
+    // Create mask image filter
+    typename MaskImageFilterType::Pointer maskFilter = MaskImageFilterType::New();
+    maskFilter->SetCoordinateTolerance(1e-4);
+    maskFilter->SetDirectionTolerance(1e-4);
+    maskFilter->SetInput(image);
+    maskFilter->SetMaskImage(mask);
+    maskFilter->Update();
+    typename ImageType::Pointer output = maskFilter->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+
+/*
+ * Masks every volume of an image with a mask of its leading dimensions (e.g. a
+ * 4D series with a 3D mask), voxel by voxel as the former slice by slice
+ * masking did, in one pass partitioned among the threads. The output chunks
+ * are first touched by the threads that write them. The interleaved
+ * components of a vector image share the mask value of their voxel.
+ */
+template<typename ImageType, typename MaskType>
+typename ImageType::Pointer MaskDifferentDimensions(const ImageType *image, const MaskType *mask)
+{
+    typedef typename ImageType::InternalPixelType PixelType;
+    typedef typename MaskType::PixelType MaskPixelType;
+    const typename ImageType::SizeType imageSize = image->GetBufferedRegion().GetSize();
+    const typename MaskType::SizeType maskSize = mask->GetBufferedRegion().GetSize();
+    for (unsigned int i = 0; i < MaskType::ImageDimension; ++i)
+        if (imageSize[i] != maskSize[i])
+            throw std::runtime_error("Image and mask sizes are different");
+    typename ImageType::Pointer output = ImageType::New();
+    output->CopyInformation(image);
+    output->SetRegions(image->GetBufferedRegion());
+    output->SetNumberOfComponentsPerPixel(image->GetNumberOfComponentsPerPixel());
+    output->Allocate(false);
+    const long long maskVoxels = (long long) mask->GetBufferedRegion().GetNumberOfPixels();
+    const long long components = image->GetNumberOfComponentsPerPixel();
+    const PixelType *buffer = image->GetBufferPointer();
+    const MaskPixelType *maskBuffer = mask->GetBufferPointer();
+    PixelType *outputBuffer = output->GetBufferPointer();
+    WorkPartitioner::ParallelFor((long long) image->GetBufferedRegion().GetNumberOfPixels() * components, WorkPartitioner::UnitLength<ImageType>(image) * components, [&](long long begin, long long end)
+    {
+        for (long long i = begin; i < end; ++i)
+            outputBuffer[i] = maskBuffer[(i / components) % maskVoxels] ? buffer[i] : PixelType();
+    });
+    return output;
+}
+
+
+
+// Grid (size, spacing, origin and direction) of the leading dimensions of an image covered by a mask, used as cache key
+template<typename ImageType, typename MaskType>
+std::string GridKey(const ImageType *image)
+{
+    const typename ImageType::SizeType size = image->GetLargestPossibleRegion().GetSize();
+    std::ostringstream s;
+    s.precision(6);
+    for (unsigned int i = 0; i < MaskType::ImageDimension; ++i)
+    {
+        s << size[i] << ' ' << image->GetSpacing()[i] << ' ' << image->GetOrigin()[i];
+        for (unsigned int j = 0; j < MaskType::ImageDimension; ++j)
+            s << ' ' << image->GetDirection()(i, j);
+        s << ';';
+    }
+    return s.str();
+}
+
+
+// Whether the mask lies on the grid of the leading dimensions of the image (tolerances of itk::MaskImageFilter)
+template<typename ImageType, typename MaskType>
+bool SameGrid(const ImageType *image, const MaskType *mask, double tolerance = 1e-4)
+{
+    const typename ImageType::SizeType imageSize = image->GetLargestPossibleRegion().GetSize();
+    const typename MaskType::SizeType maskSize = mask->GetLargestPossibleRegion().GetSize();
+    const double coordinateTolerance = tolerance * image->GetSpacing()[0];
+    for (unsigned int i = 0; i < MaskType::ImageDimension; ++i)
+    {
+        if (imageSize[i] != maskSize[i])
+            return false;
+        if (std::abs(image->GetSpacing()[i] - mask->GetSpacing()[i]) > coordinateTolerance || std::abs(image->GetOrigin()[i] - mask->GetOrigin()[i]) > coordinateTolerance)
+            return false;
+        for (unsigned int j = 0; j < MaskType::ImageDimension; ++j)
+            if (std::abs(image->GetDirection()(i, j) - mask->GetDirection()(i, j)) > tolerance)
+                return false;
+    }
+    return true;
+}
+
+
+/*
+ * Nearest-neighbour resampling of a mask onto the grid of the leading
+ * dimensions of an image. The map from output index to mask continuous index
+ * is affine, so it is composed once and every row is walked by adding its
+ * first column instead of transforming each voxel through physical space.
+ * Rows are partitioned among the threads; voxels outside the mask are zero.
+ */
+template<typename ImageType, typename MaskType>
+typename MaskType::Pointer ResampleMask(const ImageType *image, const MaskType *mask)
+{
+    const unsigned int Dimension = MaskType::ImageDimension;
+    typedef typename MaskType::PixelType MaskPixelType;
+    // Output grid
+    typename MaskType::SizeType size;
+    typename MaskType::SpacingType spacing;
+    typename MaskType::PointType origin;
+    typename MaskType::DirectionType direction;
+    for (unsigned int i = 0; i < Dimension; ++i)
+    {
+        size[i] = image->GetLargestPossibleRegion().GetSize()[i];
+        spacing[i] = image->GetSpacing()[i];
+        origin[i] = image->GetOrigin()[i];
+        for (unsigned int j = 0; j < Dimension; ++j)
+            direction(i, j) = image->GetDirection()(i, j);
+    }
+    typename MaskType::Pointer output = MaskType::New();
+    output->SetRegions(size);
+    output->SetSpacing(spacing);
+    output->SetOrigin(origin);
+    output->SetDirection(direction);
+    output->Allocate(false);
+    // Output index -> mask continuous index: A * index + b
+    const typename MaskType::DirectionType A = mask->GetPhysicalPointToIndex() * output->GetIndexToPhysicalPoint();
+    double b[Dimension];
+    for (unsigned int i = 0; i < Dimension; ++i)
+    {
+        b[i] = 0;
+        for (unsigned int j = 0; j < Dimension; ++j)
+            b[i] += mask->GetPhysicalPointToIndex()(i, j) * (origin[j] - mask->GetOrigin()[j]);
+    }
+    const typename MaskType::SizeType maskSize = mask->GetBufferedRegion().GetSize();
+    long long strides[Dimension];
+    strides[0] = 1;
+    for (unsigned int i = 1; i < Dimension; ++i)
+        strides[i] = strides[i - 1] * (long long) maskSize[i - 1];
+    const MaskPixelType *maskBuffer = mask->GetBufferPointer();
+    MaskPixelType *outputBuffer = output->GetBufferPointer();
+    const long long rowLength = (long long) size[0];
+    WorkPartitioner::ParallelFor((long long) output->GetBufferedRegion().GetNumberOfPixels(), WorkPartitioner::UnitLength<MaskType>(output), [&](long long begin, long long end)
+    {
+        for (long long row = begin; row < end; row += rowLength)
+        {
+            // Mask continuous index of the first voxel of the row
+            double index[Dimension];
+            for (unsigned int i = 0; i < Dimension; ++i)
+                index[i] = b[i];
+            long long rest = row / rowLength;
+            for (unsigned int j = 1; j < Dimension; ++j)
+            {
+                const long long position = rest % (long long) size[j];
+                rest /= (long long) size[j];
+                for (unsigned int i = 0; i < Dimension; ++i)
+                    index[i] += A(i, j) * position;
+            }
+            for (long long x = 0; x < rowLength; ++x)
+            {
+                long long offset = 0;
+                bool inside = true;
+                for (unsigned int i = 0; i < Dimension && inside; ++i)
+                {
+                    const long long nearest = (long long) std::floor(index[i] + 0.5);
+                    inside = nearest >= 0 && nearest < (long long) maskSize[i];
+                    offset += nearest * strides[i];
+                }
+                outputBuffer[row + x] = inside ? maskBuffer[offset] : MaskPixelType();
+                for (unsigned int i = 0; i < Dimension; ++i)
+                    index[i] += A(i, 0);
+            }
+        }
+    });
+    return output;
+}
+
+#endif
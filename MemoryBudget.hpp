@@ -0,0 +1,144 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Memory budget of a tool (--max-memory)                                   *
+***************************************************************************/
+
+#ifndef MEMORYBUDGET_HPP
+#define MEMORYBUDGET_HPP
+
+#include <cctype>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <itkImageIOBase.h>
+
+/*
+ * Upper bound on the memory a tool may allocate, given as a number of bytes
+ * with an optional K, M, G or T (binary) suffix, e.g. --max-memory=6G. The
+ * tools estimate their peak from the image header before reading any voxel
+ * data and, when the whole image does not fit, process it in slabs sized by
+ * Units(). A plan that cannot fit even one slab fails before allocating.
+ * Without a budget every plan fits and the tools keep their in-memory path.
+ */
+class MemoryBudget
+{
+public:
+    MemoryBudget(const std::string &limit = "") : m_Bytes(0)
+    {
+        if (limit.empty())
+            return;
+        char *end = NULL;
+        const double value = std::strtod(limit.c_str(), &end);
+        std::string suffix(end);
+        if (!suffix.empty() && (suffix[suffix.size() - 1] == 'B' || suffix[suffix.size() - 1] == 'b'))
+            suffix.erase(suffix.size() - 1);
+        if (suffix.size() > 1 && (suffix[suffix.size() - 1] == 'i'))
+            suffix.erase(suffix.size() - 1);
+        double scale = 1;
+        if (suffix.size() == 1)
+        {
+            const char unit = (char) std::toupper(suffix[0]);
+            const std::string units("KMGT");
+            const std::size_t power = units.find(unit);
+            if (power == std::string::npos)
+                throw std::runtime_error("Invalid memory budget: " + limit);
+            for (std::size_t i = 0; i <= power; ++i)
+                scale *= 1024;
+        }
+        else if (!suffix.empty())
+            throw std::runtime_error("Invalid memory budget: " + limit);
+        if (end == limit.c_str() || value <= 0)
+            throw std::runtime_error("Invalid memory budget: " + limit);
+        m_Bytes = (unsigned long long) (value * scale);
+    }
+
+    bool Limited() const
+    {
+        return m_Bytes > 0;
+    }
+
+    unsigned long long Bytes() const
+    {
+        return m_Bytes;
+    }
+
+    bool Fits(unsigned long long bytes) const
+    {
+        return !Limited() || bytes <= m_Bytes;
+    }
+
+    // Fail before allocating when an in-memory plan does not fit
+    void Require(unsigned long long bytes, const std::string &what) const
+    {
+        if (!Fits(bytes))
+            throw std::runtime_error(what + " needs about " + Format(bytes) + ", over the memory budget of " + Format(m_Bytes));
+    }
+
+    /*
+     * Number of units (time points, slices) per slab so that the resident
+     * bytes plus a slab of units of unitBytes each stay within the budget,
+     * all of them without a budget.
+     */
+    long long Units(long long units, unsigned long long unitBytes, unsigned long long residentBytes, const std::string &what) const
+    {
+        if (!Limited() || residentBytes + units * unitBytes <= m_Bytes)
+            return units;
+        Require(residentBytes + unitBytes, what);
+        return (long long) ((m_Bytes - residentBytes) / unitBytes);
+    }
+
+    // Print the chosen plan (only when a budget was given) on stderr, as stdout may carry the JSON profile
+    void Report(const std::string &plan, unsigned long long peakBytes, std::ostream &os = std::cerr) const
+    {
+        if (Limited())
+            os << "Memory plan: " << plan << ", estimated peak " << Format(peakBytes) << " of " << Format(m_Bytes) << std::endl;
+    }
+
+    static std::string Format(unsigned long long bytes)
+    {
+        const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+        double value = (double) bytes;
+        unsigned int unit = 0;
+        while (value >= 1024 && unit < 4)
+        {
+            value /= 1024;
+            ++unit;
+        }
+        std::ostringstream s;
+        if (unit == 0)
+            s << bytes << " " << units[unit];
+        else
+        {
+            s.precision(3);
+            s << value << " " << units[unit];
+        }
+        return s.str();
+    }
+
+    // Bytes of a whole image once read with pixels of pixelBytes
+    static unsigned long long ImageBytes(const itk::ImageIOBase *imageIO, unsigned int pixelBytes)
+    {
+        return (unsigned long long) imageIO->GetImageSizeInPixels() * imageIO->GetNumberOfComponents() * pixelBytes;
+    }
+
+    // Bytes of one volume (the three spatial dimensions) of an image
+    static unsigned long long VolumeBytes(const itk::ImageIOBase *imageIO, unsigned int pixelBytes)
+    {
+        unsigned long long voxels = 1;
+        for (unsigned int i = 0; i < imageIO->GetNumberOfDimensions() && i < 3; ++i)
+            voxels *= imageIO->GetDimensions(i);
+        return voxels * pixelBytes;
+    }
+
+private:
+    unsigned long long m_Bytes;
+};
+
+#endif
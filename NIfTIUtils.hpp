@@ -0,0 +1,851 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* NIfTI header level utilities                                             *
+***************************************************************************/
+
+#ifndef NIFTIUTILS_HPP
+#define NIFTIUTILS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <itkImage.h>
+#include <itkImageFileReader.h>
+#include <itkNiftiImageIO.h>
+#include <itkRegionOfInterestImageFilter.h>
+#include <nifti1_io.h>
+#include <ChunkedImage.hpp>
+#include <GzipIndex.hpp>
+
+namespace NIfTIUtils
+{
+    /*
+     * Builds a NIfTI-1 header from the geometry of an ITK image, converting
+     * ITK's LPS physical space to NIfTI's RAS as ITK's NiftiImageIO does.
+     * Multi-component (vector) images are laid out as ITK does, with the
+     * components in the fifth dimension.
+     */
+    template<typename ImageType>
+    nifti_image *MakeNIfTIHeader(const ImageType *image, int datatype, int dataFill, unsigned int components = 1)
+    {
+        const unsigned int Dimension = ImageType::ImageDimension;
+        const unsigned int SpatialDimension = std::min(Dimension, 3u);
+        const typename ImageType::SizeType size = image->GetLargestPossibleRegion().GetSize();
+        const typename ImageType::SpacingType spacing = image->GetSpacing();
+        const typename ImageType::PointType origin = image->GetOrigin();
+        const typename ImageType::DirectionType direction = image->GetDirection();
+        int dims[8] = {(int) Dimension, 1, 1, 1, 1, 1, 1, 1};
+        for (unsigned int i = 0; i < Dimension; ++i)
+            dims[i + 1] = (int) size[i];
+        if (components > 1)
+        {
+            dims[0] = 5;
+            dims[5] = (int) components;
+        }
+        nifti_image *nim = nifti_make_new_nim(dims, datatype, dataFill);
+        if (nim == NULL)
+            throw std::runtime_error("Unable to create NIfTI header");
+        for (unsigned int i = 0; i < Dimension; ++i)
+            nim->pixdim[i + 1] = (float) spacing[i];
+        nim->dx = nim->pixdim[1];
+        nim->dy = nim->pixdim[2];
+        nim->dz = nim->pixdim[3];
+        nim->dt = nim->pixdim[4];
+        nim->xyz_units = NIFTI_UNITS_MM;
+        nim->time_units = NIFTI_UNITS_SEC;
+        if (Dimension > 3)
+            nim->toffset = (float) origin[3];
+        if (components > 1)
+            nim->intent_code = NIFTI_INTENT_VECTOR;
+        // Voxel to world transform
+        mat44 xyz;
+        for (unsigned int i = 0; i < 4; ++i)
+            for (unsigned int j = 0; j < 4; ++j)
+                xyz.m[i][j] = (i == j) ? 1.0f : 0.0f;
+        for (unsigned int i = 0; i < SpatialDimension; ++i)
+        {
+            const double flip = (i < 2) ? -1.0 : 1.0;
+            for (unsigned int j = 0; j < SpatialDimension; ++j)
+                xyz.m[i][j] = (float) (flip * direction(i, j) * spacing[j]);
+            xyz.m[i][3] = (float) (flip * origin[i]);
+        }
+        nim->sform_code = NIFTI_XFORM_SCANNER_ANAT;
+        nim->sto_xyz = xyz;
+        nim->sto_ijk = nifti_mat44_inverse(xyz);
+        nim->qform_code = NIFTI_XFORM_SCANNER_ANAT;
+        float dx, dy, dz;
+        nifti_mat44_to_quatern(xyz, &nim->quatern_b, &nim->quatern_c, &nim->quatern_d, &nim->qoffset_x, &nim->qoffset_y, &nim->qoffset_z, &dx, &dy, &dz, &nim->qfac);
+        nim->qto_xyz = nifti_quatern_to_mat44(nim->quatern_b, nim->quatern_c, nim->quatern_d, nim->qoffset_x, nim->qoffset_y, nim->qoffset_z, nim->dx, nim->dy, nim->dz, nim->qfac);
+        nim->qto_ijk = nifti_mat44_inverse(nim->qto_xyz);
+        return nim;
+    }
+
+    /*
+     * Writes the header and the in-memory data of a NIfTI image, returning
+     * whether every byte reached the file. nifti_image_write() only reports
+     * failures (a full disk, an unwritable path) on stderr.
+     */
+    inline bool WriteNIfTIFile(nifti_image *nim)
+    {
+        // Header only, the file is left open for the voxel data
+        znzFile file = nifti_image_write_hdr_img(nim, 2, "wb");
+        if (znz_isnull(file))
+            return false;
+        bool written = true;
+        const char zero = 0;
+        for (long position = znztell(file); written && position < (long) nim->iname_offset; ++position)
+            written = znzwrite(&zero, 1, 1, file) == 1;
+        // In blocks, as gzwrite takes 32-bit lengths
+        const size_t BlockSize = 64 << 20;
+        const char *data = static_cast<const char *>(nim->data);
+        const size_t bytes = (size_t) nim->nvox * nim->nbyper;
+        for (size_t offset = 0; written && offset < bytes; offset += BlockSize)
+        {
+            const size_t length = std::min(BlockSize, bytes - offset);
+            written = znzwrite(data + offset, 1, length, file) == length;
+        }
+        return znzclose(file) == 0 && written;
+    }
+
+    inline int NIfTIDatatype(unsigned char)
+    {
+        return NIFTI_TYPE_UINT8;
+    }
+
+    inline int NIfTIDatatype(char)
+    {
+        return NIFTI_TYPE_INT8;
+    }
+
+    inline int NIfTIDatatype(unsigned short)
+    {
+        return NIFTI_TYPE_UINT16;
+    }
+
+    inline int NIfTIDatatype(short)
+    {
+        return NIFTI_TYPE_INT16;
+    }
+
+    inline int NIfTIDatatype(unsigned int)
+    {
+        return NIFTI_TYPE_UINT32;
+    }
+
+    inline int NIfTIDatatype(int)
+    {
+        return NIFTI_TYPE_INT32;
+    }
+
+    inline int NIfTIDatatype(unsigned long)
+    {
+        return (sizeof(unsigned long) == 8) ? NIFTI_TYPE_UINT64 : NIFTI_TYPE_UINT32;
+    }
+
+    inline int NIfTIDatatype(long)
+    {
+        return (sizeof(long) == 8) ? NIFTI_TYPE_INT64 : NIFTI_TYPE_INT32;
+    }
+
+    inline int NIfTIDatatype(float)
+    {
+        return NIFTI_TYPE_FLOAT32;
+    }
+
+    inline int NIfTIDatatype(double)
+    {
+        return NIFTI_TYPE_FLOAT64;
+    }
+
+    /*
+     * Writes an image (scalar or vector) through niftilib, so header fields
+     * ITK does not expose are under control: timeStep > 0 sets pixdim[4] (the
+     * TR) also for 3D vector images, whose components ITK stores in the fifth
+     * dimension with a unit time step.
+     */
+    template<typename ImageType>
+    void WriteNIfTIImage(const ImageType *image, const std::string &fileName, double timeStep = 0)
+    {
+        typedef typename ImageType::InternalPixelType InternalPixelType;
+        const unsigned int components = image->GetNumberOfComponentsPerPixel();
+        const long long voxels = (long long) image->GetBufferedRegion().GetNumberOfPixels();
+        const InternalPixelType *buffer = image->GetBufferPointer();
+        nifti_image *nim = MakeNIfTIHeader<ImageType>(image, NIfTIDatatype(InternalPixelType()), (components > 1) ? 1 : 0, components);
+        if (timeStep > 0)
+            nim->pixdim[4] = nim->dt = (float) timeStep;
+        if (components > 1)
+        {
+            // ITK interleaves the components of every voxel, NIfTI stores one volume per component
+            InternalPixelType *data = static_cast<InternalPixelType *>(nim->data);
+            #pragma omp parallel for
+            for (long long i = 0; i < voxels; ++i)
+                for (unsigned int c = 0; c < components; ++c)
+                    data[c * voxels + i] = buffer[i * components + c];
+        }
+        else
+            nim->data = const_cast<InternalPixelType *>(buffer);
+        if (nifti_set_filenames(nim, fileName.c_str(), 0, 1) != 0)
+        {
+            if (components == 1)
+                nim->data = NULL;
+            nifti_image_free(nim);
+            throw std::runtime_error("Invalid NIfTI file name: " + fileName);
+        }
+        const bool written = WriteNIfTIFile(nim);
+        // The image buffer is not owned by the NIfTI image
+        if (components == 1)
+            nim->data = NULL;
+        nifti_image_free(nim);
+        if (!written)
+            throw std::runtime_error("Unable to write file: " + fileName);
+    }
+
+    // Time step (pixdim[4]) of a NIfTI file, kept by the tools that write vector images through niftilib
+    inline double ReadTimeStep(const std::string &fileName)
+    {
+        nifti_image *nim = nifti_image_read(fileName.c_str(), 0);
+        if (nim == NULL)
+            throw std::runtime_error("Unable to read NIfTI header: " + fileName);
+        const double timeStep = (nim->nt > 1 || nim->nu > 1) ? nim->dt : 0;
+        nifti_image_free(nim);
+        return timeStep;
+    }
+
+    // Marker of the NIfTI header sidecar of a chunked image (descrip field)
+    const char ChunkedDescription[] = "ONTs chunked image";
+
+    // Chunk data file of a chunked image: <name>.nii -> <name>.chunks
+    inline std::string ChunksFileName(const std::string &fileName)
+    {
+        if (fileName.size() < 4 || fileName.compare(fileName.size() - 4, 4, ".nii") != 0)
+            throw std::runtime_error("Chunked images are named <name>.nii: " + fileName);
+        return fileName.substr(0, fileName.size() - 4) + ".chunks";
+    }
+
+    // Whether a file is the header sidecar of a chunked image
+    inline bool IsChunkedImage(const std::string &fileName)
+    {
+        if (fileName.size() < 4 || fileName.compare(fileName.size() - 4, 4, ".nii") != 0)
+            return false;
+        nifti_image *nim = nifti_image_read(fileName.c_str(), 0);
+        if (nim == NULL)
+            return false;
+        const bool chunked = std::strncmp(nim->descrip, ChunkedDescription, sizeof(ChunkedDescription) - 1) == 0;
+        nifti_image_free(nim);
+        return chunked;
+    }
+
+    // Time points per chunk of a chunked image (1 for other files), the slab length that inflates every chunk once
+    inline long long ChunkedTimeBlock(const std::string &fileName)
+    {
+        if (!IsChunkedImage(fileName))
+            return 1;
+        ChunkedImage::Reader reader(ChunksFileName(fileName));
+        return reader.GetLayout().chunk[3];
+    }
+
+    /*
+     * Writes an image of the given size and the geometry of a (smaller) image
+     * in pieces, so the whole image never has to be in memory. Write() appends
+     * voxels in file order (x fastest, then y, z, time, and for vector images
+     * one volume per component), which also works for .nii.gz files as the
+     * compressed stream is produced sequentially. WriteAt() places voxels at
+     * any position and needs an uncompressed file.
+     */
+    template<typename ImageType>
+    class NIfTIStreamWriter
+    {
+    public:
+        typedef typename ImageType::InternalPixelType InternalPixelType;
+
+        NIfTIStreamWriter(const itk::ImageBase<ImageType::ImageDimension> *geometry, const typename ImageType::SizeType &size, const std::string &fileName, unsigned int components = 1, double timeStep = 0) : m_File(NULL), m_Written(0)
+        {
+            typename ImageType::Pointer header = ImageType::New();
+            header->CopyInformation(geometry);
+            header->SetRegions(size);
+            m_Header = MakeNIfTIHeader<ImageType>(header, NIfTIDatatype(InternalPixelType()), 0, components);
+            if (timeStep > 0)
+                m_Header->pixdim[4] = m_Header->dt = (float) timeStep;
+            if (nifti_set_filenames(m_Header, fileName.c_str(), 0, 1) != 0)
+            {
+                nifti_image_free(m_Header);
+                throw std::runtime_error("Invalid NIfTI file name: " + fileName);
+            }
+            m_Compressed = nifti_is_gzfile(m_Header->fname) != 0;
+            m_Elements = (long long) m_Header->nvox;
+            // Header only, the file is left open for the voxel data
+            m_File = nifti_image_write_hdr_img(m_Header, 2, "wb");
+            if (znz_isnull(m_File))
+            {
+                nifti_image_free(m_Header);
+                throw std::runtime_error("Unable to write file: " + fileName);
+            }
+            const char zero = 0;
+            for (long position = znztell(m_File); position < (long) m_Header->iname_offset; ++position)
+                if (znzwrite(&zero, 1, 1, m_File) != 1)
+                {
+                    znzclose(m_File);
+                    nifti_image_free(m_Header);
+                    throw std::runtime_error("Unable to write file: " + fileName);
+                }
+        }
+
+        ~NIfTIStreamWriter()
+        {
+            if (!znz_isnull(m_File))
+                znzclose(m_File);
+            nifti_image_free(m_Header);
+        }
+
+        void Write(const InternalPixelType *data, long long elements)
+        {
+            if (m_Written + elements > m_Elements)
+                throw std::runtime_error(std::string("Too many voxels written to ") + m_Header->fname);
+            if (znzwrite(data, sizeof(InternalPixelType), (size_t) elements, m_File) != (size_t) elements)
+                throw std::runtime_error(std::string("Unable to write file: ") + m_Header->fname);
+            m_Written += elements;
+        }
+
+        void WriteAt(long long element, const InternalPixelType *data, long long elements)
+        {
+            if (m_Compressed)
+                throw std::runtime_error(std::string("Compressed files can only be written in order: ") + m_Header->fname);
+            if (element + elements > m_Elements)
+                throw std::runtime_error(std::string("Voxels written outside the image: ") + m_Header->fname);
+            znzseek(m_File, (long) m_Header->iname_offset + element * (long) sizeof(InternalPixelType), SEEK_SET);
+            if (znzwrite(data, sizeof(InternalPixelType), (size_t) elements, m_File) != (size_t) elements)
+                throw std::runtime_error(std::string("Unable to write file: ") + m_Header->fname);
+            m_Written += elements;
+        }
+
+        // Every voxel must have been written once
+        void Close()
+        {
+            if (m_Written != m_Elements)
+                throw std::runtime_error(std::string("Incomplete image written to ") + m_Header->fname);
+            // The final flush of a compressed stream can still fail
+            if (znzclose(m_File) != 0)
+                throw std::runtime_error(std::string("Unable to write file: ") + m_Header->fname);
+        }
+
+    private:
+        NIfTIStreamWriter(const NIfTIStreamWriter &);
+        NIfTIStreamWriter &operator=(const NIfTIStreamWriter &);
+
+        nifti_image *m_Header;
+        znzFile m_File;
+        bool m_Compressed;
+        long long m_Elements;
+        long long m_Written;
+    };
+
+    /*
+     * Writes a chunked image: a header-only NIfTI sidecar <name>.nii with the
+     * geometry and datatype, and the voxel data in <name>.chunks (see
+     * ChunkedImage). Only NIfTIUtils reads the voxels (ReadImage,
+     * ReadNIfTIImageRegion); readers that go through ITK fail on the sidecar. Voxels are appended in file order
+     * as with NIfTIStreamWriter; every time block of chunk[3] volumes is
+     * compressed by the threads once it is complete, straight from the
+     * caller's buffer when it holds whole blocks.
+     */
+    template<typename ImageType>
+    class ChunkedNIfTIWriter
+    {
+    public:
+        typedef typename ImageType::PixelType PixelType;
+
+        ChunkedNIfTIWriter(const itk::ImageBase<ImageType::ImageDimension> *geometry, const typename ImageType::SizeType &size, const std::string &fileName, const long long chunk[4], double timeStep = 0) : m_FileName(fileName), m_Volumes(0), m_Written(0)
+        {
+            const unsigned int Dimension = ImageType::ImageDimension;
+            if (Dimension > 4)
+                throw std::runtime_error("Chunked images have up to 4 dimensions: " + fileName);
+            long long imageSize[4] = {1, 1, 1, 1};
+            for (unsigned int i = 0; i < Dimension; ++i)
+                imageSize[i] = (long long) size[i];
+            m_Layout = ChunkedImage::Layout(imageSize, chunk, (int) sizeof(PixelType));
+            m_VolumeElements = imageSize[0] * imageSize[1] * imageSize[2];
+            m_Elements = m_VolumeElements * imageSize[3];
+            m_Writer.reset(new ChunkedImage::Writer(ChunksFileName(fileName), m_Layout));
+            // Header sidecar
+            typename ImageType::Pointer header = ImageType::New();
+            header->CopyInformation(geometry);
+            header->SetRegions(size);
+            nifti_image *nim = MakeNIfTIHeader<ImageType>(header, NIfTIDatatype(PixelType()), 0);
+            if (timeStep > 0)
+                nim->pixdim[4] = nim->dt = (float) timeStep;
+            std::strncpy(nim->descrip, ChunkedDescription, sizeof(nim->descrip) - 1);
+            if (nifti_set_filenames(nim, fileName.c_str(), 0, 1) != 0)
+            {
+                nifti_image_free(nim);
+                throw std::runtime_error("Invalid NIfTI file name: " + fileName);
+            }
+            nifti_image_write_hdr_img(nim, 0, "wb");
+            nifti_image_free(nim);
+            if (!IsChunkedImage(fileName))
+                throw std::runtime_error("Unable to write file: " + fileName);
+        }
+
+        void Write(const PixelType *data, long long elements)
+        {
+            if (m_Written + elements > m_Elements)
+                throw std::runtime_error("Too many voxels written to " + m_FileName);
+            m_Written += elements;
+            while (elements > 0)
+            {
+                if (m_Block.empty())
+                {
+                    long long volumes = elements / m_VolumeElements;
+                    if (m_Volumes + volumes < m_Layout.size[3])
+                        volumes -= volumes % m_Layout.chunk[3];
+                    if (volumes > 0)
+                    {
+                        m_Writer->WriteVolumes(data, m_Volumes, volumes);
+                        m_Volumes += volumes;
+                        data += volumes * m_VolumeElements;
+                        elements -= volumes * m_VolumeElements;
+                        continue;
+                    }
+                }
+                // Gather a partial time block
+                const long long blockElements = std::min<long long>(m_Layout.chunk[3], m_Layout.size[3] - m_Volumes) * m_VolumeElements;
+                const long long length = std::min(elements, blockElements - (long long) m_Block.size());
+                m_Block.insert(m_Block.end(), data, data + length);
+                data += length;
+                elements -= length;
+                if ((long long) m_Block.size() == blockElements)
+                {
+                    m_Writer->WriteVolumes(m_Block.data(), m_Volumes, blockElements / m_VolumeElements);
+                    m_Volumes += blockElements / m_VolumeElements;
+                    m_Block.clear();
+                }
+            }
+        }
+
+        // Every voxel must have been written once
+        void Close()
+        {
+            if (m_Written != m_Elements)
+                throw std::runtime_error("Incomplete image written to " + m_FileName);
+            m_Writer->Close();
+        }
+
+    private:
+        ChunkedNIfTIWriter(const ChunkedNIfTIWriter &);
+        ChunkedNIfTIWriter &operator=(const ChunkedNIfTIWriter &);
+
+        std::string m_FileName;
+        ChunkedImage::Layout m_Layout;
+        std::unique_ptr<ChunkedImage::Writer> m_Writer;
+        std::vector<PixelType> m_Block;
+        long long m_VolumeElements;
+        long long m_Elements;
+        long long m_Volumes;
+        long long m_Written;
+    };
+
+    // Write a whole image as a chunked image
+    template<typename ImageType>
+    void WriteChunkedImage(const ImageType *image, const std::string &fileName, const long long chunk[4], double timeStep = 0)
+    {
+        ChunkedNIfTIWriter<ImageType> writer(image, image->GetLargestPossibleRegion().GetSize(), fileName, chunk, timeStep);
+        writer.Write(image->GetBufferPointer(), (long long) image->GetBufferedRegion().GetNumberOfPixels());
+        writer.Close();
+    }
+
+    /*
+     * Header-only pre-pass over the volumes of a series: every file must be a
+     * readable NIfTI image with the geometry of the first one, so a bad volume
+     * is rejected before any voxel data is decoded.
+     */
+    inline void ValidateSeriesGeometry(const std::vector<std::string> &fileNames, double tolerance = 1e-4)
+    {
+        if (fileNames.empty())
+            throw std::runtime_error("Empty image series");
+        itk::NiftiImageIO::Pointer reference;
+        for (std::size_t f = 0; f < fileNames.size(); ++f)
+        {
+            itk::NiftiImageIO::Pointer io = itk::NiftiImageIO::New();
+            if (!io->CanReadFile(fileNames[f].c_str()))
+                throw std::runtime_error("Unable to read file: " + fileNames[f]);
+            io->SetFileName(fileNames[f]);
+            io->ReadImageInformation();
+            if (f == 0)
+            {
+                reference = io;
+                continue;
+            }
+            std::string difference;
+            if (io->GetNumberOfDimensions() != reference->GetNumberOfDimensions())
+                difference = "number of dimensions";
+            else if (io->GetNumberOfComponents() != reference->GetNumberOfComponents())
+                difference = "number of components";
+            for (unsigned int i = 0; i < reference->GetNumberOfDimensions() && difference.empty(); ++i)
+            {
+                if (io->GetDimensions(i) != reference->GetDimensions(i))
+                    difference = "size";
+                else if (std::abs(io->GetSpacing(i) - reference->GetSpacing(i)) > tolerance)
+                    difference = "spacing";
+                else if (std::abs(io->GetOrigin(i) - reference->GetOrigin(i)) > tolerance)
+                    difference = "origin";
+                for (unsigned int j = 0; j < reference->GetNumberOfDimensions() && difference.empty(); ++j)
+                    if (std::abs(io->GetDirection(i)[j] - reference->GetDirection(i)[j]) > tolerance)
+                        difference = "direction";
+            }
+            if (!difference.empty())
+                throw std::runtime_error("Volume " + fileNames[f] + " has a different " + difference + " than " + fileNames[0]);
+        }
+    }
+
+    /*
+     * Reads the acquisition time (in seconds) of every volume of a series, one
+     * per line, and returns the time step and offset NIfTI can store. NIfTI-1
+     * only represents uniform sampling, so non-uniform timestamps are reported
+     * and stored with their mean step.
+     */
+    inline void ReadTimestamps(const std::string &fileName, std::size_t volumes, double &timeStep, double &timeOffset)
+    {
+        std::ifstream file(fileName.c_str());
+        if (!file)
+            throw std::runtime_error("Unable to read timestamps file: " + fileName);
+        std::vector<double> timestamps;
+        double timestamp;
+        while (file >> timestamp)
+            timestamps.push_back(timestamp);
+        if (!file.eof())
+            throw std::runtime_error("Invalid timestamp in file: " + fileName);
+        if (timestamps.size() != volumes)
+        {
+            std::ostringstream s;
+            s << "The timestamps file has " << timestamps.size() << " entries for " << volumes << " volumes";
+            throw std::runtime_error(s.str());
+        }
+        for (std::size_t i = 1; i < timestamps.size(); ++i)
+            if (timestamps[i] <= timestamps[i - 1])
+                throw std::runtime_error("Timestamps must be strictly increasing: " + fileName);
+        timeOffset = timestamps.empty() ? 0 : timestamps[0];
+        timeStep = (timestamps.size() > 1) ? (timestamps.back() - timestamps.front()) / (timestamps.size() - 1) : 1;
+        for (std::size_t i = 1; i < timestamps.size(); ++i)
+        {
+            if (std::abs(timestamps[i] - timestamps[i - 1] - timeStep) > 1e-3 * timeStep)
+            {
+                std::cerr << "Warning! Non-uniform timestamps, stored with their mean step of " << timeStep << " s" << std::endl;
+                break;
+            }
+        }
+    }
+
+    /*
+     * Writes an image as int16 with scl_slope/scl_inter chosen from its
+     * intensity range, halving the size of float32 intermediates. ITK's NIfTI
+     * reader applies scl_slope/scl_inter on read, so these files are read back
+     * transparently as float images. The components of a vector image share
+     * the scaling and are stored one volume per component.
+     */
+    template<typename ImageType>
+    void WriteScaledNIfTIImage(const ImageType *image, const std::string &fileName, double timeStep = 0)
+    {
+        typedef typename ImageType::InternalPixelType PixelType;
+        const PixelType *buffer = image->GetBufferPointer();
+        const unsigned int components = image->GetNumberOfComponentsPerPixel();
+        const long long voxels = (long long) image->GetBufferedRegion().GetNumberOfPixels();
+        const long long elements = voxels * components;
+        // Intensity range
+        double minimum = std::numeric_limits<double>::max();
+        double maximum = std::numeric_limits<double>::lowest();
+        #pragma omp parallel for reduction(min:minimum) reduction(max:maximum)
+        for (long long i = 0; i < elements; ++i)
+        {
+            minimum = std::min(minimum, (double) buffer[i]);
+            maximum = std::max(maximum, (double) buffer[i]);
+        }
+        // Map [minimum, maximum] onto [-32767, 32767]
+        const double range = 32767.0;
+        double intercept = 0.5 * (maximum + minimum);
+        double slope = 0.5 * (maximum - minimum) / range;
+        if (voxels == 0 || slope <= 0)
+        {
+            slope = 1;
+            intercept = (voxels == 0) ? 0 : minimum;
+        }
+        nifti_image *nim = MakeNIfTIHeader<ImageType>(image, NIFTI_TYPE_INT16, 1, components);
+        if (timeStep > 0)
+            nim->pixdim[4] = nim->dt = (float) timeStep;
+        nim->scl_slope = (float) slope;
+        nim->scl_inter = (float) intercept;
+        nim->cal_min = (float) minimum;
+        nim->cal_max = (float) maximum;
+        short *data = static_cast<short *>(nim->data);
+        #pragma omp parallel for
+        for (long long i = 0; i < elements; ++i)
+            data[(i % components) * voxels + i / components] = (short) std::max(-range, std::min(range, std::round((buffer[i] - intercept) / slope)));
+        if (nifti_set_filenames(nim, fileName.c_str(), 0, 1) != 0)
+        {
+            nifti_image_free(nim);
+            throw std::runtime_error("Invalid NIfTI file name: " + fileName);
+        }
+        const bool written = WriteNIfTIFile(nim);
+        nifti_image_free(nim);
+        if (!written)
+            throw std::runtime_error("Unable to write file: " + fileName);
+    }
+
+    // Convert a row of raw voxels to the pixel type
+    template<typename InputPixelType, typename PixelType>
+    void ConvertRow(const void *row, long long length, PixelType *output)
+    {
+        const InputPixelType *input = static_cast<const InputPixelType *>(row);
+        for (long long i = 0; i < length; ++i)
+            output[i] = (PixelType) input[i];
+    }
+
+    // Convert raw voxels of a NIfTI datatype to the pixel type, with the intensity scaling NiftiImageIO applies
+    template<typename PixelType>
+    void ConvertVoxels(int datatype, const void *voxels, long long length, double slope, double intercept, PixelType *output, const std::string &fileName)
+    {
+        switch (datatype)
+        {
+            case NIFTI_TYPE_UINT8: ConvertRow<unsigned char>(voxels, length, output); break;
+            case NIFTI_TYPE_INT8: ConvertRow<signed char>(voxels, length, output); break;
+            case NIFTI_TYPE_UINT16: ConvertRow<unsigned short>(voxels, length, output); break;
+            case NIFTI_TYPE_INT16: ConvertRow<short>(voxels, length, output); break;
+            case NIFTI_TYPE_UINT32: ConvertRow<unsigned int>(voxels, length, output); break;
+            case NIFTI_TYPE_INT32: ConvertRow<int>(voxels, length, output); break;
+            case NIFTI_TYPE_FLOAT32: ConvertRow<float>(voxels, length, output); break;
+            case NIFTI_TYPE_FLOAT64: ConvertRow<double>(voxels, length, output); break;
+            default: throw std::runtime_error("Unsupported NIfTI datatype: " + fileName);
+        }
+        if (slope != 0 && !(slope == 1 && intercept == 0))
+            for (long long i = 0; i < length; ++i)
+                output[i] = (PixelType) (output[i] * slope + intercept);
+    }
+
+    /*
+     * Image with the geometry read from a header and no buffer, to describe
+     * images that are never held in memory. Dimensions beyond those of the
+     * file get size and spacing 1.
+     */
+    template<typename ImageType>
+    typename ImageType::Pointer ImageGeometry(const itk::ImageIOBase *io)
+    {
+        const unsigned int Dimension = std::min((unsigned int) ImageType::ImageDimension, io->GetNumberOfDimensions());
+        typename ImageType::SizeType size;
+        typename ImageType::SpacingType spacing;
+        typename ImageType::PointType origin;
+        typename ImageType::DirectionType direction;
+        size.Fill(1);
+        spacing.Fill(1);
+        origin.Fill(0);
+        direction.SetIdentity();
+        for (unsigned int i = 0; i < Dimension; ++i)
+        {
+            size[i] = io->GetDimensions(i);
+            spacing[i] = io->GetSpacing(i);
+            origin[i] = io->GetOrigin(i);
+            for (unsigned int j = 0; j < Dimension; ++j)
+                direction(j, i) = io->GetDirection(i)[j];
+        }
+        typename ImageType::Pointer image = ImageType::New();
+        image->SetRegions(size);
+        image->SetSpacing(spacing);
+        image->SetOrigin(origin);
+        image->SetDirection(direction);
+        return image;
+    }
+
+    /*
+     * Reads a single component of a vector NIfTI image, which is stored as
+     * one volume per component, so the other components are never decoded.
+     */
+    template<typename ImageType>
+    typename ImageType::Pointer ReadNIfTIComponent(const std::string &fileName, unsigned int component)
+    {
+        itk::NiftiImageIO::Pointer io = itk::NiftiImageIO::New();
+        if (!io->CanReadFile(fileName.c_str()))
+            throw std::runtime_error("Unable to read file: " + fileName);
+        io->SetFileName(fileName);
+        io->ReadImageInformation();
+        if (component >= io->GetNumberOfComponents() || io->GetNumberOfDimensions() > ImageType::ImageDimension)
+            throw std::runtime_error("Invalid image component: " + fileName);
+        typename ImageType::Pointer image = ImageGeometry<ImageType>(io);
+        image->Allocate();
+        nifti_image *nim = nifti_image_read(fileName.c_str(), 0);
+        if (nim == NULL)
+            throw std::runtime_error("Unable to read NIfTI header: " + fileName);
+        // Every dimension but the components one whole (-1), niftilib swaps the bytes
+        int dims[8] = {0, -1, -1, -1, -1, (int) component, -1, -1};
+        void *data = NULL;
+        const long long read = nifti_read_collapsed_image(nim, dims, &data);
+        const long long voxels = (long long) image->GetBufferedRegion().GetNumberOfPixels();
+        if (read != voxels * nim->nbyper)
+        {
+            free(data);
+            nifti_image_free(nim);
+            throw std::runtime_error("Unable to read image component: " + fileName);
+        }
+        try
+        {
+            ConvertVoxels(nim->datatype, data, voxels, nim->scl_slope, nim->scl_inter, image->GetBufferPointer(), fileName);
+        }
+        catch (...)
+        {
+            free(data);
+            nifti_image_free(nim);
+            throw;
+        }
+        free(data);
+        nifti_image_free(nim);
+        return image;
+    }
+
+    /*
+     * Reads only a region (a sub-volume and/or a range of time points) of a
+     * scalar NIfTI image. Uncompressed files are streamed by NiftiImageIO,
+     * which reads just the requested region. Compressed files are read row by
+     * row through a GzipIndex, inflating from the access point closest to the
+     * data. Chunked images inflate, in parallel, only the chunks overlapping
+     * the region. The returned image starts at index zero with its origin at the
+     * first voxel of the region.
+     */
+    template<typename ImageType>
+    typename ImageType::Pointer ReadNIfTIImageRegion(const std::string &fileName, const typename ImageType::RegionType &region)
+    {
+        typedef typename ImageType::PixelType PixelType;
+        const unsigned int Dimension = ImageType::ImageDimension;
+        itk::NiftiImageIO::Pointer io = itk::NiftiImageIO::New();
+        if (!io->CanReadFile(fileName.c_str()))
+            throw std::runtime_error("Unable to read file: " + fileName);
+        io->SetFileName(fileName);
+        io->ReadImageInformation();
+        if (io->GetNumberOfComponents() != 1)
+            throw std::runtime_error("Only scalar images are supported: " + fileName);
+        if (io->GetNumberOfDimensions() > Dimension)
+            throw std::runtime_error("Unsupported image dimensions: " + fileName);
+        // Geometry of the whole image
+        typename ImageType::Pointer reference = ImageGeometry<ImageType>(io);
+        const typename ImageType::SizeType size = reference->GetLargestPossibleRegion().GetSize();
+        if (region.GetNumberOfPixels() == 0 || !reference->GetLargestPossibleRegion().IsInside(region))
+            throw std::runtime_error("The requested region is outside the image: " + fileName);
+        const bool compressed = fileName.size() > 3 && fileName.compare(fileName.size() - 3, 3, ".gz") == 0;
+        const bool chunked = IsChunkedImage(fileName);
+        if (!compressed && !chunked)
+        {
+            // The reader receives the requested region of the filter and NiftiImageIO reads only that region
+            typedef itk::ImageFileReader<ImageType> ReaderType;
+            typedef itk::RegionOfInterestImageFilter<ImageType, ImageType> RegionOfInterestFilterType;
+            typename ReaderType::Pointer reader = ReaderType::New();
+            reader->SetImageIO(io);
+            reader->SetFileName(fileName);
+            typename RegionOfInterestFilterType::Pointer filter = RegionOfInterestFilterType::New();
+            filter->SetInput(reader->GetOutput());
+            filter->SetRegionOfInterest(region);
+            filter->Update();
+            typename ImageType::Pointer image = filter->GetOutput();
+            image->DisconnectPipeline();
+            return image;
+        }
+        // Voxel layout of the file
+        nifti_image *nim = nifti_image_read(fileName.c_str(), 0);
+        if (nim == NULL)
+            throw std::runtime_error("Unable to read NIfTI header: " + fileName);
+        const long long offset = (long long) nim->iname_offset;
+        const int datatype = nim->datatype;
+        const int bytes = nim->nbyper;
+        const bool swap = nim->byteorder != nifti_short_order();
+        const double slope = nim->scl_slope;
+        const double intercept = nim->scl_inter;
+        nifti_image_free(nim);
+        // Output image
+        typename ImageType::PointType start;
+        reference->TransformIndexToPhysicalPoint(region.GetIndex(), start);
+        typename ImageType::Pointer image = ImageType::New();
+        image->SetRegions(region.GetSize());
+        image->SetSpacing(reference->GetSpacing());
+        image->SetOrigin(start);
+        image->SetDirection(reference->GetDirection());
+        image->Allocate();
+        PixelType *buffer = image->GetBufferPointer();
+        if (chunked)
+        {
+            if (Dimension > 4)
+                throw std::runtime_error("Chunked images have up to 4 dimensions: " + fileName);
+            ChunkedImage::Reader chunks(ChunksFileName(fileName));
+            if (chunks.GetLayout().bytes != bytes)
+                throw std::runtime_error("Chunk data does not match its header: " + fileName);
+            long long first[4] = {0, 0, 0, 0};
+            long long extent[4] = {1, 1, 1, 1};
+            for (unsigned int i = 0; i < Dimension; ++i)
+            {
+                first[i] = (long long) region.GetIndex(i);
+                extent[i] = (long long) region.GetSize(i);
+            }
+            const long long voxels = (long long) region.GetNumberOfPixels();
+            std::vector<char> raw(voxels * bytes);
+            chunks.ReadBox(first, extent, raw.data());
+            ConvertVoxels(datatype, raw.data(), voxels, slope, intercept, buffer, fileName);
+            return image;
+        }
+        // Rows along x are contiguous in the file, rows are visited in file order
+        GzipIndex gzip(fileName);
+        const long long rowLength = (long long) region.GetSize(0);
+        const long long rows = (long long) region.GetNumberOfPixels() / rowLength;
+        std::vector<char> row(rowLength * bytes);
+        for (long long r = 0; r < rows; ++r)
+        {
+            long long position = 0;
+            long long stride = 1;
+            long long rest = r;
+            for (unsigned int i = 0; i < Dimension; ++i)
+            {
+                long long coordinate = (long long) region.GetIndex(i);
+                if (i > 0)
+                {
+                    coordinate += rest % (long long) region.GetSize(i);
+                    rest /= (long long) region.GetSize(i);
+                }
+                position += coordinate * stride;
+                stride *= (long long) size[i];
+            }
+            gzip.Read(offset + position * bytes, rowLength * bytes, row.data());
+            if (swap && bytes > 1)
+                nifti_swap_Nbytes(rowLength, bytes, row.data());
+            ConvertVoxels(datatype, row.data(), rowLength, slope, intercept, buffer + r * rowLength, fileName);
+        }
+        return image;
+    }
+
+    // Read a whole image, chunked images included (other files are read by ITK)
+    template<typename ImageType>
+    typename ImageType::Pointer ReadImage(const std::string &fileName)
+    {
+        if (!IsChunkedImage(fileName))
+        {
+            typedef itk::ImageFileReader<ImageType> ReaderType;
+            typename ReaderType::Pointer reader = ReaderType::New();
+            reader->SetFileName(fileName);
+            reader->Update();
+            typename ImageType::Pointer image = reader->GetOutput();
+            image->DisconnectPipeline();
+            return image;
+        }
+        itk::NiftiImageIO::Pointer io = itk::NiftiImageIO::New();
+        io->SetFileName(fileName);
+        io->ReadImageInformation();
+        return ReadNIfTIImageRegion<ImageType>(fileName, ImageGeometry<ImageType>(io)->GetLargestPossibleRegion());
+    }
+}
+
+#endif
@@ -0,0 +1,25 @@
+# Build stamp of the --cache keys (ResultCache.hpp), run at every build:
+# cmake -DSOURCE_DIR=... -DVERSION=... -DOUTPUT=... -P ONTsVersion.cmake
+# The project version, the git revision and, for a modified tree, a hash of
+# the changes. OUTPUT is only rewritten when the stamp changes, so an
+# unchanged tree rebuilds nothing.
+set(ONTS_VERSION ${VERSION})
+find_package(Git QUIET)
+if(GIT_FOUND)
+    execute_process(COMMAND ${GIT_EXECUTABLE} describe --always --dirty
+                    WORKING_DIRECTORY ${SOURCE_DIR}
+                    OUTPUT_VARIABLE ONTS_GIT_REVISION
+                    OUTPUT_STRIP_TRAILING_WHITESPACE ERROR_QUIET)
+    if(ONTS_GIT_REVISION)
+        set(ONTS_VERSION "${ONTS_VERSION}-${ONTS_GIT_REVISION}")
+    endif()
+    if(ONTS_GIT_REVISION MATCHES "-dirty$")
+        execute_process(COMMAND ${GIT_EXECUTABLE} diff HEAD
+                        WORKING_DIRECTORY ${SOURCE_DIR}
+                        OUTPUT_VARIABLE ONTS_GIT_CHANGES
+                        ERROR_QUIET)
+        string(MD5 ONTS_GIT_CHANGES_HASH "${ONTS_GIT_CHANGES}")
+        set(ONTS_VERSION "${ONTS_VERSION}-${ONTS_GIT_CHANGES_HASH}")
+    endif()
+endif()
+configure_file(${CMAKE_CURRENT_LIST_DIR}/ONTsVersion.cpp.in ${OUTPUT} @ONLY)
@@ -0,0 +1,550 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* ONTs worker daemon                                                       *
+***************************************************************************/
+
+#include <ITKUtils.hpp>
+#include <EigenITK.hpp>
+#include <CommandLineOptions.hpp>
+#include <ResourceCache.hpp>
+#include <Dispatch.hpp>
+#include <MaskImage.hpp>
+#include <PreprocessImage.hpp>
+#include <HistogramStandarization.hpp>
+#include <GlobalPCADenoising.hpp>
+#include <SmoothImage.hpp>
+#include <TemporalPrincipalComponentAnalysis.hpp>
+#include <NIfTIUtils.hpp>
+#include <itkImage.h>
+#include <itkMultiThreaderBase.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <initializer_list>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <omp.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static std::atomic<bool> running(true);
+
+static void Shutdown(int)
+{
+    running = false;
+}
+
+
+// Get a cached image. The returned image is a graft, so pipelines of concurrent jobs never modify the shared one
+template<typename ImageType>
+typename ImageType::Pointer CachedImage(ResourceCache &cache, const std::string &fileName)
+{
+    std::shared_ptr<typename ImageType::Pointer> cached = cache.Get<typename ImageType::Pointer>(fileName, [](const std::string &name) { return ITKUtils::ReadNIfTIImage<ImageType>(name); });
+    typename ImageType::Pointer image = ImageType::New();
+    image->Graft(cached->GetPointer());
+    return image;
+}
+
+
+// Get a cached mask on the grid of the image, resampled once per mask and grid when the grids differ
+template<typename ImageType, typename MaskType>
+typename MaskType::Pointer CachedGridMask(ResourceCache &cache, const ImageType *image, const std::string &fileName)
+{
+    typename MaskType::Pointer mask = CachedImage<MaskType>(cache, fileName);
+    if (SameGrid<ImageType, MaskType>(image, mask))
+        return mask;
+    std::shared_ptr<typename MaskType::Pointer> cached = cache.Get<typename MaskType::Pointer>(fileName, GridKey<ImageType, MaskType>(image), [&](const std::string &) { return ResampleMask<ImageType, MaskType>(image, mask); });
+    typename MaskType::Pointer resampled = MaskType::New();
+    resampled->Graft(cached->GetPointer());
+    return resampled;
+}
+
+
+template<typename ImageType, typename MaskType>
+void MaskImageEqualDimensionsJob(char *argv[], ResourceCache &cache)
+{
+    typename ImageType::Pointer image = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
+    typename MaskType::Pointer mask = CachedGridMask<ImageType, MaskType>(cache, image, std::string(argv[2]));
+    typename ImageType::Pointer output = MaskEqualDimensions<ImageType, MaskType>(image, mask);
+    ITKUtils::WriteNIfTIImage<ImageType>(output, std::string(argv[3]));
+}
+
+
+template<typename ImageType, typename MaskType>
+void MaskImageDifferentDimensionsJob(char *argv[], ResourceCache &cache)
+{
+    typename ImageType::Pointer image = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
+    typename MaskType::Pointer mask = CachedGridMask<ImageType, MaskType>(cache, image, std::string(argv[2]));
+    typename ImageType::Pointer output = MaskDifferentDimensions<ImageType, MaskType>(image, mask);
+    ITKUtils::WriteNIfTIImage<ImageType>(output, std::string(argv[3]));
+}
+
+
+void MaskImageJob(int argc, char *argv[], ResourceCache &cache)
+{
+    if (argc < 4)
+        throw std::runtime_error("Usage: MaskImage inputImage maskImage outputImage");
+    typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
+    typename itk::ImageIOBase::Pointer maskIO = ITKUtils::ReadImageInformation(std::string(argv[2]));
+    const unsigned int ImageDimension = imageIO->GetNumberOfDimensions();
+    const unsigned int MaskDimension = maskIO->GetNumberOfDimensions();
+    if (ImageDimension != MaskDimension && ImageDimension != (MaskDimension + 1))
+        throw std::runtime_error("Incompatible image dimensions");
+    Dispatch::ByDimension<3, 4>(ImageDimension, [&](auto dimension)
+    {
+        const unsigned int Dimension = decltype(dimension)::value;
+        if (MaskDimension == Dimension)
+            MaskImageEqualDimensionsJob<itk::Image<float, Dimension>, itk::Image<unsigned char, Dimension>>(argv, cache);
+        else
+            MaskImageDifferentDimensionsJob<itk::Image<float, Dimension>, itk::Image<unsigned char, Dimension - 1>>(argv, cache);
+    });
+}
+
+
+template<typename ImageType>
+void PreprocessImageJob(int argc, char *argv[], const CommandLineOptions &options, ResourceCache &cache)
+{
+    typedef itk::Image<unsigned char, 3> MaskType;
+    typename ImageType::Pointer image = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
+    typename MaskType::Pointer mask = CachedImage<MaskType>(cache, std::string(argv[2]));
+    const double zerosFraction = (argc > 5) ? std::atof(argv[5]) : 0.05;
+    const float truncateValue = (argc > 6) ? (float) std::atof(argv[6]) : 0.0f;
+    typename MaskType::Pointer refined = PreprocessSeries<ImageType, MaskType>(image, mask, zerosFraction, truncateValue);
+    if (options.Has("int16"))
+        NIfTIUtils::WriteScaledNIfTIImage<ImageType>(image, std::string(argv[3]));
+    else
+        ITKUtils::WriteNIfTIImage<ImageType>(image, std::string(argv[3]));
+    ITKUtils::WriteNIfTIImage<MaskType>(refined, std::string(argv[4]));
+}
+
+
+void PreprocessImageJob(int argc, char *argv[], const CommandLineOptions &options, ResourceCache &cache)
+{
+    if (argc < 5)
+        throw std::runtime_error("Usage: PreprocessImage inputImage maskImage outputImage outputMask [zerosFraction=0.05] [insideMaskTruncateValue=0]");
+    typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
+    const unsigned int ImageDimension = imageIO->GetNumberOfDimensions();
+    Dispatch::ByDimension<3, 4>(ImageDimension, [&](auto dimension)
+    {
+        PreprocessImageJob<itk::Image<float, decltype(dimension)::value>>(argc, argv, options, cache);
+    });
+}
+
+
+template<class ImageType, class MaskType>
+void HistogramStandardizationJob(int argc, char *argv[], const CommandLineOptions &options, ResourceCache &cache)
+{
+    typename ImageType::Pointer imageSource = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
+    typename ImageType::Pointer imageReference = CachedImage<ImageType>(cache, std::string(argv[2]));
+    ITKUtils::AssertCompatibleImageAndMaskSizes<ImageType, ImageType>(imageSource, imageReference);
+    const unsigned int bins = (argc > 4) ? (unsigned int) std::atoi(argv[4]) : 128;
+    const unsigned int matchPoints = (argc > 5) ? (unsigned int) std::atoi(argv[5]) : 10;
+    typename MaskType::Pointer mask;
+    if (options.Has("mask"))
+        mask = CachedImage<MaskType>(cache, options.Get("mask"));
+    const unsigned int subsample = (unsigned int) std::atoi(options.Get("subsample", "1").c_str());
+    typename ImageType::Pointer output = HistogramMatch<ImageType, MaskType>(imageSource, imageReference, bins, matchPoints, mask.GetPointer(), subsample);
+    ITKUtils::WriteNIfTIImage<ImageType>(output, std::string(argv[3]));
+}
+
+
+void HistogramStandardizationJob(int argc, char *argv[], const CommandLineOptions &options, ResourceCache &cache)
+{
+    if (argc < 4)
+        throw std::runtime_error("Usage: HistogramStandardization sourceImage referenceImage outputImage [bins=128] [matchPoints=10]");
+    typename itk::ImageIOBase::Pointer sourceIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
+    const unsigned int SourceImageDimension = sourceIO->GetNumberOfDimensions();
+    Dispatch::ByDimension<2, 3, 4>(SourceImageDimension, [&](auto dimension)
+    {
+        const unsigned int Dimension = decltype(dimension)::value;
+        HistogramStandardizationJob<itk::Image<float, Dimension>, itk::Image<unsigned char, (Dimension > 3) ? 3 : Dimension>>(argc, argv, options, cache);
+    });
+}
+
+
+// Projection onto a cached temporal basis (GlobalPCADenoising --basis with a variance fraction)
+void GlobalPCADenoisingJob(int argc, char *argv[], const CommandLineOptions &options, ResourceCache &cache)
+{
+    typedef itk::Image<float, 4> ComponentsImageType;
+    typedef itk::Image<unsigned char, 3> MaskType;
+    if (argc < 5)
+        throw std::runtime_error("Usage: GlobalPCADenoising inputImage maskImage variance outputImage [minComponents] [maxComponents] --basis=basisFile");
+    std::shared_ptr<TemporalPrincipalComponentAnalysis> pca = cache.Get<TemporalPrincipalComponentAnalysis>(options.Get("basis"), [](const std::string &name) { TemporalPrincipalComponentAnalysis basis; basis.load(name); return basis; });
+    typename ComponentsImageType::Pointer PWI = ITKUtils::ReadNIfTIImage<ComponentsImageType>(std::string(argv[1]));
+    typename MaskType::Pointer mask = CachedImage<MaskType>(cache, std::string(argv[2]));
+    const double variance = std::strtod(argv[3], NULL);
+    typename ComponentsImageType::SizeType imageSize = PWI->GetLargestPossibleRegion().GetSize();
+    const unsigned int minComponents = (argc > 5) ? std::atoi(argv[5]) : std::ceil(imageSize[3] * 0.0500);
+    const unsigned int maxComponents = (argc > 6) ? std::atoi(argv[6]) : std::ceil(imageSize[3] * 0.3333);
+    if (imageSize[3] != pca->dimensions())
+        throw std::runtime_error("Image and temporal basis have a different number of time points");
+    typename MaskType::Pointer nonZerosMask = options.Has("refined") ? mask : ITKUtils::ZerosMaskIntersect<ComponentsImageType, MaskType>(PWI, mask, true, false, 0.05);
+    Eigen::MatrixXf dataset(MaskedDataset<ComponentsImageType, MaskType>(PWI, nonZerosMask));
+    // The cached basis is shared between jobs, so only its const interface is used (centred on the subject's own mean curve)
+    Eigen::MatrixXf PWIPCARawdata = pca->project(dataset, pca->componentsVarianceExplained(variance, minComponents, maxComponents), TemporalPrincipalComponentAnalysis::columnMean(dataset));
+    CorrectNegativeCurves(PWIPCARawdata);
+    EigenITK::toITK<ComponentsImageType, MaskType>(PWIPCARawdata, nonZerosMask, PWI);
+    if (options.Has("smooth"))
+        Smoothing::SmoothSeries<ComponentsImageType, MaskType>(PWI, nonZerosMask, Smoothing::Gaussian, std::atof(options.Get("smooth").c_str()));
+    if (options.Has("int16"))
+        NIfTIUtils::WriteScaledNIfTIImage<ComponentsImageType>(PWI, std::string(argv[4]));
+    else
+        ITKUtils::WriteNIfTIImage<ComponentsImageType>(PWI, std::string(argv[4]));
+}
+
+
+/*
+ * Whether a job can run inside the daemon: it only uses options that the
+ * in-process version implements, and its inputs are scalar images that ITK
+ * reads (not vector images, and not chunked sidecars). Any other job runs the
+ * tool itself, so no option is silently dropped.
+ */
+bool RunsInProcess(const CommandLineOptions &options, std::initializer_list<std::string> supported, std::initializer_list<std::string> inputs)
+{
+    for (std::map<std::string, std::string>::const_iterator it = options.All().begin(); it != options.All().end(); ++it)
+        if (std::find(supported.begin(), supported.end(), it->first) == supported.end())
+            return false;
+    for (std::initializer_list<std::string>::const_iterator input = inputs.begin(); input != inputs.end(); ++input)
+        if (ITKUtils::ReadImageInformation(*input)->GetNumberOfComponents() != 1 || NIfTIUtils::IsChunkedImage(*input))
+            return false;
+    return true;
+}
+
+
+// Tools a job may run as a child process
+static const char *SpawnableTools[] = {"AdaptiveHistogramEqualization", "MaskImage", "PreprocessImage", "CastImage",
+                                       "ConvertNIfTI3DImageSeriesTo3DVectorImage", "ConvertNIfTI3DImageSeriesTo4DImage", "ConvertNIfTI3DVectorImageTo4DImage",
+                                       "GlobalPCADenoising", "GlobalPCABasis", "HistogramStandardization", "TruncateNegatives", "CopyHeaderInformation",
+                                       "SaveNIfTI", "ExtractImageRegion", "TimeSeriesStatistics", "SmoothImage"};
+
+
+// Run any other ONTs tool as a child process from the directory of the daemon executable
+void SpawnJob(const std::vector<std::string> &arguments)
+{
+    if (arguments[0].find('/') != std::string::npos || std::find(std::begin(SpawnableTools), std::end(SpawnableTools), arguments[0]) == std::end(SpawnableTools))
+        throw std::runtime_error("Unknown tool: " + arguments[0]);
+    char executable[4096];
+    const ssize_t length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+    std::string directory = ".";
+    if (length > 0)
+    {
+        executable[length] = '\0';
+        directory = std::string(executable);
+        directory = directory.substr(0, directory.find_last_of('/'));
+    }
+    const std::string tool = directory + "/" + arguments[0];
+    std::vector<char *> argv;
+    for (std::size_t i = 0; i < arguments.size(); ++i)
+        argv.push_back(const_cast<char *>(arguments[i].c_str()));
+    argv.push_back(NULL);
+    pid_t pid;
+    if (posix_spawn(&pid, tool.c_str(), NULL, NULL, argv.data(), environ) != 0)
+        throw std::runtime_error("Unable to run tool: " + tool);
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        throw std::runtime_error(arguments[0] + " failed");
+}
+
+
+// Split a job line into arguments (double quotes group arguments with spaces)
+std::vector<std::string> Tokenize(const std::string &line)
+{
+    std::vector<std::string> tokens;
+    std::string token;
+    bool quoted = false, pending = false;
+    for (std::size_t i = 0; i < line.size(); ++i)
+    {
+        const char c = line[i];
+        if (c == '"')
+        {
+            quoted = !quoted;
+            pending = true;
+        }
+        else if (!quoted && (c == ' ' || c == '\t' || c == '\r'))
+        {
+            if (pending)
+                tokens.push_back(token);
+            token.clear();
+            pending = false;
+        }
+        else
+        {
+            token += c;
+            pending = true;
+        }
+    }
+    if (pending)
+        tokens.push_back(token);
+    return tokens;
+}
+
+
+std::string RunJob(const std::string &line, ResourceCache &cache)
+{
+    std::vector<std::string> arguments = Tokenize(line);
+    if (arguments.empty())
+        return "";
+    if (arguments[0] == "STATS")
+    {
+        std::ostringstream s;
+        s << "OK hits=" << cache.Hits() << " misses=" << cache.Misses() << "\n";
+        return s.str();
+    }
+    const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    try
+    {
+        std::vector<char *> argv;
+        for (std::size_t i = 0; i < arguments.size(); ++i)
+            argv.push_back(const_cast<char *>(arguments[i].c_str()));
+        argv.push_back(NULL);
+        int argc = arguments.size();
+        CommandLineOptions options(argc, argv.data());
+        const std::string &tool = arguments[0];
+        // Other options (--cache, --max-memory, --profile, ...) and other inputs are handled by the tools themselves
+        if (tool == "MaskImage" && argc > 3 && RunsInProcess(options, {}, {std::string(argv[1]), std::string(argv[2])}))
+            MaskImageJob(argc, argv.data(), cache);
+        else if (tool == "PreprocessImage" && argc > 4 && RunsInProcess(options, {"int16"}, {std::string(argv[1]), std::string(argv[2])}))
+            PreprocessImageJob(argc, argv.data(), options, cache);
+        else if (tool == "HistogramStandardization" && argc > 3 && RunsInProcess(options, {"mask", "subsample"}, {std::string(argv[1]), std::string(argv[2])}))
+            HistogramStandardizationJob(argc, argv.data(), options, cache);
+        else if (tool == "GlobalPCADenoising" && options.Has("basis") && argc > 4 && std::string(argv[3]) != "mp" && RunsInProcess(options, {"basis", "refined", "smooth", "int16"}, {std::string(argv[1]), std::string(argv[2])}))
+            GlobalPCADenoisingJob(argc, argv.data(), options, cache);
+        else
+            SpawnJob(Tokenize(line));
+    }
+    catch (itk::ExceptionObject & err)
+    {
+        std::string message(err.GetDescription());
+        std::replace(message.begin(), message.end(), '\n', ' ');
+        return "ERROR " + message + "\n";
+    }
+    catch (std::exception & err)
+    {
+        std::string message(err.what());
+        std::replace(message.begin(), message.end(), '\n', ' ');
+        return "ERROR " + message + "\n";
+    }
+    std::ostringstream s;
+    s << "OK " << std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() << "\n";
+    return s.str();
+}
+
+
+/*
+ * Client connection: the unfinished line received last, the jobs received and
+ * not started yet, and whether one of its jobs is running (one at a time, so
+ * that the answers keep the order of the jobs).
+ */
+struct Connection
+{
+    std::string buffer;
+    std::deque<std::string> jobs;
+    bool busy = false;
+    bool closed = false;
+};
+
+
+// Jobs of all the connections, run by the pool in the order they arrive
+struct JobQueue
+{
+    std::map<int, Connection> connections;
+    std::deque<std::pair<int, std::string>> jobs;
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    // Queue the next job of a connection unless one of its jobs is running (with the mutex held)
+    void Next(int connection)
+    {
+        Connection &client = connections[connection];
+        if (client.busy || client.jobs.empty() || !running)
+            return;
+        jobs.push_back(std::make_pair(connection, client.jobs.front()));
+        client.jobs.pop_front();
+        client.busy = true;
+        condition.notify_one();
+    }
+};
+
+
+// Read what a connection sent, queueing every complete line as a job
+void ReceiveJobs(int connection, JobQueue &queue)
+{
+    char chunk[4096];
+    const ssize_t received = recv(connection, chunk, sizeof(chunk), 0);
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    Connection &client = queue.connections[connection];
+    if (received <= 0)
+    {
+        client.closed = true;
+        return;
+    }
+    client.buffer.append(chunk, received);
+    std::size_t end;
+    while ((end = client.buffer.find('\n')) != std::string::npos)
+    {
+        client.jobs.push_back(client.buffer.substr(0, end));
+        client.buffer.erase(0, end + 1);
+    }
+    queue.Next(connection);
+}
+
+
+int main(int argc, char *argv[])
+{
+    CommandLineOptions options(argc, argv);
+    if (argc < 2)
+    {
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: ONTsWorker socketPath [workers=hardware threads] [cacheEntries=32]" << std::endl;
+        std::cerr << "Every job runs on hardware threads / workers threads" << std::endl;
+        std::cerr << "Jobs are sent as one line per job with the same arguments as the command line tools, e.g.:" << std::endl;
+        std::cerr << "\tMaskImage inputImage maskImage outputImage" << std::endl;
+        std::cerr << "Each job is answered with \"OK <seconds>\" or \"ERROR <message>\". STATS reports cache hits and misses." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::string socketPath(argv[1]);
+    const unsigned int hardware = std::max(1u, std::thread::hardware_concurrency());
+    unsigned int workers = hardware;
+    if (argc > 2)
+        workers = std::max(1, std::atoi(argv[2]));
+    std::size_t cacheEntries = 32;
+    if (argc > 3)
+        cacheEntries = (std::size_t) std::atoi(argv[3]);
+
+    // Listen on the Unix domain socket
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Socket path too long: " << socketPath << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (server < 0 || bind(server, (sockaddr *) &address, sizeof(address)) < 0 || listen(server, 128) < 0)
+    {
+        std::cerr << "Unable to listen on socket: " << socketPath << " (" << std::strerror(errno) << ")" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::signal(SIGINT, Shutdown);
+    std::signal(SIGTERM, Shutdown);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // Split the hardware threads among the workers: the OpenMP, ITK and Eigen parallel regions of concurrent jobs
+    // (and of the tools they spawn) would otherwise run workers x hardware threads
+    const unsigned int jobThreads = std::max(1u, hardware / workers);
+    itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(jobThreads);
+    setenv("OMP_NUM_THREADS", std::to_string(jobThreads).c_str(), 0);
+    setenv("ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS", std::to_string(jobThreads).c_str(), 0);
+
+    // Shared pool of workers running the jobs of all the connections, answering each one with a single line
+    ResourceCache cache(cacheEntries);
+    JobQueue queue;
+    std::vector<std::thread> pool;
+    for (unsigned int i = 0; i < workers; ++i)
+    {
+        pool.push_back(std::thread([&]()
+        {
+            omp_set_num_threads(jobThreads);
+            while (true)
+            {
+                std::unique_lock<std::mutex> lock(queue.mutex);
+                queue.condition.wait(lock, [&]() { return !queue.jobs.empty() || !running; });
+                if (queue.jobs.empty())
+                    return;
+                const std::pair<int, std::string> job = queue.jobs.front();
+                queue.jobs.pop_front();
+                lock.unlock();
+                const std::string response = RunJob(job.second, cache);
+                const bool sent = response.empty() || send(job.first, response.data(), response.size(), MSG_NOSIGNAL) >= 0;
+                lock.lock();
+                Connection &client = queue.connections[job.first];
+                client.busy = false;
+                client.closed = client.closed || !sent;
+                queue.Next(job.first);
+            }
+        }));
+    }
+
+    // Accept connections and receive their jobs. Only this thread closes connections, so their descriptors are never reused under a running job
+    while (running)
+    {
+        std::vector<pollfd> descriptors(1);
+        descriptors[0].fd = server;
+        descriptors[0].events = POLLIN;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            for (std::map<int, Connection>::iterator it = queue.connections.begin(); it != queue.connections.end(); )
+            {
+                if (it->second.closed && !it->second.busy)
+                {
+                    close(it->first);
+                    it = queue.connections.erase(it);
+                    continue;
+                }
+                if (!it->second.closed)
+                {
+                    pollfd descriptor;
+                    descriptor.fd = it->first;
+                    descriptor.events = POLLIN;
+                    descriptors.push_back(descriptor);
+                }
+                ++it;
+            }
+        }
+        if (poll(descriptors.data(), descriptors.size(), 500) <= 0)
+            continue;
+        for (std::size_t i = 1; i < descriptors.size(); ++i)
+            if (descriptors[i].revents != 0)
+                ReceiveJobs(descriptors[i].fd, queue);
+        if (descriptors[0].revents & POLLIN)
+        {
+            const int connection = accept(server, NULL, NULL);
+            if (connection < 0)
+                continue;
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.connections[connection] = Connection();
+        }
+    }
+
+    // Drop the jobs not started yet, unblock the clients and the answers being sent, and wait for the running jobs
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.clear();
+        for (std::map<int, Connection>::iterator it = queue.connections.begin(); it != queue.connections.end(); ++it)
+            shutdown(it->first, SHUT_RDWR);
+    }
+    queue.condition.notify_all();
+    for (std::size_t i = 0; i < pool.size(); ++i)
+        pool[i].join();
+    for (std::map<int, Connection>::iterator it = queue.connections.begin(); it != queue.connections.end(); ++it)
+        close(it->first);
+    close(server);
+    unlink(socketPath.c_str());
+
+    return EXIT_SUCCESS;
+}
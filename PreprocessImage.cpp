@@ -0,0 +1,130 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Preprocess Image (zeros mask intersection, masking and truncation)       *
+***************************************************************************/
+
+#include <cstdlib>
+#include <ITKUtils.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <Dispatch.hpp>
+#include <MemoryBudget.hpp>
+#include <NIfTIUtils.hpp>
+#include <PreprocessImage.hpp>
+#include <itkImage.h>
+
+
+template<typename ImageType, typename MaskType>
+void PreprocessImage(int argc, char *argv[], const CommandLineOptions &options, Profiler &profiler)
+{
+    // Read image
+    profiler.Start("read");
+    typename ImageType::Pointer image = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
+    // Read mask
+    typename MaskType::Pointer mask = ITKUtils::ReadNIfTIImage<MaskType>(std::string(argv[2]));
+    // Maximum fraction of zero time points of the refined mask voxels
+    double zerosFraction = 0.05;
+    if (argc > 5)
+        zerosFraction = std::atof(argv[5]);
+    // Inside mask truncate value
+    typename ImageType::PixelType truncateValue = 0;
+    if (argc > 6)
+        truncateValue = (typename ImageType::PixelType) std::atof(argv[6]);
+    // Mask, truncate and refine the mask in a single pass
+    profiler.Start("compute");
+    profiler.SetVoxels(image->GetLargestPossibleRegion().GetNumberOfPixels());
+    typename MaskType::Pointer refined = PreprocessSeries<ImageType, MaskType>(image, mask, zerosFraction, truncateValue);
+    // Save image and refined mask
+    profiler.Start("write");
+    if (options.Has("int16"))
+        NIfTIUtils::WriteScaledNIfTIImage<ImageType>(image, std::string(argv[3]));
+    else
+        ITKUtils::WriteNIfTIImage<ImageType>(image, std::string(argv[3]));
+    ITKUtils::WriteNIfTIImage<MaskType>(refined, std::string(argv[4]));
+    profiler.Stop();
+}
+
+
+int main(int argc, char *argv[])
+{
+    CommandLineOptions options(argc, argv);
+    if (argc < 5 || argc > 7)
+    {
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: PreprocessImage inputImage maskImage outputImage outputMask [zerosFraction=0.05] [insideMaskTruncateValue=0] [--int16] [--max-memory=size] [--cache=directory] [--profile=json|text]" << std::endl;
+        std::cerr << "outputMask:\tmask voxels whose series has at most zerosFraction of zero time points (use with GlobalPCADenoising --refined)" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
+    typename itk::ImageIOBase::Pointer maskIO = ITKUtils::ReadImageInformation(std::string(argv[2]));
+
+    const unsigned int ImageDimension = imageIO->GetNumberOfDimensions();
+    const unsigned int MaskDimension = maskIO->GetNumberOfDimensions();
+
+    Profiler profiler("PreprocessImage", options.Get("profile"));
+    profiler.SetImageInformation(imageIO);
+    profiler.AddInput(std::string(argv[1]));
+    profiler.AddInput(std::string(argv[2]));
+    ResultCache cache(options.Get("cache"), "PreprocessImage");
+
+    if (MaskDimension != 3 || (ImageDimension != 3 && ImageDimension != 4))
+    {
+        std::cerr << "Unsupported image dimensions" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        cache.AddInput(std::string(argv[1]));
+        cache.AddInput(std::string(argv[2]));
+        cache.AddParameter(argc > 5 ? std::string(argv[5]) : "0.05");
+        cache.AddParameter(argc > 6 ? std::string(argv[6]) : "0");
+        cache.AddOptions(options);
+        cache.AddOutput(std::string(argv[3]));
+        cache.AddOutput(std::string(argv[4]));
+        if (cache.Fetch())
+        {
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        // Peak memory: the series (modified in place) and its int16 copy, the mask and the refined mask
+        const MemoryBudget budget(options.Get("max-memory"));
+        const unsigned long long peakBytes = MemoryBudget::ImageBytes(imageIO, sizeof(float)) * (options.Has("int16") ? 3 : 2) / 2 + 2 * MemoryBudget::VolumeBytes(imageIO, sizeof(unsigned char));
+        budget.Require(peakBytes, "PreprocessImage");
+        budget.Report("in memory", peakBytes);
+        profiler.SetMemoryPlan("in memory", peakBytes);
+        Dispatch::ByDimension<3, 4>(ImageDimension, [&](auto dimension)
+        {
+            PreprocessImage<itk::Image<float, decltype(dimension)::value>, itk::Image<unsigned char, 3>>(argc, argv, options, profiler);
+        });
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
+    }
+    catch (itk::ExceptionObject & err)
+    {
+        std::cerr << "ExceptionObject caught !" << std::endl;
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
+
+    return EXIT_SUCCESS;
+}
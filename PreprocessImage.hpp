@@ -0,0 +1,85 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Fused preprocessing kernel                                               *
+***************************************************************************/
+
+#ifndef PREPROCESSIMAGE_HPP
+#define PREPROCESSIMAGE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <itkImage.h>
+
+
+/*
+ * Front end of the perfusion pipelines fused in a single traversal of the
+ * series: masks the image, replaces the negative values inside the mask by
+ * truncateValue and counts the zero time points of every voxel after that,
+ * truncated values included. The returned refined mask keeps the mask voxels
+ * whose series has at most zerosFraction of zero time points. The image is
+ * modified in place. The mask spans the leading (spatial) dimensions of the
+ * image.
+ */
+template<typename ImageType, typename MaskType>
+typename MaskType::Pointer PreprocessSeries(ImageType *image, const MaskType *mask, double zerosFraction, typename ImageType::PixelType truncateValue)
+{
+    typedef typename ImageType::PixelType PixelType;
+    typedef typename MaskType::PixelType MaskPixelType;
+    const unsigned int SpatialDimension = MaskType::ImageDimension;
+    const typename ImageType::SizeType size = image->GetBufferedRegion().GetSize();
+    const typename MaskType::SizeType maskSize = mask->GetBufferedRegion().GetSize();
+    long long voxels = 1;
+    for (unsigned int i = 0; i < SpatialDimension; ++i)
+    {
+        if (size[i] != maskSize[i])
+            throw std::runtime_error("Image and mask sizes are different");
+        voxels *= size[i];
+    }
+    long long timePoints = 1;
+    for (unsigned int i = SpatialDimension; i < ImageType::ImageDimension; ++i)
+        timePoints *= size[i];
+    const long long maximumZeros = (long long) std::floor(zerosFraction * timePoints);
+    // Refined mask
+    typename MaskType::Pointer refined = MaskType::New();
+    refined->CopyInformation(mask);
+    refined->SetRegions(mask->GetBufferedRegion());
+    refined->Allocate();
+    PixelType *buffer = image->GetBufferPointer();
+    const MaskPixelType *maskBuffer = mask->GetBufferPointer();
+    MaskPixelType *refinedBuffer = refined->GetBufferPointer();
+    // Blocks of voxels whose zero counters stay in cache while all the time points are swept
+    const long long BlockSize = 4096;
+    const long long blocks = (voxels + BlockSize - 1) / BlockSize;
+    #pragma omp parallel for schedule(static)
+    for (long long block = 0; block < blocks; ++block)
+    {
+        const long long begin = block * BlockSize;
+        const long long end = std::min(voxels, begin + BlockSize);
+        unsigned int zeros[BlockSize];
+        std::fill(zeros, zeros + (end - begin), 0u);
+        for (long long t = 0; t < timePoints; ++t)
+        {
+            PixelType *frame = buffer + t * voxels;
+            for (long long v = begin; v < end; ++v)
+            {
+                if (!maskBuffer[v])
+                    frame[v] = 0;
+                else if (frame[v] < 0)
+                    frame[v] = truncateValue;
+                // Zeros of the masked and truncated series, as ZerosMaskIntersect counts them on the output of TruncateNegatives
+                zeros[v - begin] += (frame[v] == 0);
+            }
+        }
+        for (long long v = begin; v < end; ++v)
+            refinedBuffer[v] = (zeros[v - begin] <= maximumZeros) ? maskBuffer[v] : 0;
+    }
+    return refined;
+}
+
+#endif
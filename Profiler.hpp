@@ -0,0 +1,213 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Per-stage timing and memory profiler                                     *
+***************************************************************************/
+
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <itkImageIOBase.h>
+#include <itkMultiThreaderBase.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+/*
+ * Records the wall time of the read, compute and write stages of a tool along
+ * with its peak resident memory, number of voxels and number of threads. The
+ * report is only emitted when requested with --profile=json or --profile=text.
+ * ITK's NIfTI reader inflates compressed files inside the read call, so
+ * decompression time is accounted in the read stage and each input is flagged
+ * as compressed or not.
+ */
+class Profiler
+{
+public:
+    typedef std::chrono::steady_clock ClockType;
+
+    Profiler(const std::string &tool, const std::string &format = "") : m_Tool(tool), m_Format(format), m_Voxels(0), m_Components(1), m_EstimatedMemory(0), m_Running(false)
+    {
+        m_Begin = ClockType::now();
+    }
+
+    bool Enabled() const
+    {
+        return !m_Format.empty();
+    }
+
+    // Start timing a stage. Time of repeated stages is accumulated
+    void Start(const std::string &stage)
+    {
+        if (m_Running)
+            Stop();
+        m_Stage = stage;
+        m_StageBegin = ClockType::now();
+        m_Running = true;
+    }
+
+    void Stop()
+    {
+        if (!m_Running)
+            return;
+        const double seconds = std::chrono::duration<double>(ClockType::now() - m_StageBegin).count();
+        m_Running = false;
+        for (std::size_t i = 0; i < m_Stages.size(); ++i)
+        {
+            if (m_Stages[i].first == m_Stage)
+            {
+                m_Stages[i].second += seconds;
+                return;
+            }
+        }
+        m_Stages.push_back(std::make_pair(m_Stage, seconds));
+    }
+
+    void AddInput(const std::string &fileName)
+    {
+        m_Inputs.push_back(fileName);
+    }
+
+    void SetImageInformation(const itk::ImageIOBase *imageIO)
+    {
+        m_Voxels = imageIO->GetImageSizeInPixels();
+        m_Components = imageIO->GetNumberOfComponents();
+    }
+
+    void SetVoxels(unsigned long long voxels)
+    {
+        m_Voxels = voxels;
+    }
+
+    // Execution plan chosen under --max-memory and its estimated peak memory
+    void SetMemoryPlan(const std::string &plan, unsigned long long estimatedBytes)
+    {
+        m_MemoryPlan = plan;
+        m_EstimatedMemory = estimatedBytes;
+    }
+
+    static unsigned long long PeakResidentMemory()
+    {
+#ifndef _WIN32
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+            return (unsigned long long) usage.ru_maxrss * 1024;
+#endif
+        return 0;
+    }
+
+    static unsigned int NumberOfThreads()
+    {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    void Report(std::ostream &os = std::cout)
+    {
+        if (!Enabled())
+            return;
+        Stop();
+        const double total = std::chrono::duration<double>(ClockType::now() - m_Begin).count();
+        if (m_Format == "json")
+            ReportJSON(os, total);
+        else
+            ReportText(os, total);
+    }
+
+private:
+    static bool IsCompressed(const std::string &fileName)
+    {
+        return fileName.size() > 3 && fileName.compare(fileName.size() - 3, 3, ".gz") == 0;
+    }
+
+    static unsigned long long FileSize(const std::string &fileName)
+    {
+        std::ifstream file(fileName.c_str(), std::ios::binary | std::ios::ate);
+        return file ? (unsigned long long) file.tellg() : 0;
+    }
+
+    static std::string Escape(const std::string &value)
+    {
+        std::ostringstream s;
+        for (std::size_t i = 0; i < value.size(); ++i)
+        {
+            const char c = value[i];
+            if (c == '"' || c == '\\')
+                s << '\\' << c;
+            else if ((unsigned char) c < 0x20)
+                s << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) c << std::dec;
+            else
+                s << c;
+        }
+        return s.str();
+    }
+
+    void ReportJSON(std::ostream &os, double total) const
+    {
+        os << "{\"tool\": \"" << Escape(m_Tool) << "\", ";
+        os << "\"wall_seconds\": " << total << ", ";
+        os << "\"stages\": {";
+        for (std::size_t i = 0; i < m_Stages.size(); ++i)
+            os << (i ? ", " : "") << "\"" << Escape(m_Stages[i].first) << "\": " << m_Stages[i].second;
+        os << "}, ";
+        os << "\"peak_rss_bytes\": " << PeakResidentMemory() << ", ";
+        if (!m_MemoryPlan.empty())
+            os << "\"memory_plan\": {\"plan\": \"" << Escape(m_MemoryPlan) << "\", \"estimated_bytes\": " << m_EstimatedMemory << "}, ";
+        os << "\"voxels\": " << m_Voxels << ", ";
+        os << "\"components\": " << m_Components << ", ";
+        os << "\"threads\": {\"openmp\": " << NumberOfThreads() << ", \"itk\": " << itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() << "}, ";
+        os << "\"inputs\": [";
+        for (std::size_t i = 0; i < m_Inputs.size(); ++i)
+            os << (i ? ", " : "") << "{\"path\": \"" << Escape(m_Inputs[i]) << "\", \"bytes\": " << FileSize(m_Inputs[i]) << ", \"compressed\": " << (IsCompressed(m_Inputs[i]) ? "true" : "false") << "}";
+        os << "]}" << std::endl;
+    }
+
+    void ReportText(std::ostream &os, double total) const
+    {
+        os << "PROFILE" << std::endl;
+        os << "-------" << std::endl;
+        os << "Tool: " << m_Tool << std::endl;
+        os << "Stages" << std::endl;
+        for (std::size_t i = 0; i < m_Stages.size(); ++i)
+            os << "\t" << m_Stages[i].first << ": " << m_Stages[i].second << " s" << std::endl;
+        os << "\ttotal: " << total << " s" << std::endl;
+        os << "Peak RSS: " << PeakResidentMemory() / (1024.0 * 1024.0) << " MiB" << std::endl;
+        if (!m_MemoryPlan.empty())
+            os << "Memory plan: " << m_MemoryPlan << " (estimated " << m_EstimatedMemory / (1024.0 * 1024.0) << " MiB)" << std::endl;
+        os << "Voxels: " << m_Voxels << " (" << m_Components << " components)" << std::endl;
+        os << "Threads: " << NumberOfThreads() << " OpenMP, " << itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() << " ITK" << std::endl;
+    }
+
+    std::string m_Tool;
+    std::string m_Format;
+    std::string m_Stage;
+    std::vector<std::pair<std::string, double>> m_Stages;
+    std::vector<std::string> m_Inputs;
+    unsigned long long m_Voxels;
+    unsigned int m_Components;
+    std::string m_MemoryPlan;
+    unsigned long long m_EstimatedMemory;
+    bool m_Running;
+    ClockType::time_point m_Begin;
+    ClockType::time_point m_StageBegin;
+};
+
+#endif
@@ -0,0 +1,110 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Least recently used cache of file backed resources                      *
+***************************************************************************/
+
+#ifndef RESOURCECACHE_HPP
+#define RESOURCECACHE_HPP
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <sys/stat.h>
+
+/*
+ * Thread-safe LRU cache of resources loaded from files (reference images,
+ * masks, PCA bases, ...). Entries are keyed by resource type, path and
+ * modification time, so a file rewritten on disk is loaded again. Cached
+ * resources are shared between jobs and must be treated as read-only.
+ */
+class ResourceCache
+{
+public:
+    ResourceCache(std::size_t capacity) : m_Capacity(capacity), m_Hits(0), m_Misses(0)
+    {
+    }
+
+    // Get the resource of type T stored in fileName, loading it with loader(fileName) on a miss
+    template<typename T, typename Loader>
+    std::shared_ptr<T> Get(const std::string &fileName, Loader loader)
+    {
+        return Get<T>(fileName, std::string(), loader);
+    }
+
+    // Get a variant of the resource stored in fileName (e.g. a mask resampled to a grid)
+    template<typename T, typename Loader>
+    std::shared_ptr<T> Get(const std::string &fileName, const std::string &variant, Loader loader)
+    {
+        const std::string key = Key(typeid(T).name(), fileName) + '|' + variant;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            typename std::unordered_map<std::string, EntryList::iterator>::iterator it = m_Index.find(key);
+            if (it != m_Index.end())
+            {
+                m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+                ++m_Hits;
+                return std::static_pointer_cast<T>(it->second->second);
+            }
+            ++m_Misses;
+        }
+        // Load outside the lock so other jobs are not blocked by the decoding
+        std::shared_ptr<T> resource = std::make_shared<T>(loader(fileName));
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (m_Index.find(key) == m_Index.end())
+        {
+            m_Entries.push_front(std::make_pair(key, std::static_pointer_cast<void>(resource)));
+            m_Index[key] = m_Entries.begin();
+            while (m_Entries.size() > m_Capacity)
+            {
+                m_Index.erase(m_Entries.back().first);
+                m_Entries.pop_back();
+            }
+        }
+        return resource;
+    }
+
+    std::size_t Hits() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_Hits;
+    }
+
+    std::size_t Misses() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_Misses;
+    }
+
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<void>>> EntryList;
+
+    static std::string Key(const std::string &type, const std::string &fileName)
+    {
+        struct stat status;
+        if (stat(fileName.c_str(), &status) != 0)
+            throw std::runtime_error("Unable to access file: " + fileName);
+        std::ostringstream s;
+        s << type << '|' << fileName << '|' << status.st_mtim.tv_sec << '.' << status.st_mtim.tv_nsec << '|' << status.st_size;
+        return s.str();
+    }
+
+    std::size_t m_Capacity;
+    std::size_t m_Hits;
+    std::size_t m_Misses;
+    EntryList m_Entries;
+    std::unordered_map<std::string, EntryList::iterator> m_Index;
+    mutable std::mutex m_Mutex;
+};
+
+#endif
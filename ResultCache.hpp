@@ -0,0 +1,255 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Content addressed result cache                                           *
+***************************************************************************/
+
+#ifndef RESULTCACHE_HPP
+#define RESULTCACHE_HPP
+
+#include <XXHash.hpp>
+#include <CommandLineOptions.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+// Build stamp generated by CMake (ONTsVersion.cmake), so tools built from other sources never share cache entries
+#ifdef ONTS_VERSION_LIBRARY
+const char *ONTsBuildVersion();
+#else
+inline const char *ONTsBuildVersion()
+{
+    return "unknown";
+}
+#endif
+
+/*
+ * Content addressed cache of tool results (--cache=directory). The key hashes
+ * the tool name, its parameters and the bytes of every input file (header and
+ * voxel data) with a streaming XXH64, so checking the cache costs one
+ * sequential read of the inputs. Entries and restored outputs are always
+ * private copies (reflinks on file systems that support FICLONE, so they share
+ * blocks copy-on-write), never hard links: a later run that writes an output
+ * in place, with or without --cache, cannot alter a cache entry.
+ */
+class ResultCache
+{
+public:
+    ResultCache(const std::string &directory, const std::string &tool) : m_Directory(directory)
+    {
+        m_Descriptor << "onts-result-cache-2|" << ONTsBuildVersion() << "|" << tool;
+    }
+
+    bool Enabled() const
+    {
+        return !m_Directory.empty();
+    }
+
+    // Hash an input file, or every file of an input directory in name order
+    void AddInput(const std::string &path)
+    {
+        if (!Enabled())
+            return;
+        struct stat status;
+        if (stat(path.c_str(), &status) != 0)
+            throw std::runtime_error("Unable to access input: " + path);
+        if (S_ISDIR(status.st_mode))
+        {
+            std::vector<std::string> names;
+            DIR *directory = opendir(path.c_str());
+            if (directory == NULL)
+                throw std::runtime_error("Unable to read directory: " + path);
+            for (dirent *entry = readdir(directory); entry != NULL; entry = readdir(directory))
+            {
+                const std::string name(entry->d_name);
+                if (name != "." && name != "..")
+                    names.push_back(name);
+            }
+            closedir(directory);
+            std::sort(names.begin(), names.end());
+            m_Descriptor << "|dir:" << names.size();
+            for (std::size_t i = 0; i < names.size(); ++i)
+            {
+                m_Descriptor << "|" << names[i];
+                AddInput(path + "/" + names[i]);
+            }
+            return;
+        }
+        m_Descriptor << "|in:" << std::hex << HashFile(path) << std::dec << ":" << (unsigned long long) status.st_size;
+    }
+
+    void AddParameter(const std::string &value)
+    {
+        m_Descriptor << "|p:" << value.size() << ":" << value;
+    }
+
+    // Positional parameters argv[first] .. argv[argc - 1]
+    void AddParameters(int first, int argc, char *argv[])
+    {
+        for (int i = first; i < argc; ++i)
+            AddParameter(std::string(argv[i]));
+    }
+
+    // Options that change the result (everything but --cache, --profile and --max-memory; a tool whose memory plan changes the result adds the plan itself)
+    void AddOptions(const CommandLineOptions &options)
+    {
+        for (std::map<std::string, std::string>::const_iterator it = options.All().begin(); it != options.All().end(); ++it)
+            if (it->first != "cache" && it->first != "profile" && it->first != "max-memory")
+                AddParameter(it->first + "=" + it->second);
+    }
+
+    void AddOutput(const std::string &path)
+    {
+        m_Outputs.push_back(path);
+    }
+
+    // Restore the outputs from the cache. Returns false on a miss
+    bool Fetch()
+    {
+        bool hit = Enabled();
+        for (std::size_t i = 0; i < m_Outputs.size() && hit; ++i)
+            hit = access(EntryPath(i).c_str(), R_OK) == 0;
+        if (!hit)
+            return false;
+        for (std::size_t i = 0; i < m_Outputs.size(); ++i)
+            Publish(EntryPath(i), m_Outputs[i]);
+        return true;
+    }
+
+    // Add the outputs written by the tool to the cache
+    void Store()
+    {
+        if (!Enabled())
+            return;
+        mkdir(m_Directory.c_str(), 0775);
+        for (std::size_t i = 0; i < m_Outputs.size(); ++i)
+            Publish(m_Outputs[i], EntryPath(i));
+    }
+
+    std::string Key() const
+    {
+        const std::string descriptor = m_Descriptor.str();
+        XXHash64 low(0), high(0x6f6e7473ULL);
+        low.Update(descriptor);
+        high.Update(descriptor);
+        std::ostringstream s;
+        s << std::hex << std::setfill('0') << std::setw(16) << high.Digest() << std::setw(16) << low.Digest();
+        return s.str();
+    }
+
+private:
+    static std::uint64_t HashFile(const std::string &path)
+    {
+        const int file = open(path.c_str(), O_RDONLY);
+        if (file < 0)
+            throw std::runtime_error("Unable to read input: " + path);
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        XXHash64 hash;
+        std::vector<char> buffer(1 << 20);
+        ssize_t bytes;
+        while ((bytes = read(file, buffer.data(), buffer.size())) > 0)
+            hash.Update(buffer.data(), bytes);
+        close(file);
+        if (bytes < 0)
+            throw std::runtime_error("Unable to read input: " + path);
+        return hash.Digest();
+    }
+
+    static std::string Extension(const std::string &path)
+    {
+        const std::size_t slash = path.find_last_of('/');
+        const std::size_t dot = path.find('.', slash == std::string::npos ? 0 : slash + 1);
+        return dot == std::string::npos ? "" : path.substr(dot);
+    }
+
+    std::string EntryPath(std::size_t output) const
+    {
+        std::ostringstream s;
+        s << m_Directory << "/" << Key() << "." << output << Extension(m_Outputs[output]);
+        return s.str();
+    }
+
+    // Copy source to destination, sharing the blocks copy-on-write where the file system allows it
+    static void Copy(const std::string &source, const std::string &destination)
+    {
+        const int input = open(source.c_str(), O_RDONLY);
+        if (input < 0)
+            throw std::runtime_error("Unable to copy " + source + " to " + destination);
+        const int output = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0664);
+        if (output < 0)
+        {
+            close(input);
+            throw std::runtime_error("Unable to copy " + source + " to " + destination);
+        }
+        bool copied = false;
+#ifdef FICLONE
+        copied = ioctl(output, FICLONE, input) == 0;
+#endif
+        if (!copied)
+        {
+            std::vector<char> buffer(1 << 20);
+            ssize_t bytes;
+            copied = true;
+            while (copied && (bytes = read(input, buffer.data(), buffer.size())) != 0)
+            {
+                copied = bytes > 0;
+                for (ssize_t offset = 0; copied && offset < bytes;)
+                {
+                    const ssize_t written = write(output, buffer.data() + offset, bytes - offset);
+                    copied = written > 0;
+                    offset += written;
+                }
+            }
+        }
+        close(input);
+        if (close(output) != 0 || !copied)
+            throw std::runtime_error("Unable to copy " + source + " to " + destination);
+    }
+
+    // Copy to a temporary file and rename it, so concurrent jobs never see a partial file
+    static void Publish(const std::string &source, const std::string &destination)
+    {
+        std::ostringstream temporary;
+        temporary << destination << ".tmp." << getpid();
+        try
+        {
+            Copy(source, temporary.str());
+        }
+        catch (...)
+        {
+            unlink(temporary.str().c_str());
+            throw;
+        }
+        if (std::rename(temporary.str().c_str(), destination.c_str()) != 0)
+        {
+            unlink(temporary.str().c_str());
+            throw std::runtime_error("Unable to copy " + source + " to " + destination);
+        }
+    }
+
+    std::string m_Directory;
+    std::ostringstream m_Descriptor;
+    std::vector<std::string> m_Outputs;
+};
+
+#endif
@@ -0,0 +1,128 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Smooth Image (recursive Gaussian or box, optionally mask normalized)     *
+***************************************************************************/
+
+#include <cstdlib>
+#include <ITKUtils.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <Dispatch.hpp>
+#include <MemoryBudget.hpp>
+#include <NIfTIUtils.hpp>
+#include <SmoothImage.hpp>
+#include <WorkPartitioner.hpp>
+#include <itkImage.h>
+
+
+template<typename ImageType, typename MaskType>
+void SmoothImage(int argc, char *argv[], const CommandLineOptions &options, Profiler &profiler)
+{
+    // Read image
+    profiler.Start("read");
+    typename ImageType::Pointer image = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
+    // Kernel width (Gaussian sigma or box radius, in physical units)
+    const double width = std::atof(argv[3]);
+    // Kernel
+    const Smoothing::Kernel kernel = Smoothing::KernelFromString((argc > 4) ? std::string(argv[4]) : "gaussian");
+    // Read mask
+    typename MaskType::Pointer mask;
+    if (argc > 5)
+        mask = ITKUtils::ReadNIfTIImage<MaskType>(std::string(argv[5]));
+    // Smooth every volume
+    profiler.Start("compute");
+    Smoothing::SmoothSeries<ImageType, MaskType>(image, mask.GetPointer(), kernel, width);
+    // Save image
+    profiler.Start("write");
+    if (options.Has("int16"))
+        NIfTIUtils::WriteScaledNIfTIImage<ImageType>(image, std::string(argv[2]));
+    else
+        ITKUtils::WriteNIfTIImage<ImageType>(image, std::string(argv[2]));
+    profiler.Stop();
+}
+
+
+int main(int argc, char *argv[])
+{
+    CommandLineOptions options(argc, argv);
+    if (argc < 4 || argc > 6)
+    {
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: SmoothImage inputImage outputImage width [kernel=gaussian|box] [maskImage] [--int16] [--max-memory=size] [--pin] [--cache=directory] [--profile=json|text]" << std::endl;
+        std::cerr << "width:\t\tGaussian sigma or box radius in physical units (mm), 4D images are smoothed per time point" << std::endl;
+        std::cerr << "maskImage:\tmask normalized smoothing, voxels outside the mask neither contribute nor are kept" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
+    const unsigned int ImageDimension = imageIO->GetNumberOfDimensions();
+
+    Profiler profiler("SmoothImage", options.Get("profile"));
+    profiler.SetImageInformation(imageIO);
+    profiler.AddInput(std::string(argv[1]));
+    if (argc > 5)
+        profiler.AddInput(std::string(argv[5]));
+    ResultCache cache(options.Get("cache"), "SmoothImage");
+    if (options.Has("pin"))
+        WorkPartitioner::PinThreads();
+
+    if (ImageDimension != 3 && ImageDimension != 4)
+    {
+        std::cerr << "Unsupported image dimensions" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        cache.AddInput(std::string(argv[1]));
+        if (argc > 5)
+            cache.AddInput(std::string(argv[5]));
+        cache.AddParameter(std::string(argv[3]));
+        cache.AddParameter(argc > 4 ? std::string(argv[4]) : "gaussian");
+        cache.AddOptions(options);
+        cache.AddOutput(std::string(argv[2]));
+        if (cache.Fetch())
+        {
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        // Peak memory: the image (smoothed in place) and its int16 copy, the mask and its smoothed weights
+        const MemoryBudget budget(options.Get("max-memory"));
+        const unsigned long long peakBytes = MemoryBudget::ImageBytes(imageIO, sizeof(float)) * (options.Has("int16") ? 3 : 2) / 2 + 2 * MemoryBudget::VolumeBytes(imageIO, sizeof(float)) + MemoryBudget::VolumeBytes(imageIO, sizeof(unsigned char));
+        budget.Require(peakBytes, "SmoothImage");
+        budget.Report("in memory", peakBytes);
+        profiler.SetMemoryPlan("in memory", peakBytes);
+        Dispatch::ByDimension<3, 4>(ImageDimension, [&](auto dimension)
+        {
+            SmoothImage<itk::Image<float, decltype(dimension)::value>, itk::Image<unsigned char, 3>>(argc, argv, options, profiler);
+        });
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
+    }
+    catch (itk::ExceptionObject & err)
+    {
+        std::cerr << "ExceptionObject caught !" << std::endl;
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
+
+    return EXIT_SUCCESS;
+}
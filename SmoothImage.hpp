@@ -0,0 +1,244 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Separable spatial smoothing                                              *
+***************************************************************************/
+
+#ifndef SMOOTHIMAGE_HPP
+#define SMOOTHIMAGE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <itkImage.h>
+
+/*
+ * Separable 3D smoothing of every volume of a series, in place. The Gaussian
+ * is the recursive (IIR) filter of Young and van Vliet, and the box filter a
+ * running sum, so the cost per voxel does not depend on the kernel width.
+ * Every axis is processed as rows of contiguous values: along y and z the
+ * recursion advances row by row over chunks of contiguous x values, which
+ * vectorizes, and the chunks are spread among the OpenMP threads.
+ */
+namespace Smoothing
+{
+    enum Kernel {Gaussian, Box};
+
+    // Contiguous values of a row processed together by a thread
+    const long long ChunkLength = 1024;
+
+    inline Kernel KernelFromString(const std::string &kernel)
+    {
+        if (kernel == "gaussian")
+            return Gaussian;
+        if (kernel == "box")
+            return Box;
+        throw std::runtime_error("Unknown smoothing kernel: " + kernel);
+    }
+
+    // Coefficients of the third order recursive Gaussian of Young and van Vliet for the scale q, normalized by b0
+    inline void GaussianCoefficients(double q, double &B, double &b1, double &b2, double &b3)
+    {
+        const double q2 = q * q;
+        const double q3 = q2 * q;
+        const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+        b1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+        b2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+        b3 = 0.422205 * q3 / b0;
+        B = 1.0 - (b1 + b2 + b3);
+    }
+
+    /*
+     * Scale q whose causal plus anti-causal impulse response has standard
+     * deviation sigma. The variance of the all-pole filter is known in closed
+     * form, so q is found by bisection instead of the published linear fit,
+     * which gives kernels about 10% wider than requested.
+     */
+    inline double GaussianScale(double sigma)
+    {
+        double low = 0.01;
+        double high = 2.0 * sigma + 1.0;
+        for (unsigned int i = 0; i < 60; ++i)
+        {
+            const double q = 0.5 * (low + high);
+            double B, b1, b2, b3;
+            GaussianCoefficients(q, B, b1, b2, b3);
+            const double mean = (b1 + 2 * b2 + 3 * b3) / B;
+            const double variance = 2.0 * ((2 * b2 + 6 * b3) / B + mean * mean + mean);
+            if (variance < sigma * sigma)
+                low = q;
+            else
+                high = q;
+        }
+        return 0.5 * (low + high);
+    }
+
+    /*
+     * Causal and anti-causal passes of the recursive Gaussian along an axis of
+     * length rows of inner contiguous values, repeated outer times. The state
+     * before the first (after the last) row is that row, the steady state of
+     * a constant signal.
+     */
+    inline void GaussianAxis(float *data, long long outer, long long length, long long inner, double sigma)
+    {
+        double coefficients[4];
+        GaussianCoefficients(GaussianScale(sigma), coefficients[0], coefficients[1], coefficients[2], coefficients[3]);
+        const float B = (float) coefficients[0];
+        const float b1 = (float) coefficients[1];
+        const float b2 = (float) coefficients[2];
+        const float b3 = (float) coefficients[3];
+        const long long chunks = (inner + ChunkLength - 1) / ChunkLength;
+        #pragma omp parallel for schedule(static)
+        for (long long task = 0; task < outer * chunks; ++task)
+        {
+            float *slab = data + (task / chunks) * length * inner + (task % chunks) * ChunkLength;
+            const long long width = std::min(ChunkLength, inner - (task % chunks) * ChunkLength);
+            for (long long n = 1; n < length; ++n)
+            {
+                float *row = slab + n * inner;
+                const float *r1 = slab + (n - 1) * inner;
+                const float *r2 = slab + std::max(n - 2, 0LL) * inner;
+                const float *r3 = slab + std::max(n - 3, 0LL) * inner;
+                #pragma omp simd
+                for (long long i = 0; i < width; ++i)
+                    row[i] = B * row[i] + b1 * r1[i] + b2 * r2[i] + b3 * r3[i];
+            }
+            for (long long n = length - 2; n >= 0; --n)
+            {
+                float *row = slab + n * inner;
+                const float *r1 = slab + (n + 1) * inner;
+                const float *r2 = slab + std::min(n + 2, length - 1) * inner;
+                const float *r3 = slab + std::min(n + 3, length - 1) * inner;
+                #pragma omp simd
+                for (long long i = 0; i < width; ++i)
+                    row[i] = B * row[i] + b1 * r1[i] + b2 * r2[i] + b3 * r3[i];
+            }
+        }
+    }
+
+    // Running mean over 2 * radius + 1 rows along an axis, replicating the edge rows
+    inline void BoxAxis(float *data, long long outer, long long length, long long inner, long long radius)
+    {
+        const long long chunks = (inner + ChunkLength - 1) / ChunkLength;
+        const double scale = 1.0 / (2 * radius + 1);
+        #pragma omp parallel
+        {
+            std::vector<float> copy(length * std::min(ChunkLength, inner));
+            std::vector<double> sum(std::min(ChunkLength, inner));
+            #pragma omp for schedule(static)
+            for (long long task = 0; task < outer * chunks; ++task)
+            {
+                float *slab = data + (task / chunks) * length * inner + (task % chunks) * ChunkLength;
+                const long long width = std::min(ChunkLength, inner - (task % chunks) * ChunkLength);
+                for (long long n = 0; n < length; ++n)
+                    std::copy(slab + n * inner, slab + n * inner + width, copy.begin() + n * width);
+                std::fill(sum.begin(), sum.begin() + width, 0.0);
+                for (long long k = -radius; k <= radius; ++k)
+                {
+                    const float *row = copy.data() + std::min(std::max(k, 0LL), length - 1) * width;
+                    for (long long i = 0; i < width; ++i)
+                        sum[i] += row[i];
+                }
+                for (long long n = 0; n < length; ++n)
+                {
+                    float *row = slab + n * inner;
+                    const float *entering = copy.data() + std::min(n + radius + 1, length - 1) * width;
+                    const float *leaving = copy.data() + std::max(n - radius, 0LL) * width;
+                    #pragma omp simd
+                    for (long long i = 0; i < width; ++i)
+                    {
+                        row[i] = (float) (sum[i] * scale);
+                        sum[i] += entering[i] - leaving[i];
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * Smooths a volume along its three axes. width is the Gaussian sigma or
+     * the box radius in physical units. Axes where the kernel is narrower
+     * than half a voxel (Gaussian) or than a voxel (box) are left unchanged.
+     */
+    inline void SmoothVolume(float *volume, const long long size[3], const double spacing[3], Kernel kernel, double width)
+    {
+        long long inner = 1;
+        for (unsigned int axis = 0; axis < 3; ++axis)
+        {
+            long long outer = 1;
+            for (unsigned int i = axis + 1; i < 3; ++i)
+                outer *= size[i];
+            const double voxels = width / spacing[axis];
+            if (kernel == Gaussian && voxels >= 0.5 && size[axis] > 1)
+                GaussianAxis(volume, outer, size[axis], inner, voxels);
+            else if (kernel == Box && std::round(voxels) >= 1 && size[axis] > 1)
+                BoxAxis(volume, outer, size[axis], inner, (long long) std::round(voxels));
+            inner *= size[axis];
+        }
+    }
+
+    /*
+     * Smooths every volume of an image in place. With a mask the smoothing is
+     * normalized: the masked image and the mask are smoothed, their ratio
+     * gives the weighted mean of the voxels inside the mask only, and the
+     * voxels outside the mask are set to zero. The mask spans the spatial
+     * dimensions of the image.
+     */
+    template<typename ImageType, typename MaskType>
+    void SmoothSeries(ImageType *image, const MaskType *mask, Kernel kernel, double width)
+    {
+        const typename ImageType::SizeType imageSize = image->GetBufferedRegion().GetSize();
+        long long size[3] = {1, 1, 1};
+        double spacing[3] = {1, 1, 1};
+        for (unsigned int i = 0; i < std::min(3u, ImageType::ImageDimension); ++i)
+        {
+            size[i] = (long long) imageSize[i];
+            spacing[i] = image->GetSpacing()[i];
+        }
+        const long long voxels = size[0] * size[1] * size[2];
+        const long long volumes = (long long) image->GetBufferedRegion().GetNumberOfPixels() / voxels;
+        float *buffer = image->GetBufferPointer();
+        std::vector<float> weights;
+        const typename MaskType::PixelType *maskBuffer = NULL;
+        if (mask != NULL)
+        {
+            const typename MaskType::SizeType maskSize = mask->GetBufferedRegion().GetSize();
+            for (unsigned int i = 0; i < MaskType::ImageDimension; ++i)
+                if (maskSize[i] != imageSize[i])
+                    throw std::runtime_error("Image and mask sizes are different");
+            // Smoothed mask, shared by all the volumes
+            maskBuffer = mask->GetBufferPointer();
+            weights.resize(voxels);
+            #pragma omp parallel for
+            for (long long i = 0; i < voxels; ++i)
+                weights[i] = maskBuffer[i] ? 1.0f : 0.0f;
+            SmoothVolume(weights.data(), size, spacing, kernel, width);
+        }
+        for (long long t = 0; t < volumes; ++t)
+        {
+            float *volume = buffer + t * voxels;
+            if (maskBuffer != NULL)
+            {
+                #pragma omp parallel for
+                for (long long i = 0; i < voxels; ++i)
+                    if (!maskBuffer[i])
+                        volume[i] = 0;
+            }
+            SmoothVolume(volume, size, spacing, kernel, width);
+            if (maskBuffer != NULL)
+            {
+                #pragma omp parallel for
+                for (long long i = 0; i < voxels; ++i)
+                    volume[i] = (maskBuffer[i] && weights[i] > 0) ? volume[i] / weights[i] : 0;
+            }
+        }
+    }
+}
+
+#endif
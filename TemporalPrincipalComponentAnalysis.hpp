@@ -0,0 +1,347 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Incremental temporal Principal Component Analysis                        *
+***************************************************************************/
+
+#ifndef TEMPORALPRINCIPALCOMPONENTANALYSIS_HPP
+#define TEMPORALPRINCIPALCOMPONENTANALYSIS_HPP
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+/*
+ * PCA over the temporal dimension of a dataset whose rows are voxels and whose
+ * columns are time points. The sufficient statistics (number of samples, sum
+ * and scatter matrix) are accumulated in double precision, so a basis can be
+ * fitted across many series with the same timing, saved, and later applied to
+ * a new series as a single projection GEMM.
+ *
+ * The precision of the scatter matrix GEMM is selectable: Single accumulates
+ * float GEMMs over blocks of rows in float, Mixed (default) accumulates them in
+ * double, and Double casts each block to double. The scatter is accumulated
+ * around a shift (the mean curve of the first block) rather than around zero:
+ * removing n * mean * mean' from the raw scatter of intensities would cancel
+ * most of the digits of the small (noise) eigenvalues.
+ */
+class TemporalPrincipalComponentAnalysis
+{
+public:
+    enum Precision { Single, Mixed, Double };
+
+    TemporalPrincipalComponentAnalysis(Precision precision = Mixed) : m_Precision(precision), m_Samples(0), m_Components(0), m_NoiseSigma(0)
+    {
+    }
+
+    static Precision precisionFromString(const std::string &name)
+    {
+        if (name == "single")
+            return Single;
+        if (name == "mixed")
+            return Mixed;
+        if (name == "double")
+            return Double;
+        throw std::runtime_error("Unknown precision: " + name + " (single, mixed or double)");
+    }
+
+    // Accumulate the statistics of a dataset (voxels x time points)
+    void update(const Eigen::MatrixXf &dataset)
+    {
+        // Accumulate in blocks of rows to bound the float rounding error of the GEMM
+        const Eigen::Index blockSize = 8192;
+        if (m_Samples == 0)
+        {
+            m_Sum = Eigen::VectorXd::Zero(dataset.cols());
+            m_Scatter = Eigen::MatrixXd::Zero(dataset.cols(), dataset.cols());
+            m_Shift = columnMean(dataset.topRows(std::min(blockSize, dataset.rows()))).transpose().cast<double>();
+        }
+        else if (dataset.cols() != m_Sum.size())
+        {
+            std::stringstream s;
+            s << "Dataset has " << dataset.cols() << " time points but the basis has " << m_Sum.size() << std::endl;
+            throw std::runtime_error(s.str());
+        }
+        const Eigen::RowVectorXf shift = m_Shift.transpose().cast<float>();
+        Eigen::MatrixXf scatter;
+        if (m_Precision == Single)
+            scatter = Eigen::MatrixXf::Zero(dataset.cols(), dataset.cols());
+        for (Eigen::Index i = 0; i < dataset.rows(); i += blockSize)
+        {
+            const Eigen::Index rows = std::min(blockSize, dataset.rows() - i);
+            if (m_Precision == Double)
+            {
+                const Eigen::MatrixXd block = dataset.middleRows(i, rows).cast<double>().rowwise() - m_Shift.transpose();
+                m_Scatter.noalias() += block.transpose() * block;
+                m_Sum.noalias() += block.colwise().sum().transpose() + rows * m_Shift;
+            }
+            else
+            {
+                const Eigen::MatrixXf block = dataset.middleRows(i, rows).rowwise() - shift;
+                if (m_Precision == Single)
+                    scatter.noalias() += block.transpose() * block;
+                else
+                    m_Scatter.noalias() += (block.transpose() * block).cast<double>();
+                m_Sum.noalias() += block.colwise().sum().transpose().cast<double>() + rows * m_Shift;
+            }
+        }
+        if (m_Precision == Single)
+            m_Scatter.noalias() += scatter.cast<double>();
+        m_Samples += dataset.rows();
+        m_Eigenvalues.resize(0);
+    }
+
+    // Eigendecomposition of the accumulated covariance (eigenvalues in descending order)
+    void fit()
+    {
+        if (m_Samples < 2)
+            throw std::runtime_error("Not enough samples to fit the temporal basis");
+        // Offset of the mean from the shift of the scatter
+        const Eigen::VectorXd offset = m_Sum / m_Samples - m_Shift;
+        const Eigen::MatrixXd covariance = (m_Scatter - m_Samples * offset * offset.transpose()) / (m_Samples - 1);
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(covariance);
+        m_Eigenvalues = solver.eigenvalues().reverse().cwiseMax(0);
+        m_Eigenvectors = solver.eigenvectors().rowwise().reverse();
+    }
+
+    // Denoise a dataset keeping the components that explain the given fraction of variance
+    Eigen::MatrixXf filteringVarianceExplained(const Eigen::MatrixXf &dataset, double variance, unsigned int minComponents, unsigned int maxComponents)
+    {
+        if (m_Samples == 0)
+        {
+            update(dataset);
+            fit();
+        }
+        else if (m_Eigenvalues.size() == 0)
+            fit();
+        if (dataset.cols() != m_Eigenvalues.size())
+        {
+            std::stringstream s;
+            s << "Dataset has " << dataset.cols() << " time points but the basis has " << m_Eigenvalues.size() << std::endl;
+            throw std::runtime_error(s.str());
+        }
+        m_Components = componentsVarianceExplained(variance, minComponents, maxComponents);
+        return project(dataset, m_Components, columnMean(dataset));
+    }
+
+    // Denoise a dataset keeping the components above the Marchenko-Pastur noise floor
+    Eigen::MatrixXf filteringMarchenkoPastur(const Eigen::MatrixXf &dataset, unsigned int minComponents, unsigned int maxComponents)
+    {
+        if (m_Samples == 0)
+        {
+            update(dataset);
+            fit();
+        }
+        else if (m_Eigenvalues.size() == 0)
+            fit();
+        if (dataset.cols() != m_Eigenvalues.size())
+        {
+            std::stringstream s;
+            s << "Dataset has " << dataset.cols() << " time points but the basis has " << m_Eigenvalues.size() << std::endl;
+            throw std::runtime_error(s.str());
+        }
+        m_Components = componentsMarchenkoPastur(minComponents, maxComponents);
+        return project(dataset, m_Components, columnMean(dataset));
+    }
+
+    // Mean curve of a dataset (mean of every time point over the samples), accumulated in double precision
+    static Eigen::RowVectorXf columnMean(const Eigen::MatrixXf &dataset)
+    {
+        Eigen::RowVectorXf mean(dataset.cols());
+        for (Eigen::Index t = 0; t < dataset.cols(); ++t)
+            mean(t) = (dataset.rows() > 0) ? (float) (dataset.col(t).cast<double>().sum() / dataset.rows()) : 0.0f;
+        return mean;
+    }
+
+    // Reconstruct the dataset from its projection onto the first k components, around the mean curve of the fit
+    Eigen::MatrixXf project(const Eigen::MatrixXf &dataset, unsigned int k) const
+    {
+        return project(dataset, k, (m_Sum / m_Samples).transpose().cast<float>());
+    }
+
+    /*
+     * Same around another mean curve: a dataset that was not part of the fit
+     * (a precomputed basis) is centred on its own mean, otherwise the part of
+     * it outside the kept components would be replaced by the mean of the fit.
+     */
+    Eigen::MatrixXf project(const Eigen::MatrixXf &dataset, unsigned int k, const Eigen::RowVectorXf &mean) const
+    {
+        const Eigen::MatrixXf basis = m_Eigenvectors.leftCols(k).cast<float>();
+        const Eigen::MatrixXf projection = basis * basis.transpose();
+        const Eigen::RowVectorXf offset = mean - mean * projection;
+        Eigen::MatrixXf reconstruction(dataset.rows(), dataset.cols());
+        reconstruction.noalias() = dataset * projection;
+        reconstruction.rowwise() += offset;
+        return reconstruction;
+    }
+
+    /*
+     * Reconstruct volumes left out of the fit (columns of volumes, over the
+     * same voxels as the fitted dataset): the least squares projection of each
+     * one onto the spatial maps of the first k components of the dataset,
+     * around the given mean of every volume (the maps have zero mean, so the
+     * volume's own mean is discarded).
+     */
+    Eigen::MatrixXf projectVolumes(const Eigen::MatrixXf &dataset, const Eigen::MatrixXf &volumes, const Eigen::RowVectorXf &volumesMean, unsigned int k) const
+    {
+        const Eigen::MatrixXf basis = m_Eigenvectors.leftCols(k).cast<float>();
+        const Eigen::RowVectorXf mean = (m_Sum / m_Samples).transpose().cast<float>();
+        // Spatial maps of the components (voxels x k)
+        Eigen::MatrixXf maps(dataset.rows(), k);
+        maps.noalias() = dataset * basis;
+        maps.rowwise() -= mean * basis;
+        const Eigen::MatrixXd gram = (maps.transpose() * maps).cast<double>();
+        const Eigen::MatrixXd coefficients = gram.ldlt().solve((maps.transpose() * volumes).cast<double>());
+        Eigen::MatrixXf reconstruction(volumes.rows(), volumes.cols());
+        reconstruction.noalias() = maps * coefficients.cast<float>();
+        reconstruction.rowwise() += volumesMean;
+        return reconstruction;
+    }
+
+    unsigned int componentsVarianceExplained(double variance, unsigned int minComponents, unsigned int maxComponents) const
+    {
+        const double total = m_Eigenvalues.sum();
+        unsigned int k = 0;
+        double explained = 0;
+        while (k < m_Eigenvalues.size() && (total <= 0 || explained / total < variance))
+            explained += m_Eigenvalues(k++);
+        k = std::max(k, minComponents);
+        k = std::min(k, maxComponents);
+        return std::max(1u, std::min(k, (unsigned int) m_Eigenvalues.size()));
+    }
+
+    /*
+     * Rank selection from the eigenvalue spectrum already computed (Veraart et al., 2016).
+     * The first p for which the noise variance estimated from the spread of the remaining
+     * eigenvalues falls below their mean is taken as the signal rank, and that mean is the
+     * estimated noise variance.
+     */
+    unsigned int componentsMarchenkoPastur(unsigned int minComponents, unsigned int maxComponents)
+    {
+        const unsigned int N = m_Eigenvalues.size();
+        unsigned int k = N - 1;
+        double tail = m_Eigenvalues.sum();
+        m_NoiseSigma = std::sqrt(m_Eigenvalues(N - 1));
+        for (unsigned int p = 0; p < N; ++p)
+        {
+            const double gamma = (N - p) / m_Samples;
+            const double sigmaMean = tail / (N - p);
+            const double sigmaRange = (m_Eigenvalues(p) - m_Eigenvalues(N - 1)) / (4 * std::sqrt(gamma));
+            if (sigmaRange < sigmaMean)
+            {
+                k = p;
+                m_NoiseSigma = std::sqrt(sigmaMean);
+                break;
+            }
+            tail -= m_Eigenvalues(p);
+        }
+        k = std::max(k, minComponents);
+        k = std::min(k, maxComponents);
+        return std::max(1u, std::min(k, N));
+    }
+
+    void save(const std::string &fileName) const
+    {
+        if (m_Eigenvalues.size() != m_Sum.size())
+            throw std::runtime_error("Temporal basis must be fitted before saving it");
+        std::ofstream file(fileName.c_str(), std::ios::binary);
+        if (!file)
+            throw std::runtime_error("Unable to write temporal basis: " + fileName);
+        const std::uint32_t dimensions = m_Sum.size();
+        file.write(magic(), 8);
+        file.write(reinterpret_cast<const char *>(&dimensions), sizeof(dimensions));
+        file.write(reinterpret_cast<const char *>(&m_Samples), sizeof(m_Samples));
+        file.write(reinterpret_cast<const char *>(m_Sum.data()), sizeof(double) * m_Sum.size());
+        file.write(reinterpret_cast<const char *>(m_Shift.data()), sizeof(double) * m_Shift.size());
+        file.write(reinterpret_cast<const char *>(m_Scatter.data()), sizeof(double) * m_Scatter.size());
+        file.write(reinterpret_cast<const char *>(m_Eigenvalues.data()), sizeof(double) * m_Eigenvalues.size());
+        file.write(reinterpret_cast<const char *>(m_Eigenvectors.data()), sizeof(double) * m_Eigenvectors.size());
+        if (!file)
+            throw std::runtime_error("Unable to write temporal basis: " + fileName);
+    }
+
+    void load(const std::string &fileName)
+    {
+        std::ifstream file(fileName.c_str(), std::ios::binary);
+        char header[8];
+        std::uint32_t dimensions = 0;
+        file.read(header, sizeof(header));
+        // Version 1 files hold the scatter around zero
+        const bool shifted = file && std::equal(header, header + sizeof(header), magic());
+        if (!file || (!shifted && !std::equal(header, header + sizeof(header), "ONTSPCA1")))
+            throw std::runtime_error("Invalid temporal basis file: " + fileName);
+        file.read(reinterpret_cast<char *>(&dimensions), sizeof(dimensions));
+        file.read(reinterpret_cast<char *>(&m_Samples), sizeof(m_Samples));
+        m_Sum.resize(dimensions);
+        m_Shift = Eigen::VectorXd::Zero(dimensions);
+        m_Scatter.resize(dimensions, dimensions);
+        m_Eigenvalues.resize(dimensions);
+        m_Eigenvectors.resize(dimensions, dimensions);
+        file.read(reinterpret_cast<char *>(m_Sum.data()), sizeof(double) * m_Sum.size());
+        if (shifted)
+            file.read(reinterpret_cast<char *>(m_Shift.data()), sizeof(double) * m_Shift.size());
+        file.read(reinterpret_cast<char *>(m_Scatter.data()), sizeof(double) * m_Scatter.size());
+        file.read(reinterpret_cast<char *>(m_Eigenvalues.data()), sizeof(double) * m_Eigenvalues.size());
+        file.read(reinterpret_cast<char *>(m_Eigenvectors.data()), sizeof(double) * m_Eigenvectors.size());
+        if (!file)
+            throw std::runtime_error("Truncated temporal basis file: " + fileName);
+    }
+
+    unsigned int components() const
+    {
+        return m_Components;
+    }
+
+    // Noise standard deviation estimated by the last Marchenko-Pastur rank selection
+    double noiseSigma() const
+    {
+        return m_NoiseSigma;
+    }
+
+    unsigned int dimensions() const
+    {
+        return m_Sum.size();
+    }
+
+    double samples() const
+    {
+        return m_Samples;
+    }
+
+    const Eigen::VectorXd &eigenvalues() const
+    {
+        return m_Eigenvalues;
+    }
+
+    const Eigen::MatrixXd &eigenvectors() const
+    {
+        return m_Eigenvectors;
+    }
+
+private:
+    static const char *magic()
+    {
+        return "ONTSPCA2";
+    }
+
+    Precision m_Precision;
+    double m_Samples;
+    unsigned int m_Components;
+    double m_NoiseSigma;
+    Eigen::VectorXd m_Sum;
+    Eigen::VectorXd m_Shift;
+    Eigen::MatrixXd m_Scatter;
+    Eigen::VectorXd m_Eigenvalues;
+    Eigen::MatrixXd m_Eigenvectors;
+};
+
+#endif
@@ -0,0 +1,85 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Outlier volumes of synthetic DSC-PWI series                              *
+***************************************************************************/
+
+#include <GlobalPCADenoising.hpp>
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Gamma variate concentration curve (peak 1 at t0 + alpha * beta)
+double GammaVariate(double t, double t0, double alpha, double beta)
+{
+    const double x = std::max(0.0, t - t0);
+    return std::pow(x / (alpha * beta), alpha) * std::exp(alpha - x / beta);
+}
+
+
+/*
+ * DSC-PWI series (voxels x time points): a bolus with recirculation lowering
+ * the signal of every voxel by a random fraction, a slow drift and 2% noise.
+ * Spikes are either noise (10% of the baseline) or a 3% intensity scaling of
+ * the whole volume.
+ */
+Eigen::MatrixXf Series(std::mt19937 &generator, const std::vector<long> &noiseSpikes, const std::vector<long> &scaledVolumes)
+{
+    const long voxels = 20000;
+    const long timePoints = 60;
+    std::normal_distribution<float> normal(0, 1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    Eigen::MatrixXf data(voxels, timePoints);
+    for (long v = 0; v < voxels; ++v)
+    {
+        const float baseline = 500 + 1000 * uniform(generator);
+        const float amplitude = 0.6f * (0.1f + 0.9f * uniform(generator));
+        for (long t = 0; t < timePoints; ++t)
+        {
+            const double concentration = GammaVariate(t, 15, 3, 1.5) + 0.15 * GammaVariate(t, 26, 3, 2);
+            data(v, t) = baseline * std::exp(-amplitude * concentration) * (1 + 0.002 * t) + 0.02f * baseline * normal(generator);
+        }
+        for (long t : noiseSpikes)
+            data(v, t) += 0.1f * baseline * normal(generator);
+        for (long t : scaledVolumes)
+            data(v, t) *= 1.03f;
+    }
+    return data;
+}
+
+
+bool Check(const std::string &name, const std::vector<Eigen::Index> &outliers, const std::vector<Eigen::Index> &expected)
+{
+    if (outliers == expected)
+        return true;
+    std::cerr << name << ": flagged";
+    for (Eigen::Index t : outliers)
+        std::cerr << " " << t;
+    std::cerr << ", expected";
+    for (Eigen::Index t : expected)
+        std::cerr << " " << t;
+    std::cerr << std::endl;
+    return false;
+}
+
+
+int main()
+{
+    std::mt19937 generator(2020);
+    Eigen::VectorXd intensityZ, dvarsZ;
+    bool passed = true;
+    // The bolus is signal, not an outlier
+    for (int run = 0; run < 10; ++run)
+        passed &= Check("Clean bolus series", OutlierVolumes(Series(generator, {}, {}), 3, intensityZ, dvarsZ), {});
+    // Spikes before and during the bolus and a scaled volume, but not the volumes after them
+    passed &= Check("Series with spikes", OutlierVolumes(Series(generator, {8, 17}, {0, 40}), 3, intensityZ, dvarsZ), {0, 8, 17, 40});
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
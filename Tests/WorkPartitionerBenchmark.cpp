@@ -0,0 +1,136 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Thread scaling of the partitioned 4D passes                              *
+***************************************************************************/
+
+#include <CommandLineOptions.hpp>
+#include <GlobalPCADenoising.hpp>
+#include <WorkPartitioner.hpp>
+#include <Eigen/Dense>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+#include <omp.h>
+
+// Seconds taken by the best of some repetitions of a pass
+template<typename Function>
+double Seconds(int repetitions, Function function)
+{
+    double best = 0;
+    for (int r = 0; r < repetitions; ++r)
+    {
+        const std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        function();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        best = (r == 0) ? seconds : std::min(best, seconds);
+    }
+    return best;
+}
+
+
+/*
+ * Times the passes of the tools at 1, 2, 4, ... threads up to the OpenMP
+ * maximum: the truncation of a 4D series (TruncateNegatives, a first-touched
+ * output written by time points), the data matrix of GlobalPCADenoising
+ * (MaskedDataset) and CorrectNegativeCurves on it. Every allocation is timed
+ * with its pass, so first touch is part of the measure. The results of every
+ * thread count must match the single thread ones, so the test fails on a
+ * partition that drops or repeats work.
+ */
+int main(int argc, char *argv[])
+{
+    CommandLineOptions options(argc, argv);
+    if (options.Has("help"))
+    {
+        std::cerr << "Usage: WorkPartitionerBenchmark [voxels=524288] [timePoints=60] [repetitions=3] [--pin]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const long long voxels = (argc > 1) ? std::atoll(argv[1]) : 524288;
+    const long long timePoints = (argc > 2) ? std::atoll(argv[2]) : 60;
+    const int repetitions = (argc > 3) ? std::atoi(argv[3]) : 3;
+    if (options.Has("pin"))
+        WorkPartitioner::PinThreads();
+    // Series with negative values and a mask of two thirds of the voxels
+    std::mt19937 generator(2020);
+    std::normal_distribution<float> normal(100, 50);
+    std::vector<float> series(voxels * timePoints);
+    for (std::size_t i = 0; i < series.size(); ++i)
+        series[i] = normal(generator);
+    std::vector<unsigned char> mask(voxels);
+    for (long long v = 0; v < voxels; ++v)
+        mask[v] = (v % 3) != 0;
+    const long long sliceLength = std::max(1LL, voxels / 32);
+    const int maximumThreads = omp_get_max_threads();
+    std::vector<float> truncatedReference;
+    Eigen::MatrixXf correctedReference;
+    double truncateBase = 0, datasetBase = 0, correctBase = 0;
+    bool identical = true;
+    std::cout << std::setw(8) << "threads" << std::setw(14) << "truncate" << std::setw(10) << "speedup" << std::setw(14) << "dataset" << std::setw(10) << "speedup" << std::setw(14) << "correct" << std::setw(10) << "speedup" << std::endl;
+    for (int threads = 1; ; threads = std::min(2 * threads, maximumThreads))
+    {
+        omp_set_num_threads(threads);
+        std::unique_ptr<float[]> truncated;
+        const double truncateSeconds = Seconds(repetitions, [&]()
+        {
+            truncated.reset(new float[voxels * timePoints]);
+            WorkPartitioner::ParallelFor(voxels * timePoints, (timePoints >= threads) ? voxels : sliceLength, [&](long long begin, long long end)
+            {
+                for (long long i = begin; i < end; ++i)
+                    truncated[i] = std::max(series[i], 0.0f);
+            });
+        });
+        Eigen::MatrixXf dataset;
+        const double datasetSeconds = Seconds(repetitions, [&]()
+        {
+            dataset = MaskedDataset(series.data(), mask.data(), voxels, timePoints);
+        });
+        Eigen::MatrixXf corrected;
+        const double correctSeconds = Seconds(repetitions, [&]()
+        {
+            corrected = dataset;
+            CorrectNegativeCurves(corrected);
+        });
+        if (threads == 1)
+        {
+            // The data matrix holds the masked voxels in buffer order
+            Eigen::Index row = 0;
+            for (long long v = 0; v < voxels; ++v)
+                if (mask[v])
+                {
+                    for (long long t = 0; t < timePoints; ++t)
+                        identical = identical && dataset(row, t) == series[t * voxels + v];
+                    ++row;
+                }
+            identical = identical && row == dataset.rows();
+            truncatedReference.assign(truncated.get(), truncated.get() + voxels * timePoints);
+            correctedReference = corrected;
+            truncateBase = truncateSeconds;
+            datasetBase = datasetSeconds;
+            correctBase = correctSeconds;
+        }
+        else
+            identical = identical && std::equal(truncatedReference.begin(), truncatedReference.end(), truncated.get()) && corrected == correctedReference;
+        std::cout << std::fixed << std::setprecision(4) << std::setw(8) << threads
+                  << std::setw(14) << truncateSeconds << std::setw(10) << std::setprecision(2) << truncateBase / truncateSeconds
+                  << std::setw(14) << std::setprecision(4) << datasetSeconds << std::setw(10) << std::setprecision(2) << datasetBase / datasetSeconds
+                  << std::setw(14) << std::setprecision(4) << correctSeconds << std::setw(10) << std::setprecision(2) << correctBase / correctSeconds << std::endl;
+        if (threads == maximumThreads)
+            break;
+    }
+    if (!identical)
+    {
+        std::cerr << "The results are wrong or depend on the number of threads" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
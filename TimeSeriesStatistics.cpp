@@ -0,0 +1,221 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Time Series Statistics (mean, std, tSNR, AUC, peak, time to peak)        *
+***************************************************************************/
+
+#include <cstdlib>
+#include <ITKUtils.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <ImageTypes.hpp>
+#include <MaskImage.hpp>
+#include <MemoryBudget.hpp>
+#include <NIfTIUtils.hpp>
+#include <TimeSeriesStatistics.hpp>
+#include <WorkPartitioner.hpp>
+#include <itkImage.h>
+
+typedef itk::Image<float, 4> ImageType;
+typedef itk::Image<float, 3> VolumeType;
+typedef itk::Image<unsigned char, 3> MaskType;
+
+
+// File name of a statistic map
+std::string StatisticFileName(const std::string &outputPrefix, int statistic)
+{
+    return outputPrefix + "_" + TemporalStatistics::Name(statistic) + ".nii.gz";
+}
+
+
+void TimeSeriesStatistics(int argc, char *argv[], const CommandLineOptions &options, bool stream, Profiler &profiler)
+{
+    const std::string fileName(argv[1]);
+    // Read the geometry, and the whole series unless it is streamed (in slabs of
+    // one volume, or of one time block of a chunked image)
+    profiler.Start("read");
+    const long long slab = stream ? NIfTIUtils::ChunkedTimeBlock(fileName) : 0;
+    ImageType::Pointer image;
+    ImageType::RegionType region;
+    if (stream)
+    {
+        typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(fileName);
+        ImageType::SizeType size;
+        for (unsigned int i = 0; i < 4; ++i)
+            size[i] = imageIO->GetDimensions(i);
+        ImageType::IndexType index;
+        index.Fill(0);
+        region.SetIndex(index);
+        region.SetSize(size);
+        // First slab, also the reference of the output geometry
+        ImageType::RegionType first = region;
+        first.SetSize(3, std::min<long long>(slab, (long long) size[3]));
+        image = NIfTIUtils::ReadNIfTIImageRegion<ImageType>(fileName, first);
+    }
+    else
+    {
+        image = NIfTIUtils::IsChunkedImage(fileName) ? NIfTIUtils::ReadImage<ImageType>(fileName) : ITKUtils::ReadNIfTIImage<ImageType>(fileName);
+        region = image->GetLargestPossibleRegion();
+    }
+    const ImageType::SizeType size = region.GetSize();
+    const long long voxels = (long long) size[0] * size[1] * size[2];
+    const long long timePoints = (long long) size[3];
+    // Read mask (a 3D mask is broadcast to every time point, a mask on another grid is resampled as in MaskImage)
+    MaskType::Pointer mask;
+    const MaskType::PixelType *maskBuffer = NULL;
+    if (argc > 3)
+    {
+        mask = ITKUtils::ReadNIfTIImage<MaskType>(std::string(argv[3]));
+        if (!SameGrid<ImageType, MaskType>(image, mask))
+            mask = ResampleMask<ImageType, MaskType>(image, mask);
+        maskBuffer = mask->GetBufferPointer();
+    }
+    // Accumulate the series one volume at a time
+    profiler.Start("compute");
+    profiler.SetVoxels(voxels * timePoints);
+    const double timeStep = (image->GetSpacing()[3] > 0) ? image->GetSpacing()[3] : 1.0;
+    TemporalStatistics statistics(voxels, (long long) size[0] * size[1], timeStep, options.Get("stats", "mean,std,tsnr,auc,peak,ttp"));
+    for (long long t = 0; t < timePoints; ++t)
+    {
+        if (stream && t > 0 && t % slab == 0)
+        {
+            profiler.Start("read");
+            ImageType::RegionType volumes = region;
+            volumes.SetIndex(3, t);
+            volumes.SetSize(3, std::min(slab, timePoints - t));
+            image = NIfTIUtils::ReadNIfTIImageRegion<ImageType>(fileName, volumes);
+            profiler.Start("compute");
+        }
+        statistics.Add(image->GetBufferPointer() + (stream ? t % slab : t) * voxels, maskBuffer);
+    }
+    // Output geometry: the spatial part of the series
+    VolumeType::Pointer output = VolumeType::New();
+    VolumeType::SizeType outputSize;
+    VolumeType::SpacingType spacing;
+    VolumeType::PointType origin;
+    VolumeType::DirectionType direction;
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        outputSize[i] = size[i];
+        spacing[i] = image->GetSpacing()[i];
+        origin[i] = image->GetOrigin()[i];
+        for (unsigned int j = 0; j < 3; ++j)
+            direction(i, j) = image->GetDirection()(i, j);
+    }
+    output->SetRegions(outputSize);
+    output->SetSpacing(spacing);
+    output->SetOrigin(origin);
+    output->SetDirection(direction);
+    output->Allocate();
+    // Save one map per statistic
+    for (int s = 0; s < TemporalStatistics::NumberOfStatistics; ++s)
+    {
+        if (!statistics.Enabled(s))
+            continue;
+        profiler.Start("compute");
+        statistics.Get(s, output->GetBufferPointer());
+        profiler.Start("write");
+        ITKUtils::WriteNIfTIImage<VolumeType>(output, StatisticFileName(std::string(argv[2]), s));
+    }
+    profiler.Stop();
+}
+
+
+int main(int argc, char *argv[])
+{
+    CommandLineOptions options(argc, argv);
+    if (argc < 3 || argc > 4)
+    {
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: TimeSeriesStatistics inputImage outputPrefix [maskImage] [--stats=mean,std,tsnr,auc,peak,ttp] [--stream] [--max-memory=size] [--pin] [--cache=directory] [--profile=json|text]" << std::endl;
+        std::cerr << "Writes outputPrefix_<statistic>.nii.gz for every statistic (auc and ttp in the time units of the series)" << std::endl;
+        std::cerr << "maskImage:\t3D mask applied to every time point, resampled to the image grid (nearest neighbour) when it is on another grid" << std::endl;
+        std::cerr << "--stream:\tread one time point (one time block of a chunked image) at a time, memory stays at a few volumes" << std::endl;
+        std::cerr << "--max-memory:\tmemory budget (e.g. 4G), streams when the whole series does not fit" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
+    const unsigned int ImageDimension = imageIO->GetNumberOfDimensions();
+
+    Profiler profiler("TimeSeriesStatistics", options.Get("profile"));
+    profiler.SetImageInformation(imageIO);
+    profiler.AddInput(std::string(argv[1]));
+    if (argc > 3)
+        profiler.AddInput(std::string(argv[3]));
+    ResultCache cache(options.Get("cache"), "TimeSeriesStatistics");
+    if (options.Has("pin"))
+        WorkPartitioner::PinThreads();
+
+    if (ImageDimension != 4)
+    {
+        std::cerr << "Unsupported image dimensions" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Statistics skip the voxels outside the mask at every time point, so the mask cannot change over time
+    if (argc > 3 && ITKUtils::ReadImageInformation(std::string(argv[3]))->GetNumberOfDimensions() != 3)
+    {
+        std::cerr << "The mask must be 3D (mask a series with a 4D mask with MaskImage first)" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        cache.AddInput(std::string(argv[1]));
+        if (NIfTIUtils::IsChunkedImage(std::string(argv[1])))
+            cache.AddInput(NIfTIUtils::ChunksFileName(std::string(argv[1])));
+        if (argc > 3)
+            cache.AddInput(std::string(argv[3]));
+        cache.AddOptions(options);
+        TemporalStatistics selection(0, 1, 1.0, options.Get("stats", "mean,std,tsnr,auc,peak,ttp"));
+        for (int s = 0; s < TemporalStatistics::NumberOfStatistics; ++s)
+            if (selection.Enabled(s))
+                cache.AddOutput(StatisticFileName(std::string(argv[2]), s));
+        if (cache.Fetch())
+        {
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        // Peak memory: the series (or a slab when streamed), the mask, the accumulators (6 per voxel) and an output map
+        const MemoryBudget budget(options.Get("max-memory"));
+        const unsigned long long slabBytes = MemoryBudget::VolumeBytes(imageIO, sizeof(float)) * NIfTIUtils::ChunkedTimeBlock(std::string(argv[1]));
+        const unsigned long long volumeBytes = MemoryBudget::VolumeBytes(imageIO, sizeof(float));
+        const unsigned long long residentBytes = MemoryBudget::VolumeBytes(imageIO, sizeof(unsigned char)) + 12 * volumeBytes + volumeBytes;
+        const unsigned long long inMemoryBytes = MemoryBudget::ImageBytes(imageIO, sizeof(float)) + residentBytes;
+        const bool stream = options.Has("stream") || !budget.Fits(inMemoryBytes);
+        if (stream)
+            budget.Require(residentBytes + slabBytes, "TimeSeriesStatistics");
+        const std::string plan = stream ? (slabBytes > volumeBytes ? "streamed one time block at a time" : "streamed one time point at a time") : "in memory";
+        budget.Report(plan, stream ? residentBytes + slabBytes : inMemoryBytes);
+        profiler.SetMemoryPlan(plan, stream ? residentBytes + slabBytes : inMemoryBytes);
+        TimeSeriesStatistics(argc, argv, options, stream, profiler);
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
+    }
+    catch (itk::ExceptionObject & err)
+    {
+        std::cerr << "ExceptionObject caught !" << std::endl;
+        std::cerr << err << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Voxel-wise temporal statistics                                           *
+***************************************************************************/
+
+#ifndef TIMESERIESSTATISTICS_HPP
+#define TIMESERIESSTATISTICS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <WorkPartitioner.hpp>
+
+/*
+ * Accumulates per-voxel temporal statistics one volume at a time, so a
+ * series can be streamed and only the accumulators (a few volumes) are kept
+ * in memory. Mean and variance use Welford's update, which stays accurate
+ * for long series with a large baseline. The area under the curve uses the
+ * trapezoidal rule with the time step of the series. Every thread always
+ * updates the same slabs of voxels (WorkPartitioner) across volumes.
+ */
+class TemporalStatistics
+{
+public:
+    enum Statistic {Mean, Std, TSNR, AUC, Peak, TTP, NumberOfStatistics};
+
+    TemporalStatistics(long long voxels, long long sliceLength, double timeStep, const std::string &statistics = "mean,std,tsnr,auc,peak,ttp") :
+        m_Voxels(voxels), m_SliceLength(sliceLength), m_TimeStep(timeStep), m_TimePoints(0), m_Enabled(NumberOfStatistics, false)
+    {
+        std::istringstream list(statistics);
+        std::string name;
+        while (std::getline(list, name, ','))
+        {
+            const int statistic = Find(name);
+            if (statistic < 0)
+                throw std::runtime_error("Unknown statistic: " + name);
+            m_Enabled[statistic] = true;
+        }
+        // Only the accumulators of the requested statistics are allocated
+        if (m_Enabled[Mean] || m_Enabled[Std] || m_Enabled[TSNR])
+            m_Mean.assign(voxels, 0.0);
+        if (m_Enabled[Std] || m_Enabled[TSNR])
+            m_M2.assign(voxels, 0.0);
+        if (m_Enabled[AUC])
+        {
+            m_AUC.assign(voxels, 0.0);
+            m_Previous.assign(voxels, 0.0);
+        }
+        if (m_Enabled[Peak] || m_Enabled[TTP])
+        {
+            m_Peak.assign(voxels, 0.0);
+            m_PeakTime.assign(voxels, 0);
+        }
+    }
+
+    static const char *Name(int statistic)
+    {
+        static const char *names[] = {"mean", "std", "tsnr", "auc", "peak", "ttp"};
+        return names[statistic];
+    }
+
+    bool Enabled(int statistic) const
+    {
+        return m_Enabled[statistic];
+    }
+
+    // Add the next volume of the series, voxels outside the mask (if any) are skipped
+    template<typename PixelType, typename MaskPixelType>
+    void Add(const PixelType *volume, const MaskPixelType *mask)
+    {
+        const long long t = m_TimePoints++;
+        const double n = (double) (t + 1);
+        const double halfStep = 0.5 * m_TimeStep;
+        double *mean = m_Mean.empty() ? NULL : m_Mean.data();
+        double *m2 = m_M2.empty() ? NULL : m_M2.data();
+        double *auc = m_AUC.empty() ? NULL : m_AUC.data();
+        double *previous = m_Previous.empty() ? NULL : m_Previous.data();
+        double *peak = m_Peak.empty() ? NULL : m_Peak.data();
+        long long *peakTime = m_PeakTime.empty() ? NULL : m_PeakTime.data();
+        WorkPartitioner::ParallelFor(m_Voxels, m_SliceLength, [&](long long begin, long long end)
+        {
+            for (long long i = begin; i < end; ++i)
+            {
+                if (mask != NULL && !mask[i])
+                    continue;
+                const double value = (double) volume[i];
+                if (mean != NULL)
+                {
+                    const double delta = value - mean[i];
+                    mean[i] += delta / n;
+                    if (m2 != NULL)
+                        m2[i] += delta * (value - mean[i]);
+                }
+                if (auc != NULL)
+                {
+                    if (t > 0)
+                        auc[i] += halfStep * (previous[i] + value);
+                    previous[i] = value;
+                }
+                if (peak != NULL && (t == 0 || value > peak[i]))
+                {
+                    peak[i] = value;
+                    peakTime[i] = t;
+                }
+            }
+        });
+    }
+
+    // Final value of a statistic for every voxel
+    template<typename PixelType>
+    void Get(int statistic, PixelType *output) const
+    {
+        if (!m_Enabled[statistic])
+            throw std::runtime_error(std::string("Statistic not computed: ") + Name(statistic));
+        const double degrees = (double) std::max(1LL, m_TimePoints - 1);
+        #pragma omp parallel for
+        for (long long i = 0; i < m_Voxels; ++i)
+        {
+            double value = 0;
+            switch (statistic)
+            {
+                case Mean: value = m_Mean[i]; break;
+                case Std: value = std::sqrt(m_M2[i] / degrees); break;
+                case TSNR:
+                {
+                    const double deviation = std::sqrt(m_M2[i] / degrees);
+                    value = (deviation > 0) ? m_Mean[i] / deviation : 0;
+                    break;
+                }
+                case AUC: value = m_AUC[i]; break;
+                case Peak: value = m_Peak[i]; break;
+                case TTP: value = m_PeakTime[i] * m_TimeStep; break;
+            }
+            output[i] = (PixelType) value;
+        }
+    }
+
+    long long TimePoints() const
+    {
+        return m_TimePoints;
+    }
+
+private:
+    static int Find(const std::string &name)
+    {
+        for (int statistic = 0; statistic < NumberOfStatistics; ++statistic)
+            if (name == Name(statistic))
+                return statistic;
+        return -1;
+    }
+
+    long long m_Voxels;
+    long long m_SliceLength;
+    double m_TimeStep;
+    long long m_TimePoints;
+    std::vector<bool> m_Enabled;
+    std::vector<double> m_Mean;
+    std::vector<double> m_M2;
+    std::vector<double> m_AUC;
+    std::vector<double> m_Previous;
+    std::vector<double> m_Peak;
+    std::vector<long long> m_PeakTime;
+};
+
+#endif
@@ -10,89 +10,119 @@
 
 #include <cstdlib>
 #include <ITKUtils.hpp>
+#include <CommandLineOptions.hpp>
+#include <Profiler.hpp>
+#include <ResultCache.hpp>
+#include <Dispatch.hpp>
+#include <NIfTIUtils.hpp>
+#include <WorkPartitioner.hpp>
 #include <itkImage.h>
-#include <itkImageRegionIterator.h>
-#include <itkImageRegionIteratorWithIndex.h>
+#include <itkVectorImage.h>
+
+
+// Vector images are written through niftilib, keeping the TR of the input
+template<typename ImageType>
+void WriteOutput(const ImageType *image, char *argv [])
+{
+    if (image->GetNumberOfComponentsPerPixel() > 1)
+        NIfTIUtils::WriteNIfTIImage<ImageType>(image, std::string(argv[2]), NIfTIUtils::ReadTimeStep(std::string(argv[1])));
+    else
+        ITKUtils::WriteNIfTIImage<ImageType>(image, std::string(argv[2]));
+}
 
 
 template<typename ImageType, typename MaskType>
-void TruncateNegativesMask(int argc, char *argv [])
+void TruncateNegativesMask(int argc, char *argv [], Profiler &profiler)
 {
-    // Image dimensions
-    const unsigned int ImageDimension = ImageType::ImageDimension;
-    const unsigned int MaskDimension = MaskType::ImageDimension;
+    typedef typename ImageType::InternalPixelType PixelType;
+    typedef typename MaskType::PixelType MaskPixelType;
     // Read image
+    profiler.Start("read");
     typename ImageType::Pointer image = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
     // Truncate value
-    const typename ImageType::PixelType truncateValue = (typename ImageType::PixelType) std::atof(argv[3]);
+    const PixelType truncateValue = (PixelType) std::atof(argv[3]);
     // Read mask
     typename MaskType::Pointer mask = ITKUtils::ReadNIfTIImage<MaskType>(std::string(argv[4]));
     // Inside mask truncate value
-    typename ImageType::PixelType truncateValueMask = 0;
+    PixelType truncateValueMask = 0;
     if (argc > 5)
-        truncateValueMask = (typename ImageType::PixelType) std::atof(argv[5]);
+        truncateValueMask = (PixelType) std::atof(argv[5]);
     // Truncate negatives
-    itk::ImageRegionIteratorWithIndex<ImageType> iterator(image, image->GetLargestPossibleRegion());
-    iterator.GoToBegin();
-    while (!iterator.IsAtEnd())
+    profiler.Start("compute");
+    // The mask spans the leading dimensions of the image (a 4D image can be passed with a 3D mask)
+    // and is broadcast to the interleaved components of every voxel of a vector image
+    const typename ImageType::SizeType imageSize = image->GetBufferedRegion().GetSize();
+    const typename MaskType::SizeType maskSize = mask->GetBufferedRegion().GetSize();
+    for (unsigned int i = 0; i < MaskType::ImageDimension; ++i)
+        if (imageSize[i] != maskSize[i])
+            throw std::runtime_error("Image and mask sizes are different");
+    const long long maskVoxels = (long long) mask->GetBufferedRegion().GetNumberOfPixels();
+    const long long components = image->GetNumberOfComponentsPerPixel();
+    PixelType *buffer = image->GetBufferPointer();
+    const MaskPixelType *maskBuffer = mask->GetBufferPointer();
+    WorkPartitioner::ParallelFor((long long) image->GetBufferedRegion().GetNumberOfPixels() * components, WorkPartitioner::UnitLength<ImageType>(image) * components, [&](long long begin, long long end)
     {
-        itk::Index<ImageDimension> imageIndex = iterator.GetIndex();
-        itk::Index<MaskDimension> maskIndex;
-        // Need to do this because I can pass a 4D image and a 3D mask (or a 3D image and a 3D mask, where, therefore, imageIndex = maskIndex)
-        for (int i = 0; i < MaskDimension; ++i)
-            maskIndex[i] = imageIndex[i];
-        const typename ImageType::PixelType imageValue = image->GetPixel(imageIndex);
-        const typename MaskType::PixelType maskValue = mask->GetPixel(maskIndex);
-        if (maskValue)
-        {
-            if (imageValue < 0)
-                iterator.Set(truncateValueMask);
-        }
-        else
-        {
-            if (imageValue < 0)
-                iterator.Set(truncateValue);
-        }
-        ++iterator;
-    }
+        for (long long i = begin; i < end; ++i)
+            if (buffer[i] < 0)
+                buffer[i] = maskBuffer[(i / components) % maskVoxels] ? truncateValueMask : truncateValue;
+    });
     // Save image
-    ITKUtils::WriteNIfTIImage<ImageType>(image, std::string(argv[2]));
+    profiler.Start("write");
+    WriteOutput<ImageType>(image, argv);
+    profiler.Stop();
 }
 
 
 template<typename ImageType>
-void TruncateNegatives(int argc, char *argv [])
+void TruncateNegatives(int argc, char *argv [], Profiler &profiler)
 {
+    typedef typename ImageType::InternalPixelType PixelType;
     // Read image
+    profiler.Start("read");
     typename ImageType::Pointer image = ITKUtils::ReadNIfTIImage<ImageType>(std::string(argv[1]));
     // Truncate value
-    typename ImageType::PixelType truncateValue = 0;
+    PixelType truncateValue = 0;
     if (argc > 3)
-        truncateValue = (typename ImageType::PixelType) std::atof(argv[3]);
-    // Truncate negatives
-    itk::ImageRegionIterator<ImageType> iterator(image, image->GetLargestPossibleRegion());
-    iterator.GoToBegin();
-    while (!iterator.IsAtEnd())
+        truncateValue = (PixelType) std::atof(argv[3]);
+    // Truncate negatives (all the components of a vector image in one pass)
+    profiler.Start("compute");
+    const long long components = image->GetNumberOfComponentsPerPixel();
+    PixelType *buffer = image->GetBufferPointer();
+    WorkPartitioner::ParallelFor((long long) image->GetBufferedRegion().GetNumberOfPixels() * components, WorkPartitioner::UnitLength<ImageType>(image) * components, [&](long long begin, long long end)
     {
-        if (iterator.Get() < 0)
-            iterator.Set(truncateValue);
-        ++iterator;
-    }
+        for (long long i = begin; i < end; ++i)
+            if (buffer[i] < 0)
+                buffer[i] = truncateValue;
+    });
     // Save image
-    ITKUtils::WriteNIfTIImage<ImageType>(image, std::string(argv[2]));
+    profiler.Start("write");
+    WriteOutput<ImageType>(image, argv);
+    profiler.Stop();
 }
 
 
 int main(int argc, char *argv [])
 {
+    CommandLineOptions options(argc, argv);
     if (argc < 3 || argc > 6)
     {
-        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: TruncateNegatives inputImage outputImage [truncateValue=0] [maskImage] [insideMaskTruncateValue=0]" << std::endl;
+        std::cerr << "Error! Invalid number of arguments!" << std::endl << "Usage: TruncateNegatives inputImage outputImage [truncateValue=0] [maskImage] [insideMaskTruncateValue=0] [--pin] [--cache=directory] [--profile=json|text]" << std::endl;
+        std::cerr << "Vector images are truncated component-wise, a 3D mask is applied to every component" << std::endl;
         return EXIT_FAILURE;
     }
 
     typename itk::ImageIOBase::Pointer imageIO = ITKUtils::ReadImageInformation(std::string(argv[1]));
     const unsigned int ImageDimension = imageIO->GetNumberOfDimensions();
+    const unsigned int Components = imageIO->GetNumberOfComponents();
+
+    Profiler profiler("TruncateNegatives", options.Get("profile"));
+    profiler.SetImageInformation(imageIO);
+    profiler.AddInput(std::string(argv[1]));
+    if (argc > 4)
+        profiler.AddInput(std::string(argv[4]));
+    ResultCache cache(options.Get("cache"), "TruncateNegatives");
+    if (options.Has("pin"))
+        WorkPartitioner::PinThreads();
 
     if (ImageDimension < 2 || ImageDimension > 4)
     {
@@ -102,21 +132,41 @@ int main(int argc, char *argv [])
 
     try
     {
-        if (ImageDimension == 2)
-            if (argc > 4)
-                TruncateNegativesMask<itk::Image<double, 2>, itk::Image<unsigned char, 2>>(argc, argv);
-            else
-                TruncateNegatives<itk::Image<double, 2>>(argc, argv);
-        else if (ImageDimension == 3)
-            if (argc > 4)
-                TruncateNegativesMask<itk::Image<double, 3>, itk::Image<unsigned char, 3>>(argc, argv);
-            else
-                TruncateNegatives<itk::Image<double, 3>>(argc, argv);
-        else
-            if (argc > 4)
-                TruncateNegativesMask<itk::Image<double, 4>, itk::Image<unsigned char, 3>>(argc, argv);
+        // Reuse the result of a previous run with the same inputs and parameters
+        profiler.Start("cache");
+        cache.AddInput(std::string(argv[1]));
+        if (argc > 4)
+            cache.AddInput(std::string(argv[4]));
+        cache.AddParameter(argc > 3 ? std::string(argv[3]) : "0");
+        cache.AddParameter(argc > 5 ? std::string(argv[5]) : "0");
+        cache.AddOptions(options);
+        cache.AddOutput(std::string(argv[2]));
+        if (cache.Fetch())
+        {
+            profiler.Stop();
+            profiler.Report();
+            return EXIT_SUCCESS;
+        }
+        Dispatch::ByDimension<2, 3, 4>(ImageDimension, [&](auto dimension)
+        {
+            // A 4D image takes a 3D mask
+            const unsigned int Dimension = decltype(dimension)::value;
+            typedef itk::Image<double, Dimension> ImageType;
+            typedef itk::VectorImage<double, Dimension> VectorImageType;
+            typedef itk::Image<unsigned char, (Dimension > 3) ? 3 : Dimension> MaskType;
+            if (argc > 4 && Components > 1)
+                TruncateNegativesMask<VectorImageType, MaskType>(argc, argv, profiler);
+            else if (argc > 4)
+                TruncateNegativesMask<ImageType, MaskType>(argc, argv, profiler);
+            else if (Components > 1)
+                TruncateNegatives<VectorImageType>(argc, argv, profiler);
             else
-                TruncateNegatives<itk::Image<double, 4>>(argc, argv);
+                TruncateNegatives<ImageType>(argc, argv, profiler);
+        });
+        // Keep the result for later runs
+        profiler.Start("cache");
+        cache.Store();
+        profiler.Stop();
     }
     catch (itk::ExceptionObject & err)
     {
@@ -124,6 +174,14 @@ int main(int argc, char *argv [])
         std::cerr << err << std::endl;
         return EXIT_FAILURE;
     }
+    catch (std::exception & err)
+    {
+        std::cerr << "Exception caught !" << std::endl;
+        std::cerr << err.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    profiler.Report();
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
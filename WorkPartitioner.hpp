@@ -0,0 +1,117 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Static partition of image buffers among OpenMP threads                   *
+***************************************************************************/
+
+#ifndef WORKPARTITIONER_HPP
+#define WORKPARTITIONER_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+#include <omp.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+ * Splits an image buffer into contiguous chunks of whole work units (time
+ * points of a 4D series or z slabs) and always gives the same chunk to the
+ * same OpenMP thread. Output images allocated without initialization
+ * (Allocate(false)) and written with ParallelFor are first touched by the
+ * thread that processes each chunk, so on NUMA systems the pages of a chunk
+ * live on the node of the thread that uses them (together with PinThreads(),
+ * which stops the worker threads from migrating between nodes).
+ */
+namespace WorkPartitioner
+{
+    enum Unit {TimePoints, Slabs};
+
+    // Range of units [begin, end) of a thread when the units are split evenly among the threads
+    inline void Range(long long units, int thread, int threads, long long &begin, long long &end)
+    {
+        const long long base = units / threads;
+        const long long extra = units % threads;
+        begin = thread * base + std::min<long long>(thread, extra);
+        end = begin + base + ((thread < extra) ? 1 : 0);
+    }
+
+    // Elements of a work unit: a whole volume of a 4D series or one z slab
+    template<typename ImageType>
+    long long UnitLength(const ImageType *image, Unit unit)
+    {
+        const typename ImageType::SizeType size = image->GetBufferedRegion().GetSize();
+        const unsigned int dimensions = (unit == TimePoints && ImageType::ImageDimension > 3) ? 3 : std::min(2u, ImageType::ImageDimension - 1);
+        long long length = 1;
+        for (unsigned int i = 0; i < dimensions; ++i)
+            length *= size[i];
+        return length;
+    }
+
+    // Split by time points when there are enough of them to keep every thread busy, by z slabs otherwise
+    template<typename ImageType>
+    long long UnitLength(const ImageType *image)
+    {
+        const long long volume = UnitLength<ImageType>(image, TimePoints);
+        const long long timePoints = (long long) image->GetBufferedRegion().GetNumberOfPixels() / std::max(1LL, volume);
+        return UnitLength<ImageType>(image, (timePoints >= omp_get_max_threads()) ? TimePoints : Slabs);
+    }
+
+    // Run function(begin, end) on the chunk of elements of every thread
+    template<typename Function>
+    void ParallelFor(long long elements, long long unitLength, Function function)
+    {
+        const long long units = (elements + unitLength - 1) / std::max(1LL, unitLength);
+        #pragma omp parallel
+        {
+            long long begin, end;
+            Range(units, omp_get_thread_num(), omp_get_num_threads(), begin, end);
+            begin = std::min(elements, begin * unitLength);
+            end = std::min(elements, end * unitLength);
+            if (begin < end)
+                function(begin, end);
+        }
+    }
+
+    /*
+     * Pin the OpenMP worker threads to the CPUs of the process in order, unless
+     * OMP_PROC_BIND already sets a policy. The master thread keeps the affinity
+     * of the process: threads created later from it (ITK's pool, readers and
+     * filters) inherit its mask and would otherwise all run on a single CPU.
+     */
+    inline void PinThreads()
+    {
+#ifdef __linux__
+        if (std::getenv("OMP_PROC_BIND") != NULL)
+            return;
+        cpu_set_t available;
+        CPU_ZERO(&available);
+        if (sched_getaffinity(0, sizeof(available), &available) != 0)
+            return;
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &available))
+                cpus.push_back(cpu);
+        if (cpus.empty())
+            return;
+        #pragma omp parallel
+        {
+            if (omp_get_thread_num() > 0)
+            {
+                cpu_set_t cpu;
+                CPU_ZERO(&cpu);
+                CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &cpu);
+                pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+            }
+        }
+#endif
+    }
+}
+
+#endif
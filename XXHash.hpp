@@ -0,0 +1,153 @@
+/***************************************************************************
+/* Javier Juan Albarracin - jajuaal1@ibime.upv.es                         */
+/* Universidad Politecnica de Valencia, Spain                             */
+/*                                                                        */
+/* Copyright (C) 2020 Javier Juan Albarracin                              */
+/*                                                                        */
+/***************************************************************************
+* Streaming XXH64 hash                                                     *
+***************************************************************************/
+
+#ifndef XXHASH_HPP
+#define XXHASH_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/*
+ * Streaming implementation of the XXH64 non-cryptographic hash
+ * (https://github.com/Cyan4973/xxHash, XXH64 specification).
+ */
+class XXHash64
+{
+public:
+    XXHash64(std::uint64_t seed = 0)
+    {
+        Reset(seed);
+    }
+
+    void Reset(std::uint64_t seed = 0)
+    {
+        m_Accumulators[0] = seed + Prime1 + Prime2;
+        m_Accumulators[1] = seed + Prime2;
+        m_Accumulators[2] = seed;
+        m_Accumulators[3] = seed - Prime1;
+        m_Seed = seed;
+        m_Length = 0;
+        m_Buffered = 0;
+    }
+
+    void Update(const void *data, std::size_t length)
+    {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        const unsigned char *end = p + length;
+        m_Length += length;
+        // Complete the pending stripe
+        if (m_Buffered > 0)
+        {
+            const std::size_t missing = std::min<std::size_t>(32 - m_Buffered, length);
+            std::memcpy(m_Buffer + m_Buffered, p, missing);
+            m_Buffered += missing;
+            p += missing;
+            if (m_Buffered < 32)
+                return;
+            ProcessStripe(m_Buffer);
+            m_Buffered = 0;
+        }
+        // Full stripes
+        while (end - p >= 32)
+        {
+            ProcessStripe(p);
+            p += 32;
+        }
+        // Keep the tail for the next update
+        m_Buffered = end - p;
+        std::memcpy(m_Buffer, p, m_Buffered);
+    }
+
+    void Update(const std::string &value)
+    {
+        Update(value.data(), value.size());
+    }
+
+    std::uint64_t Digest() const
+    {
+        std::uint64_t hash;
+        if (m_Length >= 32)
+        {
+            hash = Rotate(m_Accumulators[0], 1) + Rotate(m_Accumulators[1], 7) + Rotate(m_Accumulators[2], 12) + Rotate(m_Accumulators[3], 18);
+            for (int i = 0; i < 4; ++i)
+                hash = (hash ^ Round(0, m_Accumulators[i])) * Prime1 + Prime4;
+        }
+        else
+            hash = m_Seed + Prime5;
+        hash += m_Length;
+        const unsigned char *p = m_Buffer;
+        std::size_t remaining = m_Buffered;
+        for (; remaining >= 8; p += 8, remaining -= 8)
+            hash = Rotate(hash ^ Round(0, Read64(p)), 27) * Prime1 + Prime4;
+        if (remaining >= 4)
+        {
+            hash = Rotate(hash ^ (Read32(p) * Prime1), 23) * Prime2 + Prime3;
+            p += 4;
+            remaining -= 4;
+        }
+        for (; remaining > 0; ++p, --remaining)
+            hash = Rotate(hash ^ (*p * Prime5), 11) * Prime1;
+        hash ^= hash >> 33;
+        hash *= Prime2;
+        hash ^= hash >> 29;
+        hash *= Prime3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+private:
+    static const std::uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+    static const std::uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static const std::uint64_t Prime3 = 0x165667B19E3779F9ULL;
+    static const std::uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+    static const std::uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+    static std::uint64_t Rotate(std::uint64_t value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    static std::uint64_t Round(std::uint64_t accumulator, std::uint64_t input)
+    {
+        return Rotate(accumulator + input * Prime2, 31) * Prime1;
+    }
+
+    // Little endian reads (the hash is defined over little endian words)
+    static std::uint64_t Read64(const unsigned char *p)
+    {
+        std::uint64_t value = 0;
+        for (int i = 7; i >= 0; --i)
+            value = (value << 8) | p[i];
+        return value;
+    }
+
+    static std::uint64_t Read32(const unsigned char *p)
+    {
+        return (std::uint64_t) p[0] | ((std::uint64_t) p[1] << 8) | ((std::uint64_t) p[2] << 16) | ((std::uint64_t) p[3] << 24);
+    }
+
+    void ProcessStripe(const unsigned char *p)
+    {
+        m_Accumulators[0] = Round(m_Accumulators[0], Read64(p));
+        m_Accumulators[1] = Round(m_Accumulators[1], Read64(p + 8));
+        m_Accumulators[2] = Round(m_Accumulators[2], Read64(p + 16));
+        m_Accumulators[3] = Round(m_Accumulators[3], Read64(p + 24));
+    }
+
+    std::uint64_t m_Accumulators[4];
+    std::uint64_t m_Seed;
+    std::uint64_t m_Length;
+    unsigned char m_Buffer[32];
+    std::size_t m_Buffered;
+};
+
+#endif